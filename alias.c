@@ -0,0 +1,176 @@
+/*
+ * vrctl - node names, groups and rooms
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every alias, group and room is compiled into a node bitset when the rc
+ * file is read, so using one is a hash lookup plus a walk over the set
+ * bits, no matter how the name was built up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "util.h"
+#include "arena.h"
+#include "alias.h"
+
+#define NAMELEN			64
+#define HASH_SIZE		64
+
+struct alias {
+	char			name[NAMELEN];
+	struct nodeset		set;
+	int			is_group;
+	struct alias		*hnext;		/* hash chain */
+	struct alias		*next;		/* definition order */
+};
+
+ARENA_DEFINE(alias_arena, "aliases", sizeof(struct alias), ARENA_ALIASES);
+
+static struct alias *hash[HASH_SIZE];
+static struct alias *alias_head = NULL, *alias_tail = NULL;
+
+/* FNV-1a, case-insensitive */
+static unsigned int hash_name(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *name; name++)
+		h = (h ^ tolower(*name)) * 16777619U;
+	return h % HASH_SIZE;
+}
+
+static struct alias *find(const char *name)
+{
+	struct alias *a;
+
+	for (a = hash[hash_name(name)]; a != NULL; a = a->hnext)
+		if (strcasecmp(a->name, name) == 0)
+			return a;
+	return NULL;
+}
+
+int alias_define(const char *name, const struct nodeset *set, int is_group)
+{
+	struct alias *a = find(name);
+	unsigned int h;
+
+	if (!a) {
+		if (strlen(name) >= NAMELEN)
+			return -1;
+		a = arena_alloc(&alias_arena);
+		if (!a)
+			die("out of memory\n");
+		strcpy(a->name, name);
+		a->is_group = is_group;
+
+		h = hash_name(name);
+		a->hnext = hash[h];
+		hash[h] = a;
+
+		if (alias_tail != NULL)
+			alias_tail->next = a;
+		else
+			alias_head = a;
+		alias_tail = a;
+	}
+	ns_or(&a->set, set);
+	return 0;
+}
+
+const struct nodeset *alias_lookup(const char *name)
+{
+	struct alias *a = find(name);
+
+	return a ? &a->set : NULL;
+}
+
+/* one name or node number */
+static int eval_term(const char *term, struct nodeset *set)
+{
+	const struct nodeset *named;
+	unsigned long id;
+	char *endp;
+
+	ns_clear(set);
+	named = alias_lookup(term);
+	if (named) {
+		*set = *named;
+		return 0;
+	}
+
+	id = strtoul(term, &endp, 10);
+	if (*term == 0 || *endp != 0 || !isdigit(*term) ||
+	    id > VRCTL_MAX_NODEID)
+		return -1;
+	ns_add(set, id);
+	return 0;
+}
+
+int alias_eval(const char *expr, struct nodeset *set)
+{
+	char term[NAMELEN];
+	struct nodeset t;
+	const char *p;
+	int len, too_long, op = '+';
+
+	/* a plain name or number (which may itself contain a '-') */
+	if (eval_term(expr, set) == 0)
+		return 0;
+	if (!strpbrk(expr, "+-,"))
+		return -1;
+
+	ns_clear(set);
+	for (p = expr; ; p++) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		for (len = too_long = 0; *p && !strchr("+-,", *p); p++) {
+			if (len < NAMELEN - 1)
+				term[len++] = *p;
+			else if (*p != ' ' && *p != '\t')
+				too_long = 1;
+		}
+		while (len && (term[len - 1] == ' ' || term[len - 1] == '\t'))
+			len--;
+		term[len] = 0;
+
+		/* a truncated name could match some other alias */
+		if (too_long || eval_term(term, &t) < 0)
+			return -1;
+		if (op == '-')
+			ns_andnot(set, &t);
+		else
+			ns_or(set, &t);
+
+		if (!*p)
+			return 0;
+		op = *p;
+	}
+}
+
+const char *alias_name(int nodeid)
+{
+	struct alias *a;
+
+	for (a = alias_head; a != NULL; a = a->next)
+		if (!a->is_group && ns_has(&a->set, nodeid))
+			return a->name;
+	return NULL;
+}
@@ -0,0 +1,44 @@
+/*
+ * vrctl - node names, groups and rooms
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ALIAS_H_
+#define _ALIAS_H_
+
+#include "nodeset.h"
+
+/*
+ * Add the nodes in set to a name, creating it if necessary.  Names
+ * defined with is_group set are not used when printing node names.
+ * Returns -1 if the name is too long.
+ */
+int alias_define(const char *name, const struct nodeset *set, int is_group);
+
+/* case-insensitive; NULL if not defined */
+const struct nodeset *alias_lookup(const char *name);
+
+/*
+ * Evaluate a node expression: names and node numbers joined by "+" (or
+ * ",") for union and "-" for difference, left to right, e.g.
+ * "downstairs - kitchen + 7".  Returns -1 if it is invalid.
+ */
+int alias_eval(const char *expr, struct nodeset *set);
+
+/* the first plain alias naming nodeid, or NULL */
+const char *alias_name(int nodeid);
+
+#endif /* _ALIAS_H_ */
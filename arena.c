@@ -0,0 +1,99 @@
+/*
+ * vrctl - fixed-size object arenas
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "arena.h"
+
+static struct arena *arenas;
+
+void *arena_alloc_len(struct arena *a, size_t len)
+{
+	void *obj = NULL;
+
+	if (!a->listed) {
+		a->next = arenas;
+		arenas = a;
+		a->listed = 1;
+	}
+
+#ifdef VRCTL_ARENA
+	if (len > a->size) {
+		/* a caller asked for more than the arena was sized for */
+	} else if (a->free_list) {
+		obj = a->free_list;
+		a->free_list = *(void **)obj;
+	} else if (a->carved < a->count) {
+		obj = a->mem + (size_t)a->carved++ * a->size;
+	}
+	if (obj)
+		memset(obj, 0, len);
+	else if (!a->failed)
+		info(L_WARNING, "warning: %s arena exhausted (%d x %zu "
+			"bytes)\n", a->name, a->count, a->size);
+#else
+	obj = calloc(1, len);
+#endif
+
+	if (!obj) {
+		a->failed++;
+		return NULL;
+	}
+	if (++a->used > a->peak)
+		a->peak = a->used;
+	return obj;
+}
+
+void arena_free(struct arena *a, void *obj)
+{
+	if (!obj)
+		return;
+	a->used--;
+#ifdef VRCTL_ARENA
+	*(void **)obj = a->free_list;
+	a->free_list = obj;
+#else
+	free(obj);
+#endif
+}
+
+const struct arena *arena_next(const struct arena *a)
+{
+	return a ? a->next : arenas;
+}
+
+void arena_report(int level)
+{
+	const struct arena *a;
+	size_t peak = 0, reserved = 0;
+
+	for (a = arenas; a; a = a->next) {
+		info(level, "%-12s %6zu bytes  used %4d  peak %4d/%-4d%s\n",
+			a->name, a->size, a->used, a->peak, a->count,
+			a->failed ? "  EXHAUSTED" : "");
+		peak += a->size * a->peak;
+		reserved += a->size * a->count;
+	}
+#ifdef VRCTL_ARENA
+	info(level, "arena peak %zu of %zu bytes reserved\n", peak, reserved);
+#else
+	info(level, "arena peak %zu bytes (heap)\n", peak);
+#endif
+}
@@ -0,0 +1,115 @@
+/*
+ * vrctl - fixed-size object arenas
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include "libvrctl.h"
+
+/*
+ * Everything vrctl keeps around at runtime (connections, aliases, rules,
+ * schedule entries, server clients and requests, link statistics) comes
+ * from a named arena of same-sized objects.
+ *
+ * Normally an arena is just a counter in front of calloc()/free().  When
+ * built with "make ARENA=1" (VRCTL_ARENA), each one is a static array
+ * instead, carved up on demand and recycled through a free list, so a
+ * gateway's memory footprint is fixed at link time and a long-running
+ * server cannot fragment the heap.  An exhausted arena makes the
+ * allocation fail like an out-of-memory calloc() would.  Arena builds are
+ * meant for single-threaded programs like vrctl itself; nothing here is
+ * locked.
+ *
+ * Either way, the arenas record their high-water marks so the capacities
+ * below can be sized from a real installation.  Any of them can be
+ * overridden on the make command line, e.g.
+ * "make ARENA=1 CPPFLAGS=-DARENA_CLIENTS=4".
+ */
+
+#ifndef ARENA_CONNS
+#define ARENA_CONNS		2		/* open VRC0P ports */
+#endif
+#ifndef ARENA_ALIASES
+#define ARENA_ALIASES		(2 * VRCTL_MAX_NODEID)
+#endif
+#ifndef ARENA_RULES
+#define ARENA_RULES		64
+#endif
+#ifndef ARENA_SCHED
+#define ARENA_SCHED		64
+#endif
+#ifndef ARENA_ACTIONS
+#define ARENA_ACTIONS		(2 * VRCTL_MAX_NODEID)	/* per rules/sched */
+#endif
+#ifndef ARENA_CLIENTS
+#define ARENA_CLIENTS		16
+#endif
+#ifndef ARENA_REQS
+#define ARENA_REQS		(2 * VRCTL_MAX_NODEID)	/* server queue */
+#endif
+
+#define ARENA_ALIGN		16
+#define ARENA_ROUND(x)		(((x) + ARENA_ALIGN - 1) & \
+				 ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena {
+	const char		*name;
+	size_t			size;		/* bytes per object */
+	int			count;		/* capacity */
+	char			*mem;		/* VRCTL_ARENA only */
+
+	void			*free_list;
+	int			carved;		/* objects taken from mem */
+	int			used;
+	int			peak;
+	unsigned int		failed;
+	int			listed;
+	struct arena		*next;
+};
+
+/* size is per object; an array can be one object of n elements */
+#ifdef VRCTL_ARENA
+#define ARENA_DEFINE(var, name, size, count) \
+	static char var##_mem[ARENA_ROUND(size) * (count)] \
+		__attribute__((aligned(ARENA_ALIGN))); \
+	static struct arena var = { name, ARENA_ROUND(size), count, var##_mem }
+#else
+#define ARENA_DEFINE(var, name, size, count) \
+	static struct arena var = { name, ARENA_ROUND(size), count, NULL }
+#endif
+
+/*
+ * Returns len zeroed bytes (at most the arena's object size), or NULL.
+ * arena_free() accepts NULL.
+ */
+void *arena_alloc_len(struct arena *a, size_t len);
+void arena_free(struct arena *a, void *obj);
+
+static inline void *arena_alloc(struct arena *a)
+{
+	return arena_alloc_len(a, a->size);
+}
+
+/* walk the arenas that have been used so far; start with NULL */
+const struct arena *arena_next(const struct arena *a);
+
+/* log one line per arena, and the total high-water mark */
+void arena_report(int level);
+
+#endif /* _ARENA_H_ */
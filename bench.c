@@ -0,0 +1,364 @@
+/*
+ * vrctl - hot path microbenchmarks ("make bench")
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each benchmark runs its operation n times, with n doubled until a run
+ * takes at least MIN_RUN_NS, and reports the time and the number of heap
+ * allocations per operation.  Allocations are counted by wrapping
+ * malloc/calloc/realloc at link time (see the Makefile), so calls made
+ * from inside libc itself (e.g. by fopen) are not included.
+ *
+ * Usage: vrctl_bench [<name>...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "util.h"
+#include "port.h"
+#include "vrctl_int.h"
+#include "alias.h"
+#include "firmware.h"
+
+#define MIN_RUN_NS		200000000LL
+#define LINE_BATCH		1000
+#define HEX_RECORDS		512
+
+static unsigned long n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	n_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	n_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	n_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* keeps the compiler from optimizing the work away */
+static volatile int sink;
+
+/*
+ * RESPONSE PARSING
+ */
+
+static char *resp_lines[] = {
+	"<E000",
+	"<X000",
+	"<N003L255",
+	"<N004:049,005,001,009,075",		/* temperature */
+	"<N005:064,003,001",			/* thermostat mode */
+};
+
+static void bench_parse_resp(long n)
+{
+	struct vrctl_resp r;
+	char buf[VRCTL_FRAMELEN];
+	long i;
+
+	for (i = 0; i < n; i++) {
+		strcpy(buf, resp_lines[i % ARRAY_SIZE(resp_lines)]);
+		sink += vrctl_parse_resp(buf, &r);
+	}
+}
+
+static void bench_parse_temp(long n)
+{
+	struct vrctl_resp r;
+	char buf[VRCTL_FRAMELEN];
+	long i;
+
+	for (i = 0; i < n; i++) {
+		strcpy(buf, "<N004:049,005,001,009,075");
+		sink += vrctl_parse_resp(buf, &r);
+	}
+}
+
+/*
+ * LINE FRAMING
+ *
+ * read_line() on a pipe, refilled LINE_BATCH lines at a time.  This is
+ * dominated by the poll() + read() per byte, which is what it costs on a
+ * real tty too.
+ */
+
+static int pipe_read(struct vrctl_port *p, void *buf, int len)
+{
+	return read(p->fd, buf, len);
+}
+
+static const struct port_ops pipe_ops = {
+	.name		= "pipe",
+	.read		= pipe_read,
+};
+
+static void bench_read_line(long n)
+{
+	static char batch[LINE_BATCH * 16];
+	struct vrctl_port port = { .ops = &pipe_ops };
+	char buf[VRCTL_FRAMELEN];
+	int fds[2], len = 0, i;
+	long done;
+
+	for (i = 0; i < LINE_BATCH; i++)
+		len += sprintf(batch + len, "<N%03dL%03d\r\n", i % 232 + 1,
+			i % 256);
+	if (pipe(fds) < 0)
+		die("can't create pipe\n");
+	port.fd = fds[0];
+
+	for (done = 0; done < n; ) {
+		if (write(fds[1], batch, len) != len)
+			die("short write to pipe\n");
+		for (i = 0; i < LINE_BATCH && done < n; i++, done++)
+			sink += read_line(&port, buf, sizeof(buf), 1000000);
+		/* drain the rest of a partial batch */
+		for (; i < LINE_BATCH; i++)
+			read_line(&port, buf, sizeof(buf), 1000000);
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/*
+ * RC FILE AND NODE NAMES
+ */
+
+static void bench_next_token(long n)
+{
+	char tok[64], *p;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		p = "when 12 scene 3 kitchen,hall level 40";
+		while (next_token(&p, tok, sizeof(tok)) == 0)
+			sink++;
+	}
+}
+
+static void setup_aliases(void)
+{
+	static int done;
+	struct nodeset set;
+	char name[32];
+	int i;
+
+	if (done)
+		return;
+	done = 1;
+
+	/* a large house: one alias per node plus some rooms */
+	for (i = 1; i <= VRCTL_MAX_NODEID; i++) {
+		ns_clear(&set);
+		ns_add(&set, i);
+		snprintf(name, sizeof(name), "light%d", i);
+		alias_define(name, &set, 0);
+	}
+	for (i = 0; i < 32; i++) {
+		ns_clear(&set);
+		ns_add(&set, i * 7 % VRCTL_MAX_NODEID + 1);
+		ns_add(&set, i * 7 % VRCTL_MAX_NODEID + 2);
+		snprintf(name, sizeof(name), "room%d", i);
+		alias_define(name, &set, 1);
+	}
+}
+
+static void bench_alias_lookup(long n)
+{
+	static const char *names[] = { "light1", "LIGHT117", "room31",
+		"light232", "nosuchname" };
+	long i;
+
+	setup_aliases();
+	for (i = 0; i < n; i++)
+		sink += alias_lookup(names[i % ARRAY_SIZE(names)]) != NULL;
+}
+
+static void bench_alias_eval(long n)
+{
+	struct nodeset set;
+	long i;
+
+	setup_aliases();
+	for (i = 0; i < n; i++)
+		sink += alias_eval("room3 + room4 + light9 - light22", &set);
+}
+
+static void bench_alias_name(long n)
+{
+	long i;
+
+	setup_aliases();
+	for (i = 0; i < n; i++)
+		sink += alias_name(i % VRCTL_MAX_NODEID + 1) != NULL;
+}
+
+/*
+ * FIRMWARE IMAGES
+ */
+
+static char hex_path[] = "/tmp/vrctl_bench.XXXXXX";
+
+static void setup_hex(void)
+{
+	static int done;
+	uint8_t rec[5 + 16];
+	FILE *f;
+	int fd, i, j, sum;
+
+	if (done)
+		return;
+	done = 1;
+
+	fd = mkstemp(hex_path);
+	if (fd < 0 || (f = fdopen(fd, "w")) == NULL)
+		die("can't create %s\n", hex_path);
+
+	/* like an ST image: an address record, then HEX_RECORDS x 16 bytes */
+	fprintf(f, ":020000040000FA\n");
+	for (i = 0; i < HEX_RECORDS; i++) {
+		rec[0] = 16;
+		rec[1] = (0x8000 + i * 16) >> 8;
+		rec[2] = (0x8000 + i * 16) & 0xff;
+		rec[3] = FW_REC_DATA;
+		for (j = 0; j < 16; j++)
+			rec[4 + j] = i * 16 + j;
+		for (j = sum = 0; j < 20; j++)
+			sum += rec[j];
+		rec[20] = -sum;
+
+		fputc(':', f);
+		for (j = 0; j < 21; j++)
+			fprintf(f, "%02X", rec[j]);
+		fputc('\n', f);
+	}
+	fprintf(f, ":00000001FF\n");
+	fclose(f);
+}
+
+static void bench_fw_load_hex(long n)
+{
+	struct fw_image img;
+	long i;
+
+	setup_hex();
+	for (i = 0; i < n; i++) {
+		if (fw_load(hex_path, FW_TARGET_ST, &img) < 0)
+			die("can't load %s\n", hex_path);
+		sink += img.hdr->n_blocks;
+		fw_free(&img);
+	}
+}
+
+static void bench_st_checksum(long n)
+{
+	uint8_t buf[18];
+	long i;
+
+	for (i = 0; i < n; i++) {
+		memset(buf, i, 17);
+		fw_st_checksum(buf, 17);
+		sink += buf[17];
+	}
+}
+
+/*
+ * DRIVER
+ */
+
+struct bench {
+	const char		*name;
+	void			(*fn)(long n);
+};
+
+static const struct bench benches[] = {
+	{ "parse_resp",		bench_parse_resp },
+	{ "parse_temp",		bench_parse_temp },
+	{ "read_line",		bench_read_line },
+	{ "next_token",		bench_next_token },
+	{ "alias_lookup",	bench_alias_lookup },
+	{ "alias_eval",		bench_alias_eval },
+	{ "alias_name",		bench_alias_name },
+	{ "fw_load_hex",	bench_fw_load_hex },
+	{ "st_checksum",	bench_st_checksum },
+};
+
+static void run_bench(const struct bench *b)
+{
+	long long start, elapsed;
+	unsigned long allocs;
+	long n;
+
+	/* warm up (and run any setup) outside of the measurement */
+	b->fn(1);
+
+	for (n = 1; ; n *= 2) {
+		allocs = n_allocs;
+		start = now_ns();
+		b->fn(n);
+		elapsed = now_ns() - start;
+		allocs = n_allocs - allocs;
+		if (elapsed >= MIN_RUN_NS)
+			break;
+	}
+	printf("%-16s %12ld %12.1f ns/op %10.2f allocs/op\n", b->name, n,
+		(double)elapsed / n, (double)allocs / n);
+}
+
+int main(int argc, char **argv)
+{
+	int i, j;
+
+	g_loglevel = L_WARNING;
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		if (argc > 1) {
+			for (j = 1; j < argc; j++)
+				if (strcmp(argv[j], benches[i].name) == 0)
+					break;
+			if (j == argc)
+				continue;
+		}
+		run_bench(&benches[i]);
+	}
+	if (hex_path[strlen(hex_path) - 1] != 'X')
+		unlink(hex_path);
+	return 0;
+}
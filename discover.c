@@ -0,0 +1,282 @@
+/*
+ * libvrctl - network discovery
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "vrctl_int.h"
+
+/*
+ * The VRC0P can only answer "which node is the Nth instance of generic
+ * class C?" (>?FI), so discovery asks that for every class until the
+ * answer is 0.
+ *
+ * A rescan trusts a class from the previous scan if its last known member
+ * is still in the same slot and there is nobody after it.  That costs two
+ * probes per populated class (one per empty class) instead of one per
+ * node, and catches the usual pairing/unpairing changes; a full scan
+ * catches everything else.
+ */
+
+struct gen_class {
+	int			id;
+	const char		*name;
+	unsigned int		caps;
+};
+
+static const struct gen_class gen_classes[] = {
+	{ 0x10, "switch/appliance",	VRCTL_CAP_SWITCH },
+	{ 0x11, "dimmer",		VRCTL_CAP_SWITCH | VRCTL_CAP_DIMMER },
+	{ 0x08, "thermostat",		VRCTL_CAP_THERMOSTAT },
+	{ 0x01, "controller",		VRCTL_CAP_CONTROLLER },
+	{ 0x02, "static controller",	VRCTL_CAP_CONTROLLER },
+	{ 0x03, "AV control point",	0 },
+	{ 0x04, "display",		0 },
+	{ 0x09, "window covering",	VRCTL_CAP_SWITCH | VRCTL_CAP_DIMMER },
+	{ 0x0f, "repeater",		0 },
+	{ 0x12, "remote switch",	VRCTL_CAP_CONTROLLER },
+	{ 0x13, "toggle switch",	VRCTL_CAP_SWITCH },
+	{ 0x16, "ventilation",		0 },
+	{ 0x17, "security panel",	VRCTL_CAP_SENSOR },
+	{ 0x18, "wall controller",	VRCTL_CAP_CONTROLLER },
+	{ 0x20, "binary sensor",	VRCTL_CAP_SENSOR },
+	{ 0x21, "multilevel sensor",	VRCTL_CAP_SENSOR },
+	{ 0x30, "pulse meter",		VRCTL_CAP_METER },
+	{ 0x31, "meter",		VRCTL_CAP_METER },
+	{ 0x40, "door lock",		VRCTL_CAP_LOCK },
+	{ 0x50, "semi-interoperable",	0 },
+	{ 0xa1, "alarm sensor",		VRCTL_CAP_SENSOR },
+	{ 0xff, "non-interoperable",	0 },
+};
+
+static const struct gen_class *find_class(int gen_class)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gen_classes); i++)
+		if (gen_classes[i].id == gen_class)
+			return &gen_classes[i];
+	return NULL;
+}
+
+const char *vrctl_class_name(int gen_class)
+{
+	const struct gen_class *gc = find_class(gen_class);
+
+	return gc ? gc->name : "unknown";
+}
+
+static int probe(struct vrctl_conn *v, struct vrctl_netinfo *ni,
+	int gen_class, int instance)
+{
+	int ret;
+
+	ni->probes++;
+	ret = vrctl_find_node(v, gen_class, instance);
+	if (ret > VRCTL_MAX_NODEID)
+		return 0;
+	return ret;
+}
+
+static void add_node(struct vrctl_netinfo *ni, int nodeid,
+	const struct gen_class *gc, int instance)
+{
+	struct vrctl_node *n = &ni->node[nodeid];
+
+	n->gen_class = gc->id;
+	n->instance = instance;
+	n->caps = gc->caps;
+}
+
+static int scan_class(struct vrctl_conn *v, struct vrctl_netinfo *ni,
+	const struct gen_class *gc)
+{
+	int i, ret;
+
+	for (i = 1; i <= VRCTL_MAX_NODEID; i++) {
+		ret = probe(v, ni, gc->id, i);
+		if (ret <= 0)
+			return ret;
+		add_node(ni, ret, gc, i);
+	}
+	return 0;
+}
+
+/* 1 if gen_class still looks exactly like it did in prev */
+static int class_unchanged(struct vrctl_conn *v, struct vrctl_netinfo *ni,
+	const struct vrctl_netinfo *prev, const struct gen_class *gc)
+{
+	int i, last = 0, count = 0, ret;
+
+	for (i = 1; i <= VRCTL_MAX_NODEID; i++) {
+		if (prev->node[i].gen_class != gc->id)
+			continue;
+		count++;
+		if (prev->node[i].instance > prev->node[last].instance)
+			last = i;
+	}
+	if (count && prev->node[last].instance != count)
+		return 0;	/* saved list has holes; don't trust it */
+
+	if (count) {
+		ret = probe(v, ni, gc->id, count);
+		if (ret != last)
+			return ret < 0 ? ret : 0;
+	}
+	ret = probe(v, ni, gc->id, count + 1);
+	if (ret != 0)
+		return ret < 0 ? ret : 0;
+
+	for (i = 1; i <= VRCTL_MAX_NODEID; i++)
+		if (prev->node[i].gen_class == gc->id)
+			add_node(ni, i, gc, prev->node[i].instance);
+	return 1;
+}
+
+static int discover(struct vrctl_conn *v, const struct vrctl_netinfo *prev,
+	struct vrctl_netinfo *ni, int full)
+{
+	const struct gen_class *gc;
+	int i, ret, changed = 0;
+
+	memset(ni, 0, sizeof(*ni));
+	if (prev && !prev->generation)
+		prev = NULL;
+
+	for (i = 0; i < ARRAY_SIZE(gen_classes); i++) {
+		gc = &gen_classes[i];
+
+		ret = prev && !full ? class_unchanged(v, ni, prev, gc) : 0;
+		if (ret == 0)
+			ret = scan_class(v, ni, gc);
+
+		/* firmware that doesn't know a class rejects the frame */
+		if (ret == -VRCTL_EDEVICE)
+			continue;
+		if (ret < 0)
+			return ret;
+	}
+
+	for (i = 1; i <= VRCTL_MAX_NODEID; i++) {
+		struct vrctl_node *n = &ni->node[i];
+		const struct vrctl_node *old = prev ? &prev->node[i] : NULL;
+
+		if (n->gen_class)
+			ni->n_nodes++;
+		if (!old || old->gen_class != n->gen_class ||
+		    old->instance != n->instance)
+			changed = 1;
+		else
+			n->generation = old->generation;
+	}
+
+	ni->generation = prev ? prev->generation : 0;
+	if (changed || !prev)
+		ni->generation++;
+	for (i = 1; i <= VRCTL_MAX_NODEID; i++)
+		if (ni->node[i].gen_class && !ni->node[i].generation)
+			ni->node[i].generation = ni->generation;
+
+	info(L_DEBUG, "%s: %d nodes, generation %u, %d probes\n", __func__,
+		ni->n_nodes, ni->generation, ni->probes);
+	return 0;
+}
+
+/* a scan is a long train of frames; don't let it hold up anything else */
+int vrctl_discover(struct vrctl_conn *v, const struct vrctl_netinfo *prev,
+	struct vrctl_netinfo *ni, int full)
+{
+	int saved = v->sync_prio, ret;
+
+	v->sync_prio = VRCTL_PRIO_BACKGROUND;
+	ret = discover(v, prev, ni, full);
+	v->sync_prio = saved;
+	return ret;
+}
+
+/*
+ * SAVED SCANS
+ */
+
+int vrctl_netinfo_load(const char *path, const char *dev,
+	struct vrctl_netinfo *ni)
+{
+	char buf[PATHLEN], port[PATHLEN];
+	const struct gen_class *gc;
+	int id, gen_class, instance;
+	unsigned int generation;
+	FILE *f;
+
+	memset(ni, 0, sizeof(*ni));
+	f = fopen(path, "r");
+	if (!f)
+		return -VRCTL_EOPEN;
+
+	port[0] = 0;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		if (sscanf(buf, "port %255s", port) == 1)
+			continue;
+		if (sscanf(buf, "generation %u", &generation) == 1) {
+			ni->generation = generation;
+			continue;
+		}
+		if (sscanf(buf, "node %d %d %d %u", &id, &gen_class,
+			   &instance, &generation) != 4 ||
+		    id < 1 || id > VRCTL_MAX_NODEID)
+			continue;
+		gc = find_class(gen_class);
+		if (!gc)
+			continue;
+		add_node(ni, id, gc, instance);
+		ni->node[id].generation = generation;
+		ni->n_nodes++;
+	}
+	fclose(f);
+
+	if (strcmp(port, dev) != 0) {
+		memset(ni, 0, sizeof(*ni));
+		return -VRCTL_EOPEN;
+	}
+	return 0;
+}
+
+int vrctl_netinfo_save(const char *path, const char *dev,
+	const struct vrctl_netinfo *ni)
+{
+	const struct vrctl_node *n;
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -VRCTL_EOPEN;
+
+	fprintf(f, "# vrctl node list - regenerated by vrctl --list\n");
+	fprintf(f, "port %s\n", dev);
+	fprintf(f, "generation %u\n", ni->generation);
+	for (i = 1; i <= VRCTL_MAX_NODEID; i++) {
+		n = &ni->node[i];
+		if (n->gen_class)
+			fprintf(f, "node %d %d %d %u\n", i, n->gen_class,
+				n->instance, n->generation);
+	}
+	if (fclose(f) != 0)
+		return -VRCTL_EIO;
+	return 0;
+}
@@ -0,0 +1,625 @@
+/*
+ * libvrctl - asynchronous request engine
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <poll.h>
+#include "util.h"
+#include "vrctl_int.h"
+
+/*
+ * Every frame sent to the VRC0P is answered with <Ennn (accepted, or an
+ * error code) and then, for node commands, <Xnnn (transmit status) or
+ * <Fnnn (node search result).  With several frames in flight the E of a
+ * later frame can arrive before the X of an earlier one, but each kind
+ * comes back in the order the frames were sent: an E belongs to the
+ * oldest request that hasn't been acked yet, and an X or F to the oldest
+ * one that has.  <N reports are matched by node ID instead, since they
+ * can arrive at any time.
+ *
+ * Positional matching only works as long as no reply goes missing.  When
+ * one does (a frame times out, or a reply is garbled while other frames
+ * are in flight), nothing more is sent until the port has been quiet for
+ * DRAIN_QUIET; any E/X/F that trickles in meanwhile is thrown away.  The
+ * frames that were still in flight then go back to the front of their
+ * queues, once; a frame caught up in a second resync fails.
+ */
+
+#define DRAIN_QUIET		1000000
+
+enum {
+	RQ_IDLE = 0,
+	RQ_QUEUED,		/* waiting for a slot on the wire */
+	RQ_SENT,		/* waiting for E/X/F */
+	RQ_REPORT,		/* waiting for <N from the target node */
+	RQ_DONE,
+};
+
+void vrctl_req_vinit(struct vrctl_req *rq, char expect, int nodeid,
+	const char *report, const char *fmt, va_list ap)
+{
+	memset(rq, 0, sizeof(*rq));
+	vsnprintf(rq->frame, VRCTL_FRAMELEN, fmt, ap);
+	rq->expect = expect;
+	rq->nodeid = nodeid;
+	rq->report = report;
+}
+
+void vrctl_req_init(struct vrctl_req *rq, char expect, int nodeid,
+	const char *report, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vrctl_req_vinit(rq, expect, nodeid, report, fmt, ap);
+	va_end(ap);
+}
+
+void engine_init(struct vrctl_conn *v)
+{
+	v->window = 1;
+}
+
+/*
+ * FLOW CONTROL
+ *
+ * The VRC0P only buffers a few commands, and a busy mesh drains them
+ * slowly, so the number of frames in flight is limited by a window which
+ * adapts to what the unit keeps up with.  Once per round (a window's worth
+ * of clean replies) the smoothed reply latency is compared with the best
+ * seen so far to estimate how many frames are just sitting in the VRC0P's
+ * queue: the window opens by one if that is less than one frame, and
+ * closes by one if it is two or more.  It only opens if the last round
+ * actually had it full, so an idle connection doesn't build up a window
+ * it has never tested.  Ennn errors, garbled or overflowing input halve
+ * the window, and a frame the VRC0P never answered drops it back to one.
+ */
+
+#define WINDOW_MAX		8
+
+static void set_window(struct vrctl_conn *v, int window, const char *why)
+{
+	if (window < 1)
+		window = 1;
+	if (window > WINDOW_MAX)
+		window = WINDOW_MAX;
+	if (window != v->window)
+		info(L_DEBUG, "%s: window %d -> %d (%s)\n", __func__,
+			v->window, window, why);
+	v->window = window;
+	v->win_acked = v->win_full = 0;
+}
+
+/* the reply to rq arrived without trouble */
+static void flow_ok(struct vrctl_conn *v, struct vrctl_req *rq)
+{
+	long long rtt = mono_us() - rq->sent, queued;
+
+	if (!v->srtt)
+		v->srtt = rtt;
+	else
+		v->srtt += (rtt - v->srtt) / 8;
+	if (!v->rtt_min || rtt < v->rtt_min)
+		v->rtt_min = rtt;
+
+	if (++v->win_acked < v->window || v->srtt <= 0)
+		return;
+
+	/* frames in flight beyond what the link itself needs, times 16 */
+	queued = v->window * 16 * (v->srtt - v->rtt_min) / v->srtt;
+	if (queued >= 32)
+		set_window(v, v->window - 1, "latency");
+	else if (queued < 16 && v->win_full)
+		set_window(v, v->window + 1, "clean");
+	else
+		v->win_acked = v->win_full = 0;
+}
+
+static void flow_backoff(struct vrctl_conn *v, int window, const char *why)
+{
+	if (window < v->window)
+		set_window(v, window, why);
+}
+
+int vrctl_window(struct vrctl_conn *v)
+{
+	return v->window;
+}
+
+void vrctl_set_report_cb(struct vrctl_conn *v, vrctl_report_cb cb,
+	void *arg)
+{
+	v->report_cb = cb;
+	v->report_arg = arg;
+}
+
+int vrctl_pending(struct vrctl_conn *v)
+{
+	struct vrctl_req *rq;
+	int ret = v->n_sent, prio;
+
+	for (prio = 0; prio < VRCTL_PRIO_MAX; prio++)
+		for (rq = v->txq_head[prio]; rq; rq = rq->next)
+			ret++;
+	return ret;
+}
+
+static void unlink_sent(struct vrctl_conn *v, struct vrctl_req *rq)
+{
+	struct vrctl_req **p, *prev = NULL;
+
+	for (p = &v->sent_head; *p; prev = *p, p = &(*p)->next) {
+		if (*p != rq)
+			continue;
+		*p = rq->next;
+		if (v->sent_tail == rq)
+			v->sent_tail = prev;
+		v->n_sent--;
+		return;
+	}
+}
+
+static void complete(struct vrctl_conn *v, struct vrctl_req *rq, int ret);
+
+static void start_drain(struct vrctl_conn *v, int err, const char *why)
+{
+	if (!v->drain_until)
+		info(L_DEBUG, "%s: resyncing (%s)\n", __func__, why);
+	v->drain_until = mono_us() + DRAIN_QUIET;
+	v->drain_err = err;
+}
+
+static void end_drain(struct vrctl_conn *v)
+{
+	struct vrctl_req *rq, *next, *failed = NULL, **fail_tail = &failed;
+	struct vrctl_req *head[VRCTL_PRIO_MAX] = { NULL };
+	struct vrctl_req *tail[VRCTL_PRIO_MAX] = { NULL };
+	int prio;
+
+	v->drain_until = 0;
+	for (rq = v->sent_head; rq; rq = next) {
+		next = rq->next;
+		if (rq->state != RQ_SENT)
+			continue;
+		unlink_sent(v, rq);
+		rq->next = NULL;
+		if (rq->resent) {
+			*fail_tail = rq;
+			fail_tail = &rq->next;
+			continue;
+		}
+		rq->resent = 1;
+		rq->state = RQ_QUEUED;
+		if (tail[rq->prio])
+			tail[rq->prio]->next = rq;
+		else
+			head[rq->prio] = rq;
+		tail[rq->prio] = rq;
+	}
+
+	/* requeue first, so the callbacks below can't overtake them */
+	for (prio = 0; prio < VRCTL_PRIO_MAX; prio++) {
+		if (!head[prio])
+			continue;
+		tail[prio]->next = v->txq_head[prio];
+		if (!v->txq_tail[prio])
+			v->txq_tail[prio] = tail[prio];
+		v->txq_head[prio] = head[prio];
+	}
+	while ((rq = failed) != NULL) {
+		failed = rq->next;
+		rq->next = NULL;
+		rq->state = RQ_DONE;
+		rq->ret = -v->drain_err;
+		if (rq->done)
+			rq->done(rq);
+	}
+}
+
+static void complete(struct vrctl_conn *v, struct vrctl_req *rq, int ret)
+{
+	unlink_sent(v, rq);
+	rq->next = NULL;
+	rq->state = RQ_DONE;
+	rq->ret = ret;
+	if (rq->done)
+		rq->done(rq);
+}
+
+static struct vrctl_req *dequeue(struct vrctl_conn *v, int prio)
+{
+	struct vrctl_req *rq = v->txq_head[prio];
+
+	v->txq_head[prio] = rq->next;
+	if (!v->txq_head[prio])
+		v->txq_tail[prio] = NULL;
+	rq->next = NULL;
+	return rq;
+}
+
+/* fail everything; used when the port itself goes away */
+void engine_abort(struct vrctl_conn *v, int err)
+{
+	struct vrctl_req *rq;
+	int prio;
+
+	v->drain_until = 0;
+	while ((rq = v->sent_head) != NULL)
+		complete(v, rq, -err);
+
+	for (prio = 0; prio < VRCTL_PRIO_MAX; prio++)
+		while (v->txq_head[prio] != NULL)
+			complete(v, dequeue(v, prio), -err);
+}
+
+/*
+ * Pick the queue to send from: normally the highest class with anything
+ * waiting, but every time a lower class is passed over it earns a credit,
+ * and once it has STARVE_LIMIT of them it goes next.  A steady stream of
+ * interactive traffic therefore still lets one automation or background
+ * frame through every few slots.
+ */
+
+#define STARVE_LIMIT		4
+
+static int next_prio(struct vrctl_conn *v)
+{
+	int prio, best = -1, starved = -1;
+
+	for (prio = 0; prio < VRCTL_PRIO_MAX; prio++) {
+		if (!v->txq_head[prio])
+			continue;
+		if (best < 0) {
+			best = prio;
+			continue;
+		}
+		if (++v->txq_skipped[prio] >= STARVE_LIMIT && starved < 0)
+			starved = prio;
+	}
+	if (starved >= 0)
+		best = starved;
+	if (best >= 0)
+		v->txq_skipped[best] = 0;
+	return best;
+}
+
+static void kick_tx(struct vrctl_conn *v)
+{
+	struct vrctl_req *rq;
+	int prio;
+
+	if (v->drain_until)
+		return;
+	while (v->n_sent < v->window && (prio = next_prio(v)) >= 0) {
+		rq = dequeue(v, prio);
+		if (v->sent_tail)
+			v->sent_tail->next = rq;
+		else
+			v->sent_head = rq;
+		v->sent_tail = rq;
+		if (++v->n_sent == v->window)
+			v->win_full = 1;
+
+		rq->state = RQ_SENT;
+		rq->acked = 0;
+		rq->sent = mono_us();
+		rq->deadline = rq->sent + TIMEOUT;
+		if (write_line(v->port, rq->frame) < 0) {
+			engine_abort(v, VRCTL_EIO);
+			return;
+		}
+	}
+}
+
+void vrctl_submit(struct vrctl_conn *v, struct vrctl_req *rq)
+{
+	int prio = rq->prio;
+
+	if (prio < 0 || prio >= VRCTL_PRIO_MAX)
+		prio = rq->prio = VRCTL_PRIO_INTERACTIVE;
+
+	rq->state = RQ_QUEUED;
+	rq->ret = rq->code = 0;
+	rq->resent = 0;
+	rq->next = NULL;
+
+	if (v->txq_tail[prio])
+		v->txq_tail[prio]->next = rq;
+	else
+		v->txq_head[prio] = rq;
+	v->txq_tail[prio] = rq;
+
+	kick_tx(v);
+}
+
+/* the oldest frame in flight whose E reply has (or hasn't) arrived */
+static struct vrctl_req *oldest_sent(struct vrctl_conn *v, int acked)
+{
+	struct vrctl_req *rq;
+
+	for (rq = v->sent_head; rq; rq = rq->next)
+		if (rq->state == RQ_SENT && rq->acked == acked)
+			return rq;
+	return NULL;
+}
+
+/*
+ * A reply was garbled or lost.  If it can only have belonged to one frame,
+ * that frame fails; otherwise nobody knows whose it was, so resync.
+ */
+static void lost_reply(struct vrctl_conn *v, int err, const char *why)
+{
+	struct vrctl_req *rq, *only = NULL;
+	int n = 0;
+
+	flow_backoff(v, v->window / 2, why);
+	if (v->drain_until) {
+		start_drain(v, v->drain_err, why);
+		return;
+	}
+	for (rq = v->sent_head; rq; rq = rq->next)
+		if (rq->state == RQ_SENT) {
+			only = rq;
+			n++;
+		}
+	if (n == 1)
+		complete(v, only, -err);
+	else if (n > 1)
+		start_drain(v, err, why);
+}
+
+/* rq got its final E, X or F reply */
+static void reply_done(struct vrctl_conn *v, struct vrctl_req *rq,
+	struct vrctl_resp *r)
+{
+	flow_ok(v, rq);
+
+	if (rq->report && r->arg0 == 0) {
+		rq->state = RQ_REPORT;
+		rq->deadline = mono_us() + TIMEOUT;
+		return;
+	}
+	complete(v, rq, r->arg0);
+}
+
+static void process_report(struct vrctl_conn *v, struct vrctl_resp *r,
+	char *line)
+{
+	struct vrctl_req *rq;
+
+	for (rq = v->sent_head; rq; rq = rq->next) {
+		if (rq->state != RQ_REPORT || rq->nodeid != r->arg0)
+			continue;
+		if (!r->type1 || !strchr(rq->report, r->type1))
+			continue;
+		rq->r = *r;
+		complete(v, rq, 0);
+		return;
+	}
+
+	if (v->report_cb)
+		v->report_cb(r, line, v->report_arg);
+}
+
+static void process_line(struct vrctl_conn *v, char *line)
+{
+	struct vrctl_resp r;
+	struct vrctl_req *rq;
+
+	info(L_DEBUG, "%s: got '%s'\n", __func__, line);
+
+	if (vrctl_parse_resp(line, &r) < 0) {
+		info(L_VERBOSE, "bad response '%s'\n", line);
+		lost_reply(v, VRCTL_EBADRESP, "bad response");
+		return;
+	}
+
+	if (r.type0 == 'N') {
+		process_report(v, &r, line);
+		return;
+	}
+
+	if (v->drain_until) {
+		/* the port isn't quiet yet */
+		info(L_DEBUG, "%s: discarding '%s'\n", __func__, line);
+		start_drain(v, v->drain_err, "late reply");
+		return;
+	}
+
+	rq = oldest_sent(v, r.type0 != 'E');
+	if (!rq || (r.type0 != 'E' && r.type0 != rq->expect)) {
+		info(L_DEBUG, "%s: unsolicited '%s'\n", __func__, line);
+		return;
+	}
+
+	if (r.type0 == 'E' && r.arg0 != 0) {
+		flow_backoff(v, v->window / 2, "error");
+		rq->code = r.arg0;
+		complete(v, rq, -VRCTL_EDEVICE);
+		return;
+	}
+	if (r.type0 == 'E' && rq->expect != 'E') {
+		rq->acked = 1;
+		return;
+	}
+	reply_done(v, rq, &r);
+}
+
+int vrctl_handle_input(struct vrctl_conn *v)
+{
+	char buf[256];
+	int len, i;
+
+	len = v->port->ops->read(v->port, buf, sizeof(buf));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (len <= 0) {
+		engine_abort(v, VRCTL_EIO);
+		return -VRCTL_EIO;
+	}
+
+	for (i = 0; i < len; i++) {
+		char c = buf[i];
+
+		if (c == '\r' || c == '\n' || c == 0) {
+			if (v->rx_overflow) {
+				info(L_DEBUG, "%s: out of buffer space\n",
+					__func__);
+				lost_reply(v, VRCTL_EOVERFLOW, "overflow");
+			} else if (v->rxlen) {
+				v->rxbuf[v->rxlen] = 0;
+				process_line(v, v->rxbuf);
+			}
+			v->rxlen = v->rx_overflow = 0;
+			continue;
+		}
+		if (v->rxlen < BUFLEN - 1)
+			v->rxbuf[v->rxlen++] = c;
+		else
+			v->rx_overflow = 1;
+	}
+
+	kick_tx(v);
+	return 0;
+}
+
+/*
+ * TIMERS
+ *
+ * Kept on a list sorted by expiry time; there are rarely more than a
+ * handful pending.
+ */
+
+void vrctl_timer_add(struct vrctl_conn *v, struct vrctl_timer *t,
+	long long delay_us)
+{
+	struct vrctl_timer **p;
+
+	t->expires = mono_us() + delay_us;
+	for (p = &v->timers; *p && (*p)->expires <= t->expires;
+	     p = &(*p)->next)
+		;
+	t->next = *p;
+	*p = t;
+}
+
+void vrctl_timer_del(struct vrctl_conn *v, struct vrctl_timer *t)
+{
+	struct vrctl_timer **p;
+
+	for (p = &v->timers; *p; p = &(*p)->next)
+		if (*p == t) {
+			*p = t->next;
+			return;
+		}
+}
+
+static void run_timers(struct vrctl_conn *v, long long now)
+{
+	struct vrctl_timer *t;
+
+	while ((t = v->timers) != NULL && t->expires <= now) {
+		v->timers = t->next;
+		t->next = NULL;
+		t->fn(t);
+	}
+}
+
+void vrctl_handle_timers(struct vrctl_conn *v)
+{
+	struct vrctl_req *rq;
+	long long now = mono_us();
+
+	run_timers(v, now);
+	if (v->drain_until && v->drain_until <= now)
+		end_drain(v);
+
+again:
+	for (rq = v->sent_head; rq; rq = rq->next) {
+		/* frames caught in a resync get a fresh deadline later */
+		if (rq->deadline > now ||
+		    (v->drain_until && rq->state == RQ_SENT))
+			continue;
+		info(L_DEBUG, "%s: '%s' timed out\n", __func__, rq->frame);
+		/*
+		 * A missing report is the node's fault, not ours.  A missing
+		 * reply may still turn up and would be taken for somebody
+		 * else's.
+		 */
+		if (rq->state == RQ_SENT) {
+			flow_backoff(v, 1, "timeout");
+			start_drain(v, VRCTL_ETIMEDOUT, "timeout");
+		}
+		complete(v, rq, -VRCTL_ETIMEDOUT);
+		goto again;
+	}
+	kick_tx(v);
+}
+
+long long vrctl_next_deadline(struct vrctl_conn *v)
+{
+	struct vrctl_req *rq;
+	long long ret = 0;
+
+	for (rq = v->sent_head; rq; rq = rq->next) {
+		if (v->drain_until && rq->state == RQ_SENT)
+			continue;
+		if (!ret || rq->deadline < ret)
+			ret = rq->deadline;
+	}
+	if (v->drain_until && (!ret || v->drain_until < ret))
+		ret = v->drain_until;
+	if (v->timers && (!ret || v->timers->expires < ret))
+		ret = v->timers->expires;
+	return ret;
+}
+
+int vrctl_run_once(struct vrctl_conn *v, int timeout_ms)
+{
+	struct pollfd pfd;
+	long long deadline = vrctl_next_deadline(v);
+	int ret;
+
+	if (deadline) {
+		long long left = (deadline - mono_us() + 999) / 1000;
+
+		if (left < 0)
+			left = 0;
+		if (timeout_ms < 0 || left < timeout_ms)
+			timeout_ms = left;
+	}
+
+	pfd.fd = v->fd;
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0 && errno != EINTR) {
+		engine_abort(v, VRCTL_EIO);
+		return -VRCTL_EIO;
+	}
+	if (ret > 0) {
+		ret = vrctl_handle_input(v);
+		if (ret < 0)
+			return ret;
+	}
+	vrctl_handle_timers(v);
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * vrctl - event ring for report subscribers
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "events.h"
+
+static size_t ring_size(int nslots)
+{
+	return sizeof(struct evring_hdr) +
+		(size_t)nslots * sizeof(struct evring_slot);
+}
+
+static int map_ring(struct evring *ev, int fd, size_t len, int prot)
+{
+	void *map;
+
+	map = mmap(NULL, len, prot, fd < 0 ? MAP_SHARED | MAP_ANONYMOUS :
+		MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	ev->hdr = map;
+	ev->slot = (struct evring_slot *)(ev->hdr + 1);
+	ev->map_len = len;
+	return 0;
+}
+
+/*
+ * WRITER
+ */
+
+int evring_create(struct evring *ev, const char *path, int nslots)
+{
+	size_t len = ring_size(nslots);
+	int fd = -1, ret;
+
+	if (path) {
+		/* start over: readers of an old ring see it stop */
+		unlink(path);
+		fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			return -1;
+		if (ftruncate(fd, len) < 0) {
+			close(fd);
+			unlink(path);
+			return -1;
+		}
+	}
+	ret = map_ring(ev, fd, len, PROT_READ | PROT_WRITE);
+	if (fd >= 0)
+		close(fd);
+	if (ret < 0)
+		return -1;
+
+	ev->hdr->slot_size = sizeof(struct evring_slot);
+	ev->hdr->nslots = nslots;
+	ev->hdr->pid = getpid();
+	__sync_synchronize();
+	memcpy(ev->hdr->magic, EVRING_MAGIC, sizeof(ev->hdr->magic));
+	return 0;
+}
+
+void evring_destroy(struct evring *ev)
+{
+	if (!ev->hdr)
+		return;
+	ev->hdr->pid = 0;
+	munmap(ev->hdr, ev->map_len);
+	ev->hdr = NULL;
+}
+
+void evring_put(struct evring *ev, const struct vrctl_resp *r,
+	const char *line)
+{
+	uint64_t seq = ev->hdr->head;
+	struct evring_slot *s = &ev->slot[seq % ev->hdr->nslots];
+
+	s->seq = 0;
+	__sync_synchronize();
+	s->ts = now_us();
+	s->type0 = r->type0;
+	s->type1 = r->type1;
+	s->precision = r->arg1_precision;
+	s->arg0 = r->arg0;
+	s->arg1 = r->arg1;
+	strncpy(s->line, line, sizeof(s->line) - 1);
+	s->line[sizeof(s->line) - 1] = 0;
+	__sync_synchronize();
+	s->seq = seq + 1;
+	__sync_synchronize();
+	ev->hdr->head = seq + 1;
+}
+
+/*
+ * READERS
+ */
+
+int evring_attach(struct evring *ev, const char *path)
+{
+	struct evring_hdr hdr;
+	struct stat st;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(hdr) ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, EVRING_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.slot_size != sizeof(struct evring_slot) || !hdr.nslots ||
+	    st.st_size < ring_size(hdr.nslots)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	ret = map_ring(ev, fd, ring_size(hdr.nslots), PROT_READ);
+	close(fd);
+	return ret;
+}
+
+int evring_get(const struct evring *ev, uint64_t *cursor,
+	struct evring_slot *out)
+{
+	uint64_t head = evring_head(ev), want = *cursor;
+	uint32_t nslots = ev->hdr->nslots;
+	const struct evring_slot *s = &ev->slot[want % nslots];
+
+	if (want >= head)
+		return 0;
+	if (head - want > nslots)
+		goto lost;
+
+	if (s->seq != want + 1)
+		goto lost;
+	__sync_synchronize();
+	memcpy(out, (const void *)s, sizeof(*out));
+	__sync_synchronize();
+	if (s->seq != want + 1)
+		goto lost;
+
+	*cursor = want + 1;
+	return 1;
+
+lost:
+	head = evring_head(ev);
+	*cursor = head > nslots ? head - nslots : 0;
+	return -1;
+}
@@ -0,0 +1,103 @@
+/*
+ * vrctl - event ring for report subscribers
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include <stdint.h>
+#include "libvrctl.h"
+
+/*
+ * The command server appends every unsolicited <N report to a ring of
+ * fixed-size slots.  There is one writer and any number of readers; each
+ * reader keeps its own cursor (the sequence number of the next event it
+ * wants) and nobody ever waits for anybody else.  A reader which falls
+ * more than a ring's worth behind has lost events and finds out on its
+ * next read.
+ *
+ * The ring lives in a memory-mapped file if one is configured, so other
+ * programs can follow it directly (native byte order):
+ *
+ * head is the number of events ever written.  A slot holding event s has
+ * seq == s + 1; the writer zeroes seq before reusing a slot and sets it
+ * once the new event is complete, so a reader copies the slot between two
+ * reads of seq and only trusts it if both match the event it wanted.
+ */
+
+#define EVRING_MAGIC		"VRCTLEV1"
+#define EVRING_DEFAULT_SLOTS	1024
+
+struct evring_slot {
+	volatile uint64_t	seq;
+	uint64_t		ts;		/* UNIX time in usec */
+	char			type0;		/* parsed, as in vrctl_resp */
+	char			type1;
+	uint8_t			precision;
+	uint8_t			reserved;
+	uint32_t		arg0;
+	uint32_t		arg1;
+	char			line[VRCTL_FRAMELEN];
+};
+
+struct evring_hdr {
+	char			magic[8];
+	uint32_t		slot_size;	/* sizeof(struct evring_slot) */
+	uint32_t		nslots;
+	volatile uint64_t	head;
+	uint32_t		pid;		/* writer; 0 = stopped */
+	uint32_t		reserved[9];
+};
+
+struct evring {
+	struct evring_hdr	*hdr;
+	struct evring_slot	*slot;
+	size_t			map_len;
+};
+
+/*
+ * WRITER (the server)
+ *
+ * path may be NULL for a private ring that only socket subscribers use.
+ * Returns -1 on error.
+ */
+int evring_create(struct evring *ev, const char *path, int nslots);
+void evring_destroy(struct evring *ev);
+void evring_put(struct evring *ev, const struct vrctl_resp *r,
+	const char *line);
+
+/* READERS */
+int evring_attach(struct evring *ev, const char *path);
+
+static inline uint64_t evring_head(const struct evring *ev)
+{
+	uint64_t head = ev->hdr->head;
+
+	__sync_synchronize();
+	return head;
+}
+
+/*
+ * Copy event *cursor into *out and advance the cursor.  Returns 1 if an
+ * event was copied, 0 if there is nothing new, or -1 if the event was
+ * overwritten before it could be read; in that case *cursor is moved up
+ * to the oldest event still in the ring.
+ */
+int evring_get(const struct evring *ev, uint64_t *cursor,
+	struct evring_slot *out);
+
+#endif /* _EVENTS_H_ */
@@ -0,0 +1,456 @@
+/*
+ * vrctl - firmware images
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Firmware arrives as Intel HEX, which has to be parsed (and trusted)
+ * line by line.  "vrctl --pack" converts it once into a container which
+ * can be mapped and checked in full before the upgrade starts:
+ *
+ *   [ header (64 bytes) ][ segment table ][ block table ][ data ]
+ *
+ * Each block is one record of the original file, so the Zensys upgrade
+ * can regenerate the exact lines it sends, and carries a CRC32 of its
+ * data.  The header names the target and holds a 64-bit FNV-1a hash of
+ * everything that follows it.  Like the reading store, the container is
+ * written in host byte order.
+ *
+ * Loading a .hex file produces the same layout in memory, so both kinds
+ * of input share one upgrade path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "firmware.h"
+
+#define FW_MAGIC		"VRCTLFW1"
+#define HEX_LINELEN		600
+
+/*
+ * CHECKSUMS
+ */
+
+static uint32_t crc32(const uint8_t *buf, size_t len)
+{
+	static uint32_t table[256];
+	uint32_t crc = ~0U;
+	size_t i;
+	int j;
+
+	if (!table[1]) {
+		for (i = 0; i < 256; i++) {
+			crc = i;
+			for (j = 0; j < 8; j++)
+				crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+			table[i] = crc;
+		}
+		crc = ~0U;
+	}
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint64_t fnv64(const uint8_t *buf, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ buf[i]) * 1099511628211ULL;
+	return h;
+}
+
+void fw_st_checksum(uint8_t *buf, int len)
+{
+	uint8_t res = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		res ^= buf[i];
+	buf[len] = res;
+}
+
+/*
+ * TARGETS
+ */
+
+int fw_parse_target(const char *name)
+{
+	if (strcasecmp(name, "st") == 0)
+		return FW_TARGET_ST;
+	if (strcasecmp(name, "zensys") == 0)
+		return FW_TARGET_ZENSYS;
+	return 0;
+}
+
+const char *fw_target_name(int target)
+{
+	switch (target) {
+	case FW_TARGET_ST:
+		return "ST";
+	case FW_TARGET_ZENSYS:
+		return "Zensys";
+	}
+	return "unknown";
+}
+
+/*
+ * INTEL HEX
+ */
+
+struct hex_state {
+	struct fw_block		*blk;
+	struct fw_segment	*seg;
+	uint8_t			*data;
+	int			n_blocks, n_segments, data_len;
+	int			max_blocks, max_segments, max_data;
+	uint32_t		base;		/* from address records */
+	int			in_seg;
+};
+
+static int grow(void **p, int *max, int want, size_t size)
+{
+	void *n;
+	int newmax = *max ? *max : 64;
+
+	if (want <= *max)
+		return 0;
+	while (newmax < want)
+		newmax *= 2;
+	n = realloc(*p, newmax * size);
+	if (!n)
+		return -1;
+	*p = n;
+	*max = newmax;
+	return 0;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = toupper(c);
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* returns the number of bytes decoded from ":LLAAAATT...CC" or -1 */
+static int parse_record(const char *line, uint8_t *out)
+{
+	int len = strlen(line), i, hi, lo;
+	uint8_t sum = 0;
+
+	if (line[0] != ':' || len < 11 || !(len & 1))
+		return -1;
+	for (i = 0; i < (len - 1) / 2; i++) {
+		hi = hexval(line[1 + i * 2]);
+		lo = hexval(line[2 + i * 2]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		out[i] = (hi << 4) | lo;
+		sum += out[i];
+	}
+	if (sum != 0 || out[0] != i - 5)
+		return -1;
+	return i;
+}
+
+static int add_record(struct hex_state *hs, const uint8_t *rec)
+{
+	struct fw_block *b;
+	struct fw_segment *s;
+	int len = rec[0], type = rec[3];
+	uint32_t abs;
+
+	if (grow((void **)&hs->blk, &hs->max_blocks, hs->n_blocks + 1,
+		 sizeof(*hs->blk)) < 0 ||
+	    grow((void **)&hs->data, &hs->max_data, hs->data_len + len, 1) < 0)
+		return -1;
+
+	b = &hs->blk[hs->n_blocks];
+	b->addr = (rec[1] << 8) | rec[2];
+	b->type = type;
+	b->len = len;
+	b->offset = hs->data_len;
+	memcpy(hs->data + hs->data_len, &rec[4], len);
+	b->crc = crc32(&rec[4], len);
+	hs->data_len += len;
+
+	/* extended segment / linear address records */
+	if ((type == 0x02 || type == 0x04) && len == 2)
+		hs->base = ((rec[4] << 8) | rec[5]) << (type == 0x02 ? 4 : 16);
+
+	if (type != FW_REC_DATA) {
+		hs->in_seg = 0;
+		hs->n_blocks++;
+		return 0;
+	}
+
+	abs = hs->base + b->addr;
+	s = hs->n_segments ? &hs->seg[hs->n_segments - 1] : NULL;
+	if (!hs->in_seg || !s || s->addr + s->len != abs) {
+		if (grow((void **)&hs->seg, &hs->max_segments,
+			 hs->n_segments + 1, sizeof(*hs->seg)) < 0)
+			return -1;
+		s = &hs->seg[hs->n_segments++];
+		s->addr = abs;
+		s->len = 0;
+		s->first_block = hs->n_blocks;
+		s->n_blocks = 0;
+		hs->in_seg = 1;
+	}
+	s->len += len;
+	s->n_blocks++;
+	hs->n_blocks++;
+	return 0;
+}
+
+/* lay the tables out exactly like a container file */
+static int assemble(struct hex_state *hs, int target, struct fw_image *img)
+{
+	struct fw_header *hdr;
+	size_t seg_len = hs->n_segments * sizeof(struct fw_segment);
+	size_t blk_len = hs->n_blocks * sizeof(struct fw_block);
+	uint8_t *p;
+
+	img->len = sizeof(*hdr) + seg_len + blk_len + hs->data_len;
+	img->buf = calloc(1, img->len);
+	if (!img->buf)
+		return -1;
+	img->mapped = 0;
+
+	hdr = img->buf;
+	memcpy(hdr->magic, FW_MAGIC, sizeof(hdr->magic));
+	hdr->hdr_size = sizeof(*hdr);
+	hdr->target = target;
+	hdr->n_segments = hs->n_segments;
+	hdr->n_blocks = hs->n_blocks;
+	hdr->data_len = hs->data_len;
+
+	p = (uint8_t *)(hdr + 1);
+	memcpy(p, hs->seg, seg_len);
+	memcpy(p + seg_len, hs->blk, blk_len);
+	memcpy(p + seg_len + blk_len, hs->data, hs->data_len);
+	hdr->hash = fnv64(p, img->len - sizeof(*hdr));
+
+	img->hdr = hdr;
+	img->seg = (struct fw_segment *)p;
+	img->blk = (struct fw_block *)(p + seg_len);
+	img->data = p + seg_len + blk_len;
+	return 0;
+}
+
+static int load_hex(const char *path, FILE *f, int target,
+	struct fw_image *img)
+{
+	struct hex_state hs;
+	char line[HEX_LINELEN];
+	uint8_t rec[HEX_LINELEN / 2];
+	int linenum = 0, guess = 0, ret = -1;
+
+	memset(&hs, 0, sizeof(hs));
+	while (fgets(line, sizeof(line), f) != NULL) {
+		linenum++;
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0])
+			continue;
+		if (line[0] != ':')
+			break;
+		if (parse_record(line, rec) < 0) {
+			info(L_WARNING, "error: %s:%d: malformed record\n",
+				path, linenum);
+			goto out;
+		}
+
+		/* the Zensys images start with data, the ST ones don't */
+		if (!guess)
+			guess = rec[3] == FW_REC_DATA ? FW_TARGET_ZENSYS :
+				FW_TARGET_ST;
+
+		if (add_record(&hs, rec) < 0) {
+			info(L_WARNING, "error: out of memory\n");
+			goto out;
+		}
+		if (rec[3] == FW_REC_EOF)
+			break;
+	}
+
+	if (!hs.n_blocks) {
+		info(L_WARNING, "error: %s: no records\n", path);
+		goto out;
+	}
+	if (target && target != guess) {
+		info(L_WARNING, "error: %s looks like %s firmware, not %s\n",
+			path, fw_target_name(guess), fw_target_name(target));
+		goto out;
+	}
+	if (assemble(&hs, guess, img) < 0) {
+		info(L_WARNING, "error: out of memory\n");
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(hs.blk);
+	free(hs.seg);
+	free(hs.data);
+	return ret;
+}
+
+/*
+ * CONTAINERS
+ */
+
+static int verify(const char *path, struct fw_image *img)
+{
+	const struct fw_header *hdr = img->buf;
+	const uint8_t *p = (const uint8_t *)(hdr + 1);
+	uint64_t seg_len, blk_len;
+	uint32_t i;
+
+	if (img->len < sizeof(*hdr) || hdr->hdr_size != sizeof(*hdr) ||
+	    (hdr->target != FW_TARGET_ST && hdr->target != FW_TARGET_ZENSYS))
+		goto bad;
+
+	seg_len = (uint64_t)hdr->n_segments * sizeof(struct fw_segment);
+	blk_len = (uint64_t)hdr->n_blocks * sizeof(struct fw_block);
+	if (sizeof(*hdr) + seg_len + blk_len + hdr->data_len != img->len)
+		goto bad;
+
+	img->hdr = hdr;
+	img->seg = (const struct fw_segment *)p;
+	img->blk = (const struct fw_block *)(p + seg_len);
+	img->data = p + seg_len + blk_len;
+
+	for (i = 0; i < hdr->n_segments; i++)
+		if ((uint64_t)img->seg[i].first_block + img->seg[i].n_blocks >
+		    hdr->n_blocks)
+			goto bad;
+
+	for (i = 0; i < hdr->n_blocks; i++) {
+		const struct fw_block *b = &img->blk[i];
+
+		if ((uint64_t)b->offset + b->len > hdr->data_len)
+			goto bad;
+		if (crc32(img->data + b->offset, b->len) != b->crc) {
+			info(L_WARNING, "error: %s: CRC error in block %u\n",
+				path, i);
+			return -1;
+		}
+	}
+
+	if (fnv64(p, img->len - sizeof(*hdr)) != hdr->hash) {
+		info(L_WARNING, "error: %s: image hash mismatch\n", path);
+		return -1;
+	}
+	return 0;
+
+bad:
+	info(L_WARNING, "error: %s: corrupt firmware container\n", path);
+	return -1;
+}
+
+static int load_container(const char *path, int fd, int target,
+	struct fw_image *img)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		info(L_WARNING, "error: can't map %s\n", path);
+		return -1;
+	}
+	img->buf = map;
+	img->len = st.st_size;
+	img->mapped = 1;
+
+	if (verify(path, img) < 0)
+		goto err;
+	if (target && target != img->hdr->target) {
+		info(L_WARNING, "error: %s is %s firmware, not %s\n", path,
+			fw_target_name(img->hdr->target),
+			fw_target_name(target));
+		goto err;
+	}
+	return 0;
+
+err:
+	fw_free(img);
+	return -1;
+}
+
+int fw_load(const char *path, int target, struct fw_image *img)
+{
+	char magic[sizeof(FW_MAGIC) - 1];
+	FILE *f;
+	int ret;
+
+	memset(img, 0, sizeof(*img));
+	f = fopen(path, "r");
+	if (!f) {
+		info(L_WARNING, "error: can't open '%s'\n", path);
+		return -1;
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) == 1 &&
+	    memcmp(magic, FW_MAGIC, sizeof(magic)) == 0) {
+		ret = load_container(path, fileno(f), target, img);
+	} else {
+		rewind(f);
+		ret = load_hex(path, f, target, img);
+	}
+	fclose(f);
+	return ret;
+}
+
+int fw_save(const struct fw_image *img, const char *path)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	if (fwrite(img->buf, img->len, 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+void fw_free(struct fw_image *img)
+{
+	if (!img->buf)
+		return;
+	if (img->mapped)
+		munmap(img->buf, img->len);
+	else
+		free(img->buf);
+	img->buf = NULL;
+}
@@ -0,0 +1,96 @@
+/*
+ * vrctl - firmware images
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FIRMWARE_H_
+#define _FIRMWARE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FW_TARGET_ST		1	/* ST microcontroller flash */
+#define FW_TARGET_ZENSYS	2	/* Zensys Z-Wave module EEPROM */
+
+/* Intel HEX record types */
+#define FW_REC_DATA		0x00
+#define FW_REC_EOF		0x01
+
+struct fw_header {
+	char			magic[8];
+	uint32_t		hdr_size;
+	uint32_t		target;		/* FW_TARGET_* */
+	uint32_t		n_segments;
+	uint32_t		n_blocks;
+	uint32_t		data_len;
+	uint32_t		reserved0;
+	uint64_t		hash;		/* of everything after the header */
+	uint32_t		reserved[6];
+};
+
+/* a run of contiguous data, by absolute address */
+struct fw_segment {
+	uint32_t		addr;
+	uint32_t		len;
+	uint32_t		first_block;
+	uint32_t		n_blocks;
+};
+
+/* one record of the original .hex file */
+struct fw_block {
+	uint16_t		addr;		/* 16-bit record address */
+	uint8_t			type;		/* FW_REC_* */
+	uint8_t			len;
+	uint32_t		offset;		/* into the data area */
+	uint32_t		crc;		/* CRC32 of the data */
+};
+
+struct fw_image {
+	const struct fw_header	*hdr;
+	const struct fw_segment	*seg;
+	const struct fw_block	*blk;
+	const uint8_t		*data;
+
+	/* private */
+	void			*buf;
+	size_t			len;
+	int			mapped;
+};
+
+/* "st" or "zensys"; returns 0 if unknown */
+int fw_parse_target(const char *name);
+const char *fw_target_name(int target);
+
+/*
+ * Load a packed container (mmap'ed and fully verified) or an Intel HEX
+ * file.  For .hex files the target is guessed unless one is given.
+ * Returns -1 after printing an error.
+ */
+int fw_load(const char *path, int target, struct fw_image *img);
+int fw_save(const struct fw_image *img, const char *path);
+void fw_free(struct fw_image *img);
+
+/* ST bootloader frames end in the XOR of buf[0..len-1], stored at buf[len] */
+void fw_st_checksum(uint8_t *buf, int len);
+
+/* the data bytes of block i */
+static inline const uint8_t *fw_block_data(const struct fw_image *img,
+	int i)
+{
+	return img->data + img->blk[i].offset;
+}
+
+#endif /* _FIRMWARE_H_ */
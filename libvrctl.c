@@ -0,0 +1,788 @@
+/*
+ * libvrctl - Z-Wave VRC0P protocol library
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include "util.h"
+#include "arena.h"
+#include "vrctl_int.h"
+
+
+/* how long after a clean session the VRC0P is assumed to still be in sync */
+#define WARM_WINDOW_US		60000000LL
+#define WARM_PROBE_US		20000
+#define WARM_PROBE_MAX_US	320000
+
+static const char *errstr[VRCTL_EMAX] = {
+	[VRCTL_EOK]		= "success",
+	[VRCTL_EIO]		= "EOF or read/write error on tty",
+	[VRCTL_ETIMEDOUT]	= "timeout waiting for command response",
+	[VRCTL_EOVERFLOW]	= "input overflow from VRC0P",
+	[VRCTL_EBADRESP]	= "received bad response",
+	[VRCTL_EDEVICE]		= "VRC0P returned an error",
+	[VRCTL_ENODE]		= "node returned an error",
+	[VRCTL_ENOSYNC]		= "can't establish communication with VRC0P "
+				  "interface",
+	[VRCTL_EINVAL]		= "invalid argument",
+	[VRCTL_ELOCKED]		= "port is locked",
+	[VRCTL_EOPEN]		= "can't open port",
+	[VRCTL_ENOMEM]		= "out of memory",
+};
+
+/*
+ * ERROR HANDLING
+ */
+
+const char *vrctl_strerror(int err)
+{
+	if (err < 0)
+		err = -err;
+	if (err >= VRCTL_EMAX)
+		return "unknown error";
+	return errstr[err];
+}
+
+const char *vrctl_errmsg(struct vrctl_conn *v)
+{
+	return v->errmsg;
+}
+
+int vrctl_last_code(struct vrctl_conn *v)
+{
+	return v->last_code;
+}
+
+/* record the details of a failure; returns -err for convenience */
+static int set_error(struct vrctl_conn *v, int err, int code,
+	const char *fmt, ...)
+{
+	va_list ap;
+
+	/* a node NAKing a command doesn't mean we lost the VRC0P */
+	if (err != VRCTL_ENODE && err != VRCTL_EINVAL)
+		v->in_sync = 0;
+
+	v->last_code = code;
+	if (fmt) {
+		va_start(ap, fmt);
+		vsnprintf(v->errmsg, ERRLEN, fmt, ap);
+		va_end(ap);
+	} else {
+		snprintf(v->errmsg, ERRLEN, "%s", vrctl_strerror(err));
+	}
+	return -err;
+}
+
+/*
+ * SESSION STATE
+ */
+
+static void read_state(struct vrctl_conn *v)
+{
+	char path[PATHLEN];
+	struct session_state *st = &v->state;
+	FILE *f;
+
+	memset(st, 0, sizeof(*st));
+	if (get_tty_statename(v->dev, path, PATHLEN) < 0)
+		return;
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fscanf(f, "%lld %lld %lld %lld", &st->last_active_us,
+		   &st->last_update_us, &st->cold_sync_us,
+		   &st->update_us) != 4)
+		memset(st, 0, sizeof(*st));
+	fclose(f);
+}
+
+static void write_state(struct vrctl_conn *v)
+{
+	char path[PATHLEN];
+	struct session_state *st = &v->state;
+	FILE *f;
+
+	if (get_tty_statename(v->dev, path, PATHLEN) < 0)
+		return;
+	f = fopen(path, "w");
+	if (!f)
+		return;
+	fprintf(f, "%lld %lld %lld %lld\n", st->last_active_us,
+		st->last_update_us, st->cold_sync_us, st->update_us);
+	fclose(f);
+}
+
+void vrctl_forget_session(struct vrctl_conn *v)
+{
+	v->in_sync = 0;
+	v->state.last_active_us = 0;
+	v->state.last_update_us = 0;
+	write_state(v);
+}
+
+/*
+ * CONNECTION MANAGEMENT
+ */
+
+ARENA_DEFINE(conn_arena, "conns", sizeof(struct vrctl_conn), ARENA_CONNS);
+
+struct vrctl_conn *vrctl_open(const char *dev, int *err)
+{
+	return vrctl_open_wait(dev, 0, err);
+}
+
+struct vrctl_conn *vrctl_open_wait(const char *dev, int lock_timeout_ms,
+	int *err)
+{
+	struct vrctl_conn *v;
+	int ret = VRCTL_ENOMEM, saved_errno;
+
+	v = arena_alloc(&conn_arena);
+	if (!v)
+		goto out;
+	v->fd = -1;
+
+	ret = VRCTL_EOPEN;
+	if (strlen(dev) >= sizeof(v->dev)) {
+		errno = ENAMETOOLONG;
+		goto out;
+	}
+	strcpy(v->dev, dev);
+
+	ret = VRCTL_ELOCKED;
+	if (lock_tty_wait(v->dev, "vrctl", lock_timeout_ms) < 0)
+		goto out;
+	v->locked = 1;
+
+	ret = VRCTL_EOPEN;
+	v->port = port_open(v->dev);
+	if (!v->port)
+		goto out;
+	v->fd = v->port->fd;
+	if (port_set_speed(v->port, 9600, PARITY_NONE) < 0)
+		goto out;
+
+	read_state(v);
+	engine_init(v);
+
+	*err = 0;
+	return v;
+
+out:
+	/* preserve errno from the failing call for the caller's benefit */
+	saved_errno = errno;
+	if (v)
+		vrctl_close(v);
+	errno = saved_errno;
+	*err = -ret;
+	return NULL;
+}
+
+void vrctl_close(struct vrctl_conn *v)
+{
+	/* let the next invocation know it can skip the slow handshake */
+	if (v->in_sync) {
+		v->state.last_active_us = now_us();
+		write_state(v);
+	}
+	if (v->port)
+		port_close(v->port);
+	if (v->locked)
+		unlock_tty(v->dev);
+	arena_free(&conn_arena, v);
+}
+
+int vrctl_fd(struct vrctl_conn *v)
+{
+	return v->fd;
+}
+
+struct vrctl_port *vrctl_port(struct vrctl_conn *v)
+{
+	return v->port;
+}
+
+/*
+ * RESPONSE PARSING
+ */
+
+static int parse_num(char *str, int maxlen)
+{
+	int i, ret = 0;
+
+	for (i = 0; !maxlen || i < maxlen; i++) {
+		if (str[i] == 0)
+			break;
+		if (!isdigit(str[i]))
+			return -1;
+		ret = ret * 10 + str[i] - '0';
+	}
+	return ret;
+}
+
+static int parse_temp(char *buf, struct vrctl_resp *r)
+{
+	int fmt = parse_num(&buf[0], 3);
+	int bytes = fmt & 0x07;
+	int hi, lo;
+
+	if (fmt < 0)
+		return -1;
+
+	r->type1 = (fmt & 0x18) ? 'F' : 'C';
+	r->arg1_precision = (fmt >> 5) & 0x07;
+
+	if (!bytes || bytes > 2 || strlen(buf) < 3 + bytes*4)
+		return -1;
+
+	hi = parse_num(&buf[4], 3);
+	if (hi < 0)
+		return -1;
+	if (bytes == 1) {
+		r->arg1 = hi;
+	} else {
+		lo = parse_num(&buf[8], 3);
+		if (lo < 0)
+			return -1;
+		r->arg1 = (hi << 8) | (lo << 0);
+	}
+	return 0;
+}
+
+int vrctl_parse_resp(char *buf, struct vrctl_resp *r)
+{
+	int ret;
+
+	/*
+	 * Some valid inputs look like:
+	 * <E001
+	 * <X000
+	 * <N003L000 (light level)
+	 * <N004:049,005,001,009,075 (temp sensor report)
+	 *
+	 * Numbers are in decimal notation, typically 0-255.
+	 */
+
+	if (buf[0] != '<')
+		return -1;
+	if (buf[1] < 'A' || buf[1] > 'Z')
+		return -1;
+
+	r->type0 = buf[1];
+	ret = parse_num(&buf[2], 3);
+	if (ret < 0)
+		return -1;
+	r->arg0 = ret;
+
+	if (strlen(buf) < 5 || buf[5] == 0) {
+		r->type1 = 0;
+		return 0;
+	}
+
+	if (!strncmp(&buf[5], ":049,005,001,", 13) ||
+	    !strncmp(&buf[5], ":067,003,001,", 13) ||
+	    !strncmp(&buf[5], ":067,003,002,", 13)) {
+		/* parse temperature sensor result */
+		return parse_temp(&buf[18], r);
+	} else if (!strncmp(&buf[5], ":064,003,", 9)) {
+		/* parse thermostat mode */
+		r->type1 = 'M';
+		ret = parse_num(&buf[14], 3);
+	} else {
+		/* parse other result types (typically light level) */
+		r->type1 = buf[5];
+		ret = parse_num(&buf[6], 3);
+	}
+	if (ret < 0)
+		return -1;
+	r->arg1 = ret;
+
+	return 0;
+}
+
+/*
+ * LOW LEVEL I/O
+ */
+
+static void sync_done(struct vrctl_req *rq)
+{
+	*(int *)rq->priv = 1;
+}
+
+/* run one request to completion; returns its reply value or -err */
+static int run_req(struct vrctl_conn *v, struct vrctl_req *rq)
+{
+	int done = 0;
+
+	rq->done = sync_done;
+	rq->priv = &done;
+	vrctl_submit(v, rq);
+	while (!done)
+		vrctl_run_once(v, -1);
+
+	switch (-rq->ret) {
+	case VRCTL_EDEVICE:
+		return set_error(v, VRCTL_EDEVICE, rq->code,
+			"received E%03d while waiting for '%c' response",
+			rq->code, rq->expect);
+	case VRCTL_EBADRESP:
+	case VRCTL_EOVERFLOW:
+	case VRCTL_ETIMEDOUT:
+	case VRCTL_EIO:
+		return set_error(v, -rq->ret, 0, NULL);
+	}
+	return rq->ret;
+}
+
+/* returns the numeric argument of the expected response, or -err */
+static int send_then_recv(struct vrctl_conn *v, char expected_type,
+	char *fmt, ...)
+{
+	va_list ap;
+	struct vrctl_req rq;
+
+	va_start(ap, fmt);
+	vrctl_req_vinit(&rq, expected_type, 0, NULL, fmt, ap);
+	va_end(ap);
+	rq.prio = v->sync_prio;
+
+	return run_req(v, &rq);
+}
+
+/*
+ * The interface was used a moment ago, so skip the settling delay and
+ * probe right away, backing off quickly if it doesn't answer.
+ */
+static int warm_sync(struct vrctl_conn *v)
+{
+	char buf[BUFLEN];
+	int timeout, ret;
+
+	if (flush_bytes(v->port) < 0)
+		return -1;
+	for (timeout = WARM_PROBE_US; timeout <= WARM_PROBE_MAX_US;
+	     timeout <<= 1) {
+		if (write_line(v->port, "") < 0)
+			return -1;
+		ret = read_line(v->port, buf, BUFLEN, timeout);
+		if (ret > 0 && strcmp(buf, "<E000") == 0)
+			return 0;
+		if (flush_bytes(v->port) < 0)
+			return -1;
+	}
+	return -1;
+}
+
+static int cold_sync(struct vrctl_conn *v)
+{
+	char buf[BUFLEN];
+	int i, ret;
+
+	usleep(25000);
+	if (flush_bytes(v->port) < 0)
+		return set_error(v, VRCTL_EIO, 0, NULL);
+	/* hit "enter" on the serial line until we get <E000 back */
+	for (i = 0; i < 3; i++) {
+		if (write_line(v->port, "") < 0)
+			return set_error(v, VRCTL_EIO, 0, NULL);
+
+		ret = read_line(v->port, buf, BUFLEN, TIMEOUT);
+
+		if (ret > 0 && strcmp(buf, "<E000") == 0)
+			return 0;
+		sleep(1);
+	}
+	return set_error(v, VRCTL_ENOSYNC, 0, NULL);
+}
+
+int vrctl_sync(struct vrctl_conn *v)
+{
+	long long start = now_us(), elapsed;
+	struct session_state *st = &v->state;
+	int ret;
+
+	if (st->last_active_us &&
+	    start - st->last_active_us < WARM_WINDOW_US &&
+	    warm_sync(v) == 0) {
+		elapsed = now_us() - start;
+		info(L_VERBOSE, "warm start: synced in %lld ms "
+			"(saved ~%lld ms)\n", elapsed / 1000,
+			st->cold_sync_us > elapsed ?
+			(st->cold_sync_us - elapsed) / 1000 : 0);
+		v->in_sync = 1;
+		v->rxlen = v->rx_overflow = 0;
+		return 0;
+	}
+
+	ret = cold_sync(v);
+	if (ret < 0)
+		return ret;
+
+	st->cold_sync_us = now_us() - start;
+	info(L_VERBOSE, "cold start: synced in %lld ms\n",
+		st->cold_sync_us / 1000);
+	v->in_sync = 1;
+	v->rxlen = v->rx_overflow = 0;
+	return 0;
+}
+
+int vrctl_update_nodes(struct vrctl_conn *v)
+{
+	long long start = now_us();
+	int ret = send_then_recv(v, 'E', ">UP");
+
+	if (ret < 0)
+		return ret;
+	v->state.last_update_us = now_us();
+	v->state.update_us = v->state.last_update_us - start;
+	return 0;
+}
+
+int vrctl_update_nodes_deferred(struct vrctl_conn *v, int max_age)
+{
+	struct session_state *st = &v->state;
+
+	if (max_age >= 0 && st->last_update_us &&
+	    now_us() - st->last_update_us < (long long)max_age * 1000000) {
+		info(L_VERBOSE, "skipping >UP, last run %lld s ago "
+			"(saved ~%lld ms)\n",
+			(now_us() - st->last_update_us) / 1000000,
+			st->update_us / 1000);
+		return 1;
+	}
+	return vrctl_update_nodes(v);
+}
+
+/*
+ * NODE COMMANDS
+ */
+
+static void op_sync_done(struct vrctl_op *op)
+{
+	*(int *)op->priv = 1;
+}
+
+/* run an operation to completion; returns its result or -err */
+static int run_op(struct vrctl_conn *v, int cmd, int nodeid, int arg,
+	char units, struct vrctl_op *op)
+{
+	int done = 0;
+
+	memset(op, 0, sizeof(*op));
+	op->cmd = cmd;
+	op->nodeid = nodeid;
+	op->arg = arg;
+	op->units = units;
+	op->done = op_sync_done;
+	op->priv = &done;
+	op->prio = v->sync_prio;
+
+	vrctl_op_start(v, op);
+	while (!done)
+		vrctl_run_once(v, -1);
+
+	if (op->ret < 0)
+		return set_error(v, -op->ret, op->code, "%s", op->errmsg);
+	return op->ret;
+}
+
+static void op_count_done(struct vrctl_op *op)
+{
+	(*(int *)op->priv)--;
+}
+
+int vrctl_run_ops(struct vrctl_conn *v, struct vrctl_op *ops, int n)
+{
+	int i, left = n, failed = 0;
+
+	for (i = 0; i < n; i++) {
+		ops[i].done = op_count_done;
+		ops[i].priv = &left;
+		vrctl_op_start(v, &ops[i]);
+	}
+	while (left)
+		vrctl_run_once(v, -1);
+
+	for (i = n - 1; i >= 0; i--) {
+		if (ops[i].ret >= 0)
+			continue;
+		set_error(v, -ops[i].ret, ops[i].code, "%s", ops[i].errmsg);
+		failed++;
+	}
+	return failed;
+}
+
+void vrctl_set_priority(struct vrctl_conn *v, int prio)
+{
+	if (prio >= 0 && prio < VRCTL_PRIO_MAX)
+		v->sync_prio = prio;
+}
+
+static int run_simple(struct vrctl_conn *v, int cmd, int nodeid, int arg)
+{
+	struct vrctl_op op;
+
+	return run_op(v, cmd, nodeid, arg, 0, &op);
+}
+
+int vrctl_on(struct vrctl_conn *v, int nodeid)
+{
+	return run_simple(v, VRCTL_CMD_ON, nodeid, 0);
+}
+
+int vrctl_off(struct vrctl_conn *v, int nodeid)
+{
+	return run_simple(v, VRCTL_CMD_OFF, nodeid, 0);
+}
+
+int vrctl_bounce(struct vrctl_conn *v, int nodeid)
+{
+	return run_simple(v, VRCTL_CMD_BOUNCE, nodeid, 0);
+}
+
+int vrctl_level(struct vrctl_conn *v, int nodeid, int level)
+{
+	return run_simple(v, VRCTL_CMD_LEVEL, nodeid, level);
+}
+
+int vrctl_scene(struct vrctl_conn *v, int nodeid, int scene)
+{
+	return run_simple(v, VRCTL_CMD_SCENE, nodeid, scene);
+}
+
+int vrctl_lock(struct vrctl_conn *v, int nodeid, int locked)
+{
+	return run_simple(v, locked ? VRCTL_CMD_LOCK : VRCTL_CMD_UNLOCK,
+		nodeid, 0);
+}
+
+int vrctl_report(struct vrctl_conn *v, int nodeid, int to, int enable)
+{
+	return run_simple(v, enable ? VRCTL_CMD_REPORT : VRCTL_CMD_UNREPORT,
+		nodeid, to);
+}
+
+int vrctl_status(struct vrctl_conn *v, int nodeid)
+{
+	return run_simple(v, VRCTL_CMD_STATUS, nodeid, 0);
+}
+
+int vrctl_toggle(struct vrctl_conn *v, int nodeid)
+{
+	return run_simple(v, VRCTL_CMD_TOGGLE, nodeid, 0);
+}
+
+int vrctl_fade(struct vrctl_conn *v, int nodeid, int level, int time_ms)
+{
+	struct vrctl_op op;
+
+	memset(&op, 0, sizeof(op));
+	op.cmd = VRCTL_CMD_FADE;
+	op.nodeid = nodeid;
+	op.arg = level;
+	op.time_ms = time_ms;
+	op.prio = v->sync_prio;
+	vrctl_run_ops(v, &op, 1);
+	return op.ret;
+}
+
+/*
+ * The VRC0P accepts a list of nodes in one frame (">N2,3,5ON"), so after
+ * reading every status at once the nodes only need one frame per
+ * direction, plus one per VRCTL_FRAMELEN worth of node numbers.  A list
+ * frame can't say which of its nodes failed, so if one fails its nodes
+ * are retried one at a time to find out.
+ */
+
+static void list_done(struct vrctl_req *rq)
+{
+	(*(int *)rq->priv)--;
+}
+
+static void submit_list(struct vrctl_conn *v, struct vrctl_req *rq,
+	const char *list, int on, int *left)
+{
+	vrctl_req_init(rq, 'X', 0, NULL, ">N%s%s", list, on ? "ON" : "OF");
+	rq->done = list_done;
+	rq->priv = left;
+	rq->prio = v->sync_prio;
+	(*left)++;
+	vrctl_submit(v, rq);
+}
+
+/*
+ * Queue frames for every node whose status says it should go on (or off).
+ * frame_of[i] records which of rqs[] carries ops[i]; returns the new
+ * number of frames.
+ */
+static int send_lists(struct vrctl_conn *v, struct vrctl_op *ops, int n,
+	int on, int *frame_of, struct vrctl_req *rqs, int n_rqs, int *left)
+{
+	char list[VRCTL_FRAMELEN];
+	int i, len = 0, max = VRCTL_FRAMELEN - sizeof(">NON");
+
+	for (i = 0; i < n; i++) {
+		if (ops[i].ret < 0 || (ops[i].ret == 0) != on)
+			continue;
+		/* room for ",232"? */
+		if (len && len + 4 > max) {
+			submit_list(v, &rqs[n_rqs++], list, on, left);
+			len = 0;
+		}
+		len += sprintf(list + len, "%s%d", len ? "," : "",
+			ops[i].nodeid);
+		frame_of[i] = n_rqs;
+	}
+	if (len)
+		submit_list(v, &rqs[n_rqs++], list, on, left);
+	return n_rqs;
+}
+
+/* scratch arrays for one group of up to VRCTL_MAX_NODEID nodes */
+ARENA_DEFINE(group_rq_arena, "group_rqs",
+	VRCTL_MAX_NODEID * sizeof(struct vrctl_req), 1);
+ARENA_DEFINE(group_op_arena, "group_ops",
+	VRCTL_MAX_NODEID * sizeof(struct vrctl_op), 1);
+ARENA_DEFINE(group_idx_arena, "group_idx", VRCTL_MAX_NODEID * sizeof(int), 1);
+
+int vrctl_toggle_group(struct vrctl_conn *v, struct vrctl_op *ops, int n)
+{
+	struct vrctl_req *rqs;
+	struct vrctl_op *retry;
+	int *frame_of;
+	int i, j, n_rqs, n_retry = 0, left = 0, failed = 0;
+
+	rqs = arena_alloc_len(&group_rq_arena, n * sizeof(*rqs));
+	retry = arena_alloc_len(&group_op_arena, n * sizeof(*retry));
+	frame_of = arena_alloc_len(&group_idx_arena, n * sizeof(*frame_of));
+	if (!rqs || !retry || !frame_of) {
+		arena_free(&group_rq_arena, rqs);
+		arena_free(&group_op_arena, retry);
+		arena_free(&group_idx_arena, frame_of);
+		return set_error(v, VRCTL_ENOMEM, 0, NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		ops[i].cmd = VRCTL_CMD_STATUS;
+		ops[i].prio = v->sync_prio;
+	}
+	vrctl_run_ops(v, ops, n);
+
+	/* nodes which are off get switched on, and vice versa */
+	n_rqs = send_lists(v, ops, n, 1, frame_of, rqs, 0, &left);
+	send_lists(v, ops, n, 0, frame_of, rqs, n_rqs, &left);
+	while (left)
+		vrctl_run_once(v, -1);
+
+	for (i = 0; i < n; i++) {
+		if (ops[i].ret < 0 || rqs[frame_of[i]].ret == 0)
+			continue;
+		retry[n_retry].cmd = ops[i].ret ? VRCTL_CMD_OFF :
+			VRCTL_CMD_ON;
+		retry[n_retry].nodeid = ops[i].nodeid;
+		retry[n_retry].prio = v->sync_prio;
+		n_retry++;
+	}
+	if (n_retry) {
+		info(L_VERBOSE, "%s: retrying %d node(s) one at a time\n",
+			__func__, n_retry);
+		vrctl_run_ops(v, retry, n_retry);
+	}
+
+	for (i = j = 0; i < n; i++) {
+		int on = ops[i].ret == 0;
+
+		if (ops[i].ret < 0)
+			continue;
+		if (rqs[frame_of[i]].ret != 0)
+			ops[i] = retry[j++];
+		ops[i].cmd = VRCTL_CMD_TOGGLE;
+		if (ops[i].ret == 0)
+			ops[i].ret = on ? 255 : 0;
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		if (ops[i].ret >= 0)
+			continue;
+		set_error(v, -ops[i].ret, ops[i].code, "%s", ops[i].errmsg);
+		failed++;
+	}
+
+	arena_free(&group_rq_arena, rqs);
+	arena_free(&group_op_arena, retry);
+	arena_free(&group_idx_arena, frame_of);
+	return failed;
+}
+
+/*
+ * THERMOSTATS
+ */
+
+int vrctl_temp(struct vrctl_conn *v, int nodeid, struct vrctl_temp *t)
+{
+	struct vrctl_op op;
+	int ret;
+
+	ret = run_op(v, VRCTL_CMD_TEMP, nodeid, 0, 0, &op);
+	if (ret >= 0)
+		*t = op.temp;
+	return ret;
+}
+
+int vrctl_setpoint(struct vrctl_conn *v, int nodeid, struct vrctl_temp *t)
+{
+	struct vrctl_op op;
+	int ret;
+
+	ret = run_op(v, VRCTL_CMD_SETPOINT, nodeid, 0, 0, &op);
+	if (ret > 0)
+		*t = op.temp;
+	return ret;
+}
+
+int vrctl_fan(struct vrctl_conn *v, int nodeid, int enable)
+{
+	return run_simple(v, VRCTL_CMD_FAN, nodeid, enable);
+}
+
+int vrctl_thermostat(struct vrctl_conn *v, int nodeid, int mode,
+	int setpoint, char units)
+{
+	struct vrctl_op op;
+
+	if (mode == VRCTL_MODE_OFF)
+		setpoint = 0;
+	return run_op(v, mode == VRCTL_MODE_COOL ? VRCTL_CMD_COOL :
+		VRCTL_CMD_HEAT, nodeid, setpoint, units, &op);
+}
+
+/*
+ * NETWORK ENUMERATION
+ */
+
+int vrctl_find_node(struct vrctl_conn *v, int gen_class, int instance)
+{
+	return send_then_recv(v, 'F', ">?FI0,%d,0,%d", gen_class, instance);
+}
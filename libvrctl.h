@@ -0,0 +1,462 @@
+/*
+ * libvrctl - Z-Wave VRC0P protocol library
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBVRCTL_H_
+#define _LIBVRCTL_H_
+
+#define VRCTL_NODEID_ALL	-2
+#define VRCTL_MAX_NODEID	232
+
+/*
+ * Error codes.  Library calls return the negated code on failure, e.g.
+ * -VRCTL_ETIMEDOUT.  vrctl_errmsg() has a human-readable description of
+ * the most recent failure and vrctl_last_code() has the raw Ennn/Xnnn
+ * number reported by the VRC0P, if any.
+ */
+enum {
+	VRCTL_EOK = 0,
+	VRCTL_EIO,		/* EOF or read/write error on the port */
+	VRCTL_ETIMEDOUT,	/* no response from the VRC0P */
+	VRCTL_EOVERFLOW,	/* response line was too long */
+	VRCTL_EBADRESP,		/* unparseable response */
+	VRCTL_EDEVICE,		/* VRC0P returned Ennn */
+	VRCTL_ENODE,		/* target node returned Xnnn */
+	VRCTL_ENOSYNC,		/* can't establish communication */
+	VRCTL_EINVAL,		/* bad argument */
+	VRCTL_ELOCKED,		/* port is locked by another process */
+	VRCTL_EOPEN,		/* can't open or configure the port */
+	VRCTL_ENOMEM,		/* out of memory */
+	VRCTL_EMAX,
+};
+
+#define VRCTL_MODE_OFF		0
+#define VRCTL_MODE_HEAT		1
+#define VRCTL_MODE_COOL		2
+
+struct vrctl_conn;
+struct vrctl_port;
+
+struct vrctl_temp {
+	unsigned int		value;		/* scaled by 10^precision */
+	unsigned int		precision;	/* number of decimal places */
+	char			units;		/* 'F' or 'C' */
+};
+
+/*
+ * Connection management.  dev is a tty (e.g. "/dev/ttyS0") or a raw TCP
+ * serial bridge ("tcp:host:port").
+ */
+struct vrctl_conn *vrctl_open(const char *dev, int *err);
+
+/*
+ * Like vrctl_open(), but if the port is locked, wait in line for up to
+ * lock_timeout_ms (or forever if < 0).  Waiters are served in FIFO order.
+ */
+struct vrctl_conn *vrctl_open_wait(const char *dev, int lock_timeout_ms,
+	int *err);
+
+void vrctl_close(struct vrctl_conn *v);
+int vrctl_fd(struct vrctl_conn *v);
+
+/* raw byte-level access (see port.h), e.g. for firmware upgrades */
+struct vrctl_port *vrctl_port(struct vrctl_conn *v);
+
+/*
+ * Establish communication with the VRC0P.  If the port was used cleanly
+ * within the last minute, a fast probe is tried before falling back to
+ * the full handshake.
+ */
+int vrctl_sync(struct vrctl_conn *v);
+
+/* don't trust the saved session state (e.g. before a firmware upgrade) */
+void vrctl_forget_session(struct vrctl_conn *v);
+
+/* ask the VRC0P to refresh its node list (>UP) */
+int vrctl_update_nodes(struct vrctl_conn *v);
+
+/*
+ * Like vrctl_update_nodes(), but skip the refresh (returning 1) if the
+ * last one completed less than max_age seconds ago.  max_age < 0 always
+ * refreshes.
+ */
+int vrctl_update_nodes_deferred(struct vrctl_conn *v, int max_age);
+
+/* error reporting */
+const char *vrctl_strerror(int err);
+const char *vrctl_errmsg(struct vrctl_conn *v);
+int vrctl_last_code(struct vrctl_conn *v);
+
+/*
+ * Node commands.  nodeid may be VRCTL_NODEID_ALL where noted.
+ * Unless otherwise specified, these return 0 on success.
+ */
+int vrctl_on(struct vrctl_conn *v, int nodeid);			/* ALL ok */
+int vrctl_off(struct vrctl_conn *v, int nodeid);		/* ALL ok */
+int vrctl_bounce(struct vrctl_conn *v, int nodeid);		/* ALL ok */
+int vrctl_level(struct vrctl_conn *v, int nodeid, int level);	/* ALL ok */
+int vrctl_scene(struct vrctl_conn *v, int nodeid, int scene);	/* ALL ok */
+int vrctl_lock(struct vrctl_conn *v, int nodeid, int locked);
+
+/* returns the current dim level (0-255) */
+int vrctl_status(struct vrctl_conn *v, int nodeid);
+
+/* returns the new dim level (0 or 255) */
+int vrctl_toggle(struct vrctl_conn *v, int nodeid);
+
+/*
+ * Move a dimmer from its current level to level over time_ms.  Fades to
+ * different nodes run side by side, sharing the link (see ramp.c); a new
+ * fade on a node replaces the one already running there.
+ */
+int vrctl_fade(struct vrctl_conn *v, int nodeid, int level, int time_ms);
+
+/* thermostats */
+int vrctl_temp(struct vrctl_conn *v, int nodeid, struct vrctl_temp *t);
+int vrctl_fan(struct vrctl_conn *v, int nodeid, int enable);
+int vrctl_thermostat(struct vrctl_conn *v, int nodeid, int mode,
+	int setpoint, char units);
+
+/* returns the thermostat mode; *t is only filled in if mode != OFF */
+int vrctl_setpoint(struct vrctl_conn *v, int nodeid, struct vrctl_temp *t);
+
+/*
+ * Have a thermostat or sensor send its reports (temperature, mode,
+ * setpoint, ...) to node "to", normally the VRC0P itself, whenever they
+ * change, or stop doing so.  This adds "to" to the device's association
+ * group 1, which is where most devices send their unsolicited reports.
+ * The reports then show up as <N frames (see vrctl_set_report_cb()).
+ */
+int vrctl_report(struct vrctl_conn *v, int nodeid, int to, int enable);
+
+/*
+ * Priority class (VRCTL_PRIO_*) of the frames sent by the calls above,
+ * for programs which also submit asynchronous requests.  vrctl_discover()
+ * always runs in the background class.
+ */
+void vrctl_set_priority(struct vrctl_conn *v, int prio);
+
+/* returns the node ID of the Nth instance of gen_class, or 0 if none */
+int vrctl_find_node(struct vrctl_conn *v, int gen_class, int instance);
+
+/*
+ * NETWORK DISCOVERY
+ *
+ * vrctl_discover() walks every known Z-Wave generic device class and
+ * records which nodes belong to each.  Given the result of an earlier scan
+ * it only re-probes the classes whose population looks different, and
+ * bumps the generation counter if anything changed.
+ */
+
+#define VRCTL_CAP_SWITCH	0x01		/* on/off */
+#define VRCTL_CAP_DIMMER	0x02		/* level */
+#define VRCTL_CAP_THERMOSTAT	0x04
+#define VRCTL_CAP_LOCK		0x08
+#define VRCTL_CAP_SENSOR	0x10
+#define VRCTL_CAP_METER		0x20
+#define VRCTL_CAP_CONTROLLER	0x40
+
+struct vrctl_node {
+	int			gen_class;	/* 0 = no such node */
+	int			instance;
+	unsigned int		caps;		/* VRCTL_CAP_* */
+	unsigned int		generation;	/* scan that last changed it */
+};
+
+struct vrctl_netinfo {
+	unsigned int		generation;
+	int			n_nodes;
+	int			probes;		/* frames sent by the last scan */
+	struct vrctl_node	node[VRCTL_MAX_NODEID + 1];
+};
+
+/*
+ * prev may be NULL if there is no earlier scan.  full re-probes every
+ * class but still compares against prev.
+ */
+int vrctl_discover(struct vrctl_conn *v, const struct vrctl_netinfo *prev,
+	struct vrctl_netinfo *ni, int full);
+
+const char *vrctl_class_name(int gen_class);
+
+/* a saved scan is only loaded back for the same port */
+int vrctl_netinfo_load(const char *path, const char *dev,
+	struct vrctl_netinfo *ni);
+int vrctl_netinfo_save(const char *path, const char *dev,
+	const struct vrctl_netinfo *ni);
+
+/*
+ * ASYNCHRONOUS INTERFACE
+ *
+ * Each struct vrctl_req is one command frame.  Submitted requests are
+ * transmitted in order (within their priority class, see below) and the
+ * done callback runs once the VRC0P's reply (and optionally a report from
+ * the target node) has been received, or the request failed.  The caller
+ * owns the request and must keep it around until then.
+ *
+ * Programs with their own event loop should watch vrctl_fd() for input,
+ * call vrctl_handle_input() when it is readable, and call
+ * vrctl_handle_timers() once vrctl_next_deadline() passes.  Everyone else
+ * can simply call vrctl_run_once() in a loop.
+ *
+ * <N reports which don't belong to any request are passed to the report
+ * callback.
+ */
+
+#define VRCTL_FRAMELEN		64
+#define VRCTL_ERRLEN		128
+
+struct vrctl_resp {
+	char			type0;
+	unsigned int		arg0;
+	char			type1;
+	unsigned int		arg1;
+	unsigned int		arg1_precision;
+};
+
+/*
+ * Queued frames are sent in order within a priority class, and higher
+ * classes go first.  A lower class which has been passed over several
+ * times in a row gets the next slot, so it is never starved outright.
+ */
+enum {
+	VRCTL_PRIO_INTERACTIVE = 0,	/* someone is waiting on it (default) */
+	VRCTL_PRIO_AUTOMATION,		/* rules, scheduled actions */
+	VRCTL_PRIO_BACKGROUND,		/* polling, discovery */
+	VRCTL_PRIO_MAX,
+};
+
+struct vrctl_req;
+
+typedef void (*vrctl_done_cb)(struct vrctl_req *rq);
+typedef void (*vrctl_report_cb)(struct vrctl_resp *r, const char *line,
+	void *arg);
+
+struct vrctl_req {
+	/* set up by vrctl_req_init() */
+	char			frame[VRCTL_FRAMELEN];
+	char			expect;		/* 'X', 'E' or 'F' */
+	int			nodeid;		/* for reports and messages */
+	const char		*report;	/* report types to wait for */
+	vrctl_done_cb		done;
+	void			*priv;
+	int			prio;		/* VRCTL_PRIO_* */
+
+	/* results */
+	int			ret;		/* arg of the reply, or -VRCTL_E* */
+	int			code;		/* raw Ennn for VRCTL_EDEVICE */
+	struct vrctl_resp	r;		/* matching report, if any */
+
+	/* private to the library */
+	int			state;
+	int			acked;		/* got <E000, awaiting X/F */
+	int			resent;		/* requeued after a resync */
+	long long		sent;
+	long long		deadline;
+	struct vrctl_req	*next;
+};
+
+/*
+ * Build a request for the frame described by fmt.  If report is non-NULL
+ * (e.g. "L" for a dim level) the request stays open until a <N report of
+ * one of those types arrives from nodeid.
+ */
+void vrctl_req_init(struct vrctl_req *rq, char expect, int nodeid,
+	const char *report, const char *fmt, ...)
+	__attribute__ ((format (printf, 5, 6)));
+
+void vrctl_submit(struct vrctl_conn *v, struct vrctl_req *rq);
+int vrctl_pending(struct vrctl_conn *v);
+void vrctl_set_report_cb(struct vrctl_conn *v, vrctl_report_cb cb,
+	void *arg);
+
+/*
+ * Frames are pipelined up to a window which grows while the VRC0P keeps up
+ * and shrinks on errors, input overflow or rising latency.  This returns
+ * its current size.
+ */
+int vrctl_window(struct vrctl_conn *v);
+
+int vrctl_handle_input(struct vrctl_conn *v);
+void vrctl_handle_timers(struct vrctl_conn *v);
+
+/* CLOCK_MONOTONIC time in microseconds, or 0 if nothing is pending */
+long long vrctl_next_deadline(struct vrctl_conn *v);
+
+/* wait up to timeout_ms (< 0: until the next deadline) and dispatch */
+int vrctl_run_once(struct vrctl_conn *v, int timeout_ms);
+
+/*
+ * Timers run from vrctl_handle_timers() and count toward
+ * vrctl_next_deadline(), so they fit into the same event loop.
+ */
+struct vrctl_timer;
+
+typedef void (*vrctl_timer_cb)(struct vrctl_timer *t);
+
+struct vrctl_timer {
+	vrctl_timer_cb		fn;
+	void			*priv;
+
+	/* private to the library */
+	long long		expires;
+	struct vrctl_timer	*next;
+};
+
+void vrctl_timer_add(struct vrctl_conn *v, struct vrctl_timer *t,
+	long long delay_us);
+void vrctl_timer_del(struct vrctl_conn *v, struct vrctl_timer *t);
+
+/*
+ * OPERATIONS
+ *
+ * A struct vrctl_op is one user-level command (e.g. "toggle node 5"),
+ * which may take several frames and delays to complete.  Operations are
+ * resumable state machines driven by the engine, so any number of them
+ * can be in progress at once; their frames are interleaved on the TX
+ * queue.  The blocking calls above are thin wrappers around these.
+ */
+
+enum {
+	VRCTL_CMD_ON = 0,
+	VRCTL_CMD_OFF,
+	VRCTL_CMD_BOUNCE,
+	VRCTL_CMD_TOGGLE,
+	VRCTL_CMD_LEVEL,	/* arg: dim level */
+	VRCTL_CMD_STATUS,
+	VRCTL_CMD_LOCK,
+	VRCTL_CMD_UNLOCK,
+	VRCTL_CMD_SCENE,	/* arg: scene number */
+	VRCTL_CMD_TEMP,
+	VRCTL_CMD_SETPOINT,
+	VRCTL_CMD_FAN,		/* arg: 1 = on, 0 = auto */
+	VRCTL_CMD_HEAT,		/* arg: setpoint (0 = off), units */
+	VRCTL_CMD_COOL,		/* arg: setpoint (0 = off), units */
+	VRCTL_CMD_FADE,		/* arg: dim level, time_ms */
+	VRCTL_CMD_REPORT,	/* arg: node to send reports to */
+	VRCTL_CMD_UNREPORT,	/* arg: node to stop sending reports to */
+	VRCTL_CMD_MAX,
+};
+
+struct vrctl_op;
+
+typedef void (*vrctl_op_cb)(struct vrctl_op *op);
+
+struct vrctl_op {
+	/* filled in by the caller */
+	int			cmd;
+	int			nodeid;
+	int			arg;
+	char			units;
+	int			time_ms;
+	vrctl_op_cb		done;
+	void			*priv;
+	int			prio;		/* VRCTL_PRIO_* */
+
+	/*
+	 * Results: ret is the same value the corresponding blocking call
+	 * would return (e.g. the dim level for STATUS and TOGGLE, the mode
+	 * for SETPOINT).
+	 */
+	int			ret;
+	int			code;
+	struct vrctl_temp	temp;
+	char			errmsg[VRCTL_ERRLEN];
+
+	/* private to the library */
+	struct vrctl_conn	*v;
+	int			state;
+	const char		*what;
+	struct vrctl_req	rq;
+	struct vrctl_timer	timer;
+
+	/* fades in progress (ramp.c) */
+	struct vrctl_op		*ramp_next;
+	long long		ramp_start;
+	int			ramp_from, ramp_sent, ramp_busy;
+};
+
+void vrctl_op_start(struct vrctl_conn *v, struct vrctl_op *op);
+
+/*
+ * Blocking helper: start all n operations at once (their done and priv
+ * fields are overwritten) and return once every one has finished.  While
+ * one is waiting out a delay the others keep going, so e.g. bouncing a
+ * dozen nodes costs one bounce delay rather than a dozen.  Returns the
+ * number of operations which failed; vrctl_errmsg() describes the first.
+ */
+int vrctl_run_ops(struct vrctl_conn *v, struct vrctl_op *ops, int n);
+
+/*
+ * Toggle the nodes in ops[0..n-1].nodeid together: all of their statuses
+ * are read at once, then the ones that were off are switched on and the
+ * rest off using as few multi-node frames as possible.  Each op ends up
+ * like a finished VRCTL_CMD_TOGGLE (ret is the new level or -err; the
+ * other fields are overwritten).  Returns the number of nodes which
+ * failed; vrctl_errmsg() describes the first.
+ */
+int vrctl_toggle_group(struct vrctl_conn *v, struct vrctl_op *ops, int n);
+
+const char *vrctl_cmd_name(int cmd);
+
+/*
+ * LINK STATISTICS
+ *
+ * Once a table is attached with vrctl_set_stats(), every frame sent on
+ * behalf of an operation is counted against its target node and command:
+ * how often it was tried, how it ended, and how long the round trip took.
+ * The table can be saved and loaded back across invocations so that flaky
+ * nodes stand out over time.
+ */
+
+/*
+ * RTT histogram: bucket i counts replies faster than (1 << i) ms, and the
+ * last bucket counts everything slower
+ */
+#define VRCTL_RTT_BUCKETS	14
+
+struct vrctl_link_stats {
+	unsigned int		attempts;
+	unsigned int		successes;
+	unsigned int		timeouts;
+	unsigned int		xerrs;		/* node returned Xnnn */
+	int			last_x;		/* most recent Xnnn code */
+	unsigned int		rtt[VRCTL_RTT_BUCKETS];
+};
+
+struct vrctl_stats;
+
+/* returns an empty table if path is missing or belongs to another port */
+struct vrctl_stats *vrctl_stats_load(const char *path, const char *dev);
+int vrctl_stats_save(const struct vrctl_stats *st, const char *path,
+	const char *dev);
+void vrctl_stats_free(struct vrctl_stats *st);
+
+/* st may be NULL to stop counting */
+void vrctl_set_stats(struct vrctl_conn *v, struct vrctl_stats *st);
+
+/*
+ * Fill in ls for one command, or the sum of all commands if cmd < 0.
+ * Returns the number of attempts.
+ */
+int vrctl_stats_get(const struct vrctl_stats *st, int nodeid, int cmd,
+	struct vrctl_link_stats *ls);
+
+/* upper bound of the pct'th percentile RTT, in ms (0: no samples) */
+unsigned int vrctl_stats_rtt_ms(const struct vrctl_link_stats *ls, int pct);
+
+#endif /* _LIBVRCTL_H_ */
@@ -0,0 +1,423 @@
+/*
+ * vrctl_loadgen - end-to-end throughput and latency test
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Keeps up to -c operations in flight through the library's engine for -d
+ * seconds, picking each command at random from the -m mix and each target
+ * from the -n node list.  Latency is measured per operation, from
+ * vrctl_op_start() until its done callback, so it includes time spent
+ * queued behind the other operations.
+ *
+ * With -r the operations are started at a fixed rate instead of as fast
+ * as they complete (an open loop).  Starts which find all -c slots busy
+ * are counted as missed rather than queued up, so the latency figures
+ * stay honest when the link can't keep up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include "util.h"
+#include "libvrctl.h"
+#include "alias.h"
+
+#define DEFAULT_DEV		"/dev/vrc0p"
+#define DEFAULT_CONC		4
+#define DEFAULT_SECS		10
+#define DEFAULT_MIX		"on:2,off:2,level:2,status:3,temp:1"
+#define MAX_CONC		256
+
+struct mix_entry {
+	const char		*name;
+	int			cmd;
+	int			weight;
+
+	/* results */
+	unsigned int		n_ok, n_err;
+	long long		*lat;		/* usecs, successful ops only */
+	int			n_lat, lat_size;
+};
+
+static struct mix_entry mix[] = {
+	{ "on",		VRCTL_CMD_ON },
+	{ "off",	VRCTL_CMD_OFF },
+	{ "level",	VRCTL_CMD_LEVEL },
+	{ "status",	VRCTL_CMD_STATUS },
+	{ "temp",	VRCTL_CMD_TEMP },
+};
+
+struct slot {
+	struct vrctl_op		op;
+	struct mix_entry	*m;
+	long long		start;
+	int			busy;
+};
+
+static struct vrctl_conn *v;
+static struct slot slots[MAX_CONC];
+static int n_slots = DEFAULT_CONC, n_busy, total_weight;
+static int nodes[VRCTL_MAX_NODEID], n_nodes;
+static int temp_nodes[VRCTL_MAX_NODEID], n_temp_nodes;
+static int stopping, rate;
+static unsigned int n_missed, errs[VRCTL_EMAX];
+static struct vrctl_timer rate_timer;
+static long long rate_next;
+
+static void usage(void)
+{
+	printf("usage: vrctl_loadgen [ <options> ] -n <nodes>\n\n");
+	printf("options:\n");
+	printf("  -x, --port=PORT     set port to use (default: " DEFAULT_DEV "), or\n");
+	printf("                      tcp:HOST:PORT for a serial bridge\n");
+	printf("  -n, --nodes=LIST    target nodes, e.g. 2,3,7\n");
+	printf("  -t, --temp=LIST     target nodes for temp (default: --nodes)\n");
+	printf("  -m, --mix=MIX       command weights (default: " DEFAULT_MIX ")\n");
+	printf("  -c, --conc=N        operations in flight (default: %d)\n",
+		DEFAULT_CONC);
+	printf("  -d, --duration=SECS how long to run (default: %d)\n",
+		DEFAULT_SECS);
+	printf("  -r, --rate=N        start N operations/sec instead of as many\n");
+	printf("                      as possible\n");
+	printf("  -v, --verbose       print every failed operation\n");
+	printf("  -h, --help          this help\n");
+	exit(1);
+}
+
+static void parse_nodes(const char *arg, int *list, int *n)
+{
+	struct nodeset set;
+	int id;
+
+	if (alias_eval(arg, &set) < 0 || ns_count(&set) == 0)
+		die("error: bad node list '%s'\n", arg);
+	*n = 0;
+	ns_for_each(id, &set)
+		list[(*n)++] = id;
+}
+
+/* <name>:<weight>[,...]; commands which aren't listed get weight 0 */
+static void parse_mix(const char *arg)
+{
+	char buf[256], *tok, *p, *endp;
+	int i;
+
+	if (strlen(arg) >= sizeof(buf))
+		die("error: bad mix '%s'\n", arg);
+	strcpy(buf, arg);
+	for (i = 0; i < ARRAY_SIZE(mix); i++)
+		mix[i].weight = 0;
+
+	for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+		p = strchr(tok, ':');
+		if (!p)
+			die("error: bad mix entry '%s'\n", tok);
+		*p++ = 0;
+		for (i = 0; i < ARRAY_SIZE(mix); i++)
+			if (strcasecmp(mix[i].name, tok) == 0)
+				break;
+		if (i == ARRAY_SIZE(mix))
+			die("error: unknown command '%s' in mix\n", tok);
+		mix[i].weight = strtol(p, &endp, 10);
+		if (*p == 0 || *endp != 0 || mix[i].weight < 0)
+			die("error: bad weight '%s' for %s\n", p, tok);
+	}
+
+	total_weight = 0;
+	for (i = 0; i < ARRAY_SIZE(mix); i++)
+		total_weight += mix[i].weight;
+	if (!total_weight)
+		die("error: mix '%s' has no commands\n", arg);
+}
+
+static int parse_num(const char *arg, const char *what, int min, int max)
+{
+	char *endp;
+	long val = strtol(arg, &endp, 10);
+
+	if (*arg == 0 || *endp != 0 || val < min || val > max)
+		die("error: %s must be between %d and %d\n", what, min, max);
+	return val;
+}
+
+static struct mix_entry *pick_cmd(void)
+{
+	int i, r = random() % total_weight;
+
+	for (i = 0; r >= mix[i].weight; i++)
+		r -= mix[i].weight;
+	return &mix[i];
+}
+
+static void record(struct mix_entry *m, long long lat)
+{
+	if (m->n_lat == m->lat_size) {
+		m->lat_size = m->lat_size ? m->lat_size * 2 : 1024;
+		m->lat = realloc(m->lat, m->lat_size * sizeof(*m->lat));
+		if (!m->lat)
+			die("error: out of memory\n");
+	}
+	m->lat[m->n_lat++] = lat;
+}
+
+static void op_done(struct vrctl_op *op)
+{
+	struct slot *s = op->priv;
+	int err = -op->ret;
+
+	s->busy = 0;
+	n_busy--;
+	if (op->ret >= 0) {
+		s->m->n_ok++;
+		record(s->m, mono_us() - s->start);
+		return;
+	}
+
+	s->m->n_err++;
+	errs[err > 0 && err < VRCTL_EMAX ? err : 0]++;
+	info(L_VERBOSE, "%s node %d: %s\n", s->m->name, op->nodeid,
+		op->errmsg);
+}
+
+static void start_one(struct slot *s)
+{
+	struct vrctl_op *op = &s->op;
+
+	memset(op, 0, sizeof(*op));
+	s->m = pick_cmd();
+	op->cmd = s->m->cmd;
+	if (op->cmd == VRCTL_CMD_TEMP)
+		op->nodeid = temp_nodes[random() % n_temp_nodes];
+	else
+		op->nodeid = nodes[random() % n_nodes];
+	if (op->cmd == VRCTL_CMD_LEVEL)
+		op->arg = random() % 256;
+	op->done = op_done;
+	op->priv = s;
+
+	s->busy = 1;
+	n_busy++;
+	s->start = mono_us();
+	vrctl_op_start(v, op);
+}
+
+static struct slot *free_slot(void)
+{
+	int i;
+
+	for (i = 0; i < n_slots; i++)
+		if (!slots[i].busy)
+			return &slots[i];
+	return NULL;
+}
+
+static void rate_tick(struct vrctl_timer *t)
+{
+	struct slot *s;
+	long long now = mono_us();
+
+	/* catch up on starts which were due while we were busy */
+	while (!stopping && rate_next <= now) {
+		s = free_slot();
+		if (s)
+			start_one(s);
+		else
+			n_missed++;
+		rate_next += 1000000 / rate;
+	}
+	if (!stopping)
+		vrctl_timer_add(v, &rate_timer, rate_next - now);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* pct is in tenths of a percent, so 999 is p99.9 */
+static double pctile(const long long *lat, int n, int pct)
+{
+	int i = (long long)n * pct / 1000;
+
+	return lat[i < n ? i : n - 1] / 1000.0;
+}
+
+static void print_lat(const char *name, unsigned int ok, unsigned int err,
+	long long *lat, int n)
+{
+	printf("%-8s %8u %6u", name, ok, err);
+	if (!n) {
+		printf("\n");
+		return;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	printf(" %8.1f %8.1f %8.1f %8.1f %8.1f\n", pctile(lat, n, 500),
+		pctile(lat, n, 900), pctile(lat, n, 990), pctile(lat, n, 999),
+		lat[n - 1] / 1000.0);
+}
+
+static void report(long long elapsed)
+{
+	struct mix_entry all = { "all" };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mix); i++) {
+		all.n_ok += mix[i].n_ok;
+		all.n_err += mix[i].n_err;
+		if (mix[i].n_lat) {
+			all.lat = realloc(all.lat, (all.n_lat + mix[i].n_lat) *
+				sizeof(*all.lat));
+			if (!all.lat)
+				die("error: out of memory\n");
+			memcpy(&all.lat[all.n_lat], mix[i].lat,
+				mix[i].n_lat * sizeof(*all.lat));
+			all.n_lat += mix[i].n_lat;
+		}
+	}
+
+	printf("%u ops in %.2f s: %.1f ops/s (%.1f ok/s), %u errors",
+		all.n_ok + all.n_err, elapsed / 1e6,
+		(all.n_ok + all.n_err) * 1e6 / elapsed,
+		all.n_ok * 1e6 / elapsed, all.n_err);
+	if (rate)
+		printf(", %u missed starts", n_missed);
+	printf("\nfinal window %d\n\n", vrctl_window(v));
+
+	printf("command        ok    err      p50      p90      p99    p99.9"
+		"      max (ms)\n");
+	for (i = 0; i < ARRAY_SIZE(mix); i++)
+		if (mix[i].weight)
+			print_lat(mix[i].name, mix[i].n_ok, mix[i].n_err,
+				mix[i].lat, mix[i].n_lat);
+	print_lat(all.name, all.n_ok, all.n_err, all.lat, all.n_lat);
+	free(all.lat);
+
+	if (!all.n_err)
+		return;
+	printf("\nerrors:\n");
+	for (i = 0; i < VRCTL_EMAX; i++)
+		if (errs[i])
+			printf("  %8u  %s\n", errs[i], vrctl_strerror(i));
+}
+
+static struct option longopts[] = {
+	{ "port",	1,	NULL,	'x' },
+	{ "nodes",	1,	NULL,	'n' },
+	{ "temp",	1,	NULL,	't' },
+	{ "mix",	1,	NULL,	'm' },
+	{ "conc",	1,	NULL,	'c' },
+	{ "duration",	1,	NULL,	'd' },
+	{ "rate",	1,	NULL,	'r' },
+	{ "verbose",	0,	NULL,	'v' },
+	{ "help",	0,	NULL,	'h' },
+	{ NULL,		0,	NULL,	0 },
+};
+
+int main(int argc, char **argv)
+{
+	char *dev = DEFAULT_DEV;
+	int opt, i, secs = DEFAULT_SECS, ret = 0;
+	long long start, end, now;
+
+	parse_mix(DEFAULT_MIX);
+	while ((opt = getopt_long(argc, argv, "x:n:t:m:c:d:r:vh",
+			longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'x':
+			dev = optarg;
+			break;
+		case 'n':
+			parse_nodes(optarg, nodes, &n_nodes);
+			break;
+		case 't':
+			parse_nodes(optarg, temp_nodes, &n_temp_nodes);
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 'c':
+			n_slots = parse_num(optarg, "concurrency", 1,
+				MAX_CONC);
+			break;
+		case 'd':
+			secs = parse_num(optarg, "duration", 1, 86400);
+			break;
+		case 'r':
+			rate = parse_num(optarg, "rate", 1, 1000000);
+			break;
+		case 'v':
+			g_loglevel++;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || !n_nodes)
+		usage();
+	if (!n_temp_nodes) {
+		memcpy(temp_nodes, nodes, sizeof(nodes));
+		n_temp_nodes = n_nodes;
+	}
+
+	v = vrctl_open(dev, &ret);
+	if (!v) {
+		if (ret == -VRCTL_ELOCKED)
+			die("error: %s is locked\n", dev);
+		die("error: can't open %s: %s\n", dev, strerror(errno));
+	}
+	g_locked_tty = dev;
+	if (vrctl_sync(v) < 0)
+		die("error: %s\n", vrctl_errmsg(v));
+
+	srandom(mono_us());
+	start = mono_us();
+	end = start + secs * 1000000LL;
+
+	if (rate) {
+		rate_next = start;
+		rate_timer.fn = rate_tick;
+		vrctl_timer_add(v, &rate_timer, 0);
+	} else {
+		for (i = 0; i < n_slots; i++)
+			start_one(&slots[i]);
+	}
+
+	while ((now = mono_us()) < end) {
+		vrctl_run_once(v, (end - now + 999) / 1000);
+		if (rate)
+			continue;
+		for (i = 0; i < n_slots && mono_us() < end; i++)
+			if (!slots[i].busy)
+				start_one(&slots[i]);
+	}
+
+	/* let the operations in flight finish, but don't start any more */
+	stopping = 1;
+	vrctl_timer_del(v, &rate_timer);
+	while (n_busy)
+		vrctl_run_once(v, -1);
+	end = mono_us();
+
+	report(end - start);
+	vrctl_close(v);
+	return 0;
+}
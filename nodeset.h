@@ -0,0 +1,95 @@
+/*
+ * vrctl - node sets
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NODESET_H_
+#define _NODESET_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "libvrctl.h"
+
+/* one bit per possible node ID (1 - VRCTL_MAX_NODEID) */
+#define NODESET_WORDS		((VRCTL_MAX_NODEID + 32) / 32)
+
+struct nodeset {
+	uint32_t		w[NODESET_WORDS];
+};
+
+static inline void ns_clear(struct nodeset *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+static inline void ns_add(struct nodeset *s, int id)
+{
+	s->w[id / 32] |= 1U << (id % 32);
+}
+
+static inline int ns_has(const struct nodeset *s, int id)
+{
+	return !!(s->w[id / 32] & (1U << (id % 32)));
+}
+
+/* d |= s */
+static inline void ns_or(struct nodeset *d, const struct nodeset *s)
+{
+	int i;
+
+	for (i = 0; i < NODESET_WORDS; i++)
+		d->w[i] |= s->w[i];
+}
+
+/* d &= ~s */
+static inline void ns_andnot(struct nodeset *d, const struct nodeset *s)
+{
+	int i;
+
+	for (i = 0; i < NODESET_WORDS; i++)
+		d->w[i] &= ~s->w[i];
+}
+
+static inline int ns_count(const struct nodeset *s)
+{
+	int i, n = 0;
+
+	for (i = 0; i < NODESET_WORDS; i++)
+		n += __builtin_popcount(s->w[i]);
+	return n;
+}
+
+/* lowest member >= id, or -1 */
+static inline int ns_next(const struct nodeset *s, int id)
+{
+	int i = id / 32;
+	uint32_t w;
+
+	if (id < 0 || i >= NODESET_WORDS)
+		return -1;
+	w = s->w[i] & (~0U << (id % 32));
+	while (!w) {
+		if (++i >= NODESET_WORDS)
+			return -1;
+		w = s->w[i];
+	}
+	return i * 32 + __builtin_ctz(w);
+}
+
+#define ns_for_each(id, s) \
+	for ((id) = ns_next((s), 0); (id) >= 0; (id) = ns_next((s), (id) + 1))
+
+#endif /* _NODESET_H_ */
@@ -0,0 +1,416 @@
+/*
+ * libvrctl - user command state machines
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "util.h"
+#include "vrctl_int.h"
+
+/*
+ * Each command is a step function which is called once when the operation
+ * starts, and again every time the frame or delay it is waiting on
+ * completes.  op->state counts the steps taken so far.  A step either
+ * kicks off the next frame/delay, or finishes the operation.
+ */
+
+#define BOUNCE_DELAY_US		500000
+
+typedef void (*step_fn)(struct vrctl_op *op);
+
+static const char *cmd_names[VRCTL_CMD_MAX] = {
+	[VRCTL_CMD_ON]		= "on",
+	[VRCTL_CMD_OFF]		= "off",
+	[VRCTL_CMD_BOUNCE]	= "bounce",
+	[VRCTL_CMD_TOGGLE]	= "toggle",
+	[VRCTL_CMD_LEVEL]	= "level",
+	[VRCTL_CMD_STATUS]	= "status",
+	[VRCTL_CMD_LOCK]	= "lock",
+	[VRCTL_CMD_UNLOCK]	= "unlock",
+	[VRCTL_CMD_SCENE]	= "scene",
+	[VRCTL_CMD_TEMP]	= "temp",
+	[VRCTL_CMD_SETPOINT]	= "setpoint",
+	[VRCTL_CMD_FAN]		= "fan",
+	[VRCTL_CMD_HEAT]	= "heat",
+	[VRCTL_CMD_COOL]	= "cool",
+	[VRCTL_CMD_FADE]	= "fade",
+	[VRCTL_CMD_REPORT]	= "report",
+	[VRCTL_CMD_UNREPORT]	= "unreport",
+};
+
+const char *vrctl_cmd_name(int cmd)
+{
+	if (cmd < 0 || cmd >= VRCTL_CMD_MAX)
+		return "unknown";
+	return cmd_names[cmd];
+}
+
+void op_finish(struct vrctl_op *op, int ret)
+{
+	if (op->cmd == VRCTL_CMD_FADE)
+		ramp_del(op->v, op);
+	op->ret = ret;
+	if (op->done)
+		op->done(op);
+}
+
+static void op_fail(struct vrctl_op *op, int err, int code,
+	const char *fmt, ...)
+{
+	va_list ap;
+
+	op->code = code;
+	if (fmt) {
+		va_start(ap, fmt);
+		vsnprintf(op->errmsg, ERRLEN, fmt, ap);
+		va_end(ap);
+	} else {
+		snprintf(op->errmsg, ERRLEN, "%s", vrctl_strerror(err));
+	}
+	op_finish(op, -err);
+}
+
+static void op_step(struct vrctl_op *op);
+
+static void op_req_done(struct vrctl_req *rq)
+{
+	struct vrctl_op *op = rq->priv;
+
+	stats_record(op->v, op->nodeid, op->cmd, rq);
+
+	if (rq->ret == -VRCTL_EDEVICE)
+		op_fail(op, VRCTL_EDEVICE, rq->code,
+			"received E%03d while waiting for '%c' response",
+			rq->code, rq->expect);
+	else if (rq->ret < 0)
+		op_fail(op, -rq->ret, 0, NULL);
+	else if (rq->ret > 0)
+		op_fail(op, VRCTL_ENODE, rq->ret,
+			"node %d returned X%03x for %s command",
+			op->nodeid, rq->ret, op->what);
+	else
+		op_step(op);
+}
+
+/* send one node command; what is used in error messages */
+static void op_send(struct vrctl_op *op, const char *what,
+	const char *report, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vrctl_req_vinit(&op->rq, 'X', op->nodeid, report, fmt, ap);
+	va_end(ap);
+
+	op->what = what;
+	op->rq.done = op_req_done;
+	op->rq.priv = op;
+	op->rq.prio = op->prio;
+	vrctl_submit(op->v, &op->rq);
+}
+
+static void op_timer_done(struct vrctl_timer *t)
+{
+	op_step(t->priv);
+}
+
+static void op_delay(struct vrctl_op *op, long long delay_us)
+{
+	op->timer.fn = op_timer_done;
+	op->timer.priv = op;
+	vrctl_timer_add(op->v, &op->timer, delay_us);
+}
+
+/*
+ * COMMANDS
+ */
+
+static void send_on(struct vrctl_op *op)
+{
+	if (op->nodeid == VRCTL_NODEID_ALL)
+		op_send(op, "ON", NULL, ">N,ON");
+	else
+		op_send(op, "ON", NULL, ">N%03dON", op->nodeid);
+}
+
+static void send_off(struct vrctl_op *op)
+{
+	if (op->nodeid == VRCTL_NODEID_ALL)
+		op_send(op, "OFF", NULL, ">N,OF");
+	else
+		op_send(op, "OFF", NULL, ">N%03dOF", op->nodeid);
+}
+
+static void step_on(struct vrctl_op *op)
+{
+	if (op->state++ == 0)
+		send_on(op);
+	else
+		op_finish(op, 0);
+}
+
+static void step_off(struct vrctl_op *op)
+{
+	if (op->state++ == 0)
+		send_off(op);
+	else
+		op_finish(op, 0);
+}
+
+static void step_bounce(struct vrctl_op *op)
+{
+	switch (op->state++) {
+	case 0:
+		send_off(op);
+		break;
+	case 1:
+		op_delay(op, BOUNCE_DELAY_US);
+		break;
+	case 2:
+		send_on(op);
+		break;
+	default:
+		op_finish(op, 0);
+	}
+}
+
+static void step_level(struct vrctl_op *op)
+{
+	if (op->state++ != 0) {
+		op_finish(op, 0);
+		return;
+	}
+	if (op->arg < 0 || op->arg > 255)
+		op_fail(op, VRCTL_EINVAL, 0, NULL);
+	else if (op->nodeid == VRCTL_NODEID_ALL)
+		op_send(op, "LEVEL", NULL, ">N,L%03d", op->arg);
+	else
+		op_send(op, "LEVEL", NULL, ">N%03dL%03d", op->nodeid, op->arg);
+}
+
+static void step_scene(struct vrctl_op *op)
+{
+	if (op->state++ != 0) {
+		op_finish(op, 0);
+		return;
+	}
+	if (op->arg < 0 || op->arg > VRCTL_MAX_NODEID)
+		op_fail(op, VRCTL_EINVAL, 0, NULL);
+	else if (op->nodeid == VRCTL_NODEID_ALL)
+		op_send(op, "SCENE", NULL, ">N,S%d", op->arg);
+	else
+		op_send(op, "SCENE", NULL, ">N%03dS%d", op->nodeid, op->arg);
+}
+
+void op_send_level(struct vrctl_op *op, int level)
+{
+	op_send(op, "LEVEL", NULL, ">N%03dL%03d", op->nodeid, level);
+}
+
+/* the steps themselves are paced by the ramp engine */
+static void step_fade(struct vrctl_op *op)
+{
+	switch (op->state++) {
+	case 0:
+		if (op->arg < 0 || op->arg > 255 || op->time_ms < 0 ||
+		    op->nodeid == VRCTL_NODEID_ALL)
+			op_fail(op, VRCTL_EINVAL, 0, NULL);
+		else
+			op_send(op, "STATUS", "L", ">?N%03d", op->nodeid);
+		break;
+	case 1:
+		if (op->rq.r.arg1 == op->arg)
+			op_finish(op, 0);
+		else
+			ramp_add(op->v, op, op->rq.r.arg1);
+		break;
+	default:
+		op->state = 2;
+		if (ramp_step_done(op->v, op))
+			op_finish(op, 0);
+	}
+}
+
+static void step_lock(struct vrctl_op *op)
+{
+	if (op->state++ == 0)
+		op_send(op, "LOCK/UNLOCK", NULL, ">N%03dSS98,1,%d", op->nodeid,
+			op->cmd == VRCTL_CMD_LOCK ? 255 : 0);
+	else
+		op_finish(op, 0);
+}
+
+static void step_status(struct vrctl_op *op)
+{
+	if (op->state++ == 0)
+		op_send(op, "STATUS", "L", ">?N%03d", op->nodeid);
+	else
+		op_finish(op, op->rq.r.arg1);
+}
+
+static void step_toggle(struct vrctl_op *op)
+{
+	switch (op->state++) {
+	case 0:
+		op_send(op, "STATUS", "L", ">?N%03d", op->nodeid);
+		break;
+	case 1:
+		if (op->rq.r.arg1 == 0) {
+			op->ret = 255;
+			send_on(op);
+		} else {
+			op->ret = 0;
+			send_off(op);
+		}
+		break;
+	default:
+		op_finish(op, op->ret);
+	}
+}
+
+static void read_temp(struct vrctl_op *op)
+{
+	op->temp.value = op->rq.r.arg1;
+	op->temp.precision = op->rq.r.arg1_precision;
+	op->temp.units = op->rq.r.type1;
+}
+
+static void step_temp(struct vrctl_op *op)
+{
+	if (op->state++ == 0) {
+		op_send(op, "TEMP", "FC", ">N%03dSE49,4", op->nodeid);
+	} else {
+		read_temp(op);
+		op_finish(op, 0);
+	}
+}
+
+static void step_setpoint(struct vrctl_op *op)
+{
+	switch (op->state++) {
+	case 0:
+		/* get thermostat mode */
+		op_send(op, "MODE", "M", ">N%03dSE64,2", op->nodeid);
+		break;
+	case 1:
+		op->ret = op->rq.r.arg1;
+		if (op->ret == VRCTL_MODE_OFF) {
+			op_finish(op, op->ret);
+			break;
+		}
+		/* get setpoint temperature */
+		op_send(op, "SETPOINT", "FC", ">N%03dSE67,2,%d",
+			op->nodeid, op->ret);
+		break;
+	default:
+		read_temp(op);
+		op_finish(op, op->ret);
+	}
+}
+
+static void step_fan(struct vrctl_op *op)
+{
+	if (op->state++ == 0)
+		op_send(op, "FAN", NULL, ">N%03dSE68,1,%d", op->nodeid,
+			!!op->arg);
+	else
+		op_finish(op, 0);
+}
+
+static void step_thermostat(struct vrctl_op *op)
+{
+	int mode = op->cmd == VRCTL_CMD_HEAT ? VRCTL_MODE_HEAT :
+		   VRCTL_MODE_COOL;
+
+	/* a setpoint of 0 turns off both heating and cooling */
+	if (!op->arg)
+		mode = VRCTL_MODE_OFF;
+
+	switch (op->state++) {
+	case 0:
+		if (mode != VRCTL_MODE_OFF) {
+			op_send(op, "SETPOINT", NULL, ">N%03dSE67,1,%d,%d,%d",
+				op->nodeid, mode, op->units == 'C' ? 17 : 9,
+				op->arg);
+			break;
+		}
+		op->state++;
+		/* fall through */
+	case 1:
+		op_send(op, "MODE", NULL, ">N%03dSE64,1,%d", op->nodeid, mode);
+		break;
+	default:
+		op_finish(op, 0);
+	}
+}
+
+/* ASSOCIATION_SET or ASSOCIATION_REMOVE, group 1 */
+static void step_report(struct vrctl_op *op)
+{
+	if (op->state++ != 0) {
+		op_finish(op, 0);
+		return;
+	}
+	if (op->arg < 1 || op->arg > VRCTL_MAX_NODEID) {
+		op_fail(op, VRCTL_EINVAL, 0, "invalid report destination %d",
+			op->arg);
+		return;
+	}
+	op_send(op, "ASSOCIATION", NULL, ">N%03dSE133,%d,1,%d", op->nodeid,
+		op->cmd == VRCTL_CMD_REPORT ? 1 : 4, op->arg);
+}
+
+static const step_fn step_table[VRCTL_CMD_MAX] = {
+	[VRCTL_CMD_ON]		= step_on,
+	[VRCTL_CMD_OFF]		= step_off,
+	[VRCTL_CMD_BOUNCE]	= step_bounce,
+	[VRCTL_CMD_TOGGLE]	= step_toggle,
+	[VRCTL_CMD_LEVEL]	= step_level,
+	[VRCTL_CMD_STATUS]	= step_status,
+	[VRCTL_CMD_LOCK]	= step_lock,
+	[VRCTL_CMD_UNLOCK]	= step_lock,
+	[VRCTL_CMD_SCENE]	= step_scene,
+	[VRCTL_CMD_TEMP]	= step_temp,
+	[VRCTL_CMD_SETPOINT]	= step_setpoint,
+	[VRCTL_CMD_FAN]		= step_fan,
+	[VRCTL_CMD_HEAT]	= step_thermostat,
+	[VRCTL_CMD_COOL]	= step_thermostat,
+	[VRCTL_CMD_FADE]	= step_fade,
+	[VRCTL_CMD_REPORT]	= step_report,
+	[VRCTL_CMD_UNREPORT]	= step_report,
+};
+
+static void op_step(struct vrctl_op *op)
+{
+	step_table[op->cmd](op);
+}
+
+void vrctl_op_start(struct vrctl_conn *v, struct vrctl_op *op)
+{
+	op->v = v;
+	op->state = 0;
+	op->ret = op->code = 0;
+	op->errmsg[0] = 0;
+
+	if (op->cmd < 0 || op->cmd >= VRCTL_CMD_MAX) {
+		op_fail(op, VRCTL_EINVAL, 0, NULL);
+		return;
+	}
+	op_step(op);
+}
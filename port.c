@@ -0,0 +1,328 @@
+/*
+ * libvrctl - serial port transports
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "util.h"
+#include "arena.h"
+#include "port.h"
+
+#define TCP_PREFIX		"tcp:"
+#define FRAMELEN		256
+
+/*
+ * TTY TRANSPORT
+ */
+
+static int tty_open(struct vrctl_port *p, const char *addr)
+{
+	p->fd = open(addr, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (p->fd < 0)
+		return -1;
+	/* O_NONBLOCK was only needed to get past DCD */
+	return fcntl(p->fd, F_SETFL, 0);
+}
+
+static int tty_set_speed(struct vrctl_port *p, int baud, int parity)
+{
+	struct termios termios;
+
+	if (set_tty_defaults(p->fd, baud) < 0)
+		return -1;
+	if (parity == PARITY_NONE)
+		return 0;
+
+	if (tcgetattr(p->fd, &termios) != 0)
+		return -1;
+	termios.c_cflag |= PARENB;
+	return tcsetattr(p->fd, TCSANOW, &termios);
+}
+
+static int fd_read(struct vrctl_port *p, void *buf, int len)
+{
+	return read(p->fd, buf, len);
+}
+
+static int fd_write(struct vrctl_port *p, const void *buf, int len)
+{
+	return write(p->fd, buf, len);
+}
+
+static void fd_close(struct vrctl_port *p)
+{
+	close(p->fd);
+}
+
+static const struct port_ops tty_ops = {
+	.name		= "tty",
+	.open		= tty_open,
+	.set_speed	= tty_set_speed,
+	.read		= fd_read,
+	.write		= fd_write,
+	.close		= fd_close,
+};
+
+/*
+ * TCP TRANSPORT
+ *
+ * A raw (not telnet/RFC 2217) connection to a serial bridge which is
+ * already configured for the VRC0P's 9600 8N1.  Frames are small and
+ * latency-bound, so Nagle is turned off and every frame goes out in a
+ * single write.
+ */
+
+static int tcp_open(struct vrctl_port *p, const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[FRAMELEN], *service;
+	int one = 1, ret;
+
+	snprintf(host, sizeof(host), "%s", addr + strlen(TCP_PREFIX));
+	service = strrchr(host, ':');
+	if (!service) {
+		errno = EINVAL;
+		return -1;
+	}
+	*service++ = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, service, &hints, &res);
+	if (ret != 0) {
+		info(L_VERBOSE, "%s: %s: %s\n", __func__, host,
+			gai_strerror(ret));
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	p->fd = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		p->fd = socket(ai->ai_family, ai->ai_socktype,
+			ai->ai_protocol);
+		if (p->fd < 0)
+			continue;
+		if (connect(p->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(p->fd);
+		p->fd = -1;
+	}
+	freeaddrinfo(res);
+	if (p->fd < 0)
+		return -1;
+
+	setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+static int tcp_set_speed(struct vrctl_port *p, int baud, int parity)
+{
+	/* the bridge owns the line settings */
+	if (baud == 9600 && parity == PARITY_NONE)
+		return 0;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static int tcp_write(struct vrctl_port *p, const void *buf, int len)
+{
+	return send(p->fd, buf, len, MSG_NOSIGNAL);
+}
+
+static const struct port_ops tcp_ops = {
+	.name		= "tcp",
+	.open		= tcp_open,
+	.set_speed	= tcp_set_speed,
+	.read		= fd_read,
+	.write		= tcp_write,
+	.close		= fd_close,
+};
+
+/*
+ * GENERIC PORT OPERATIONS
+ */
+
+ARENA_DEFINE(port_arena, "ports", sizeof(struct vrctl_port), ARENA_CONNS);
+
+struct vrctl_port *port_open(const char *addr)
+{
+	struct vrctl_port *p;
+	int saved_errno;
+
+	p = arena_alloc(&port_arena);
+	if (!p)
+		return NULL;
+
+	if (strncmp(addr, TCP_PREFIX, strlen(TCP_PREFIX)) == 0)
+		p->ops = &tcp_ops;
+	else
+		p->ops = &tty_ops;
+
+	p->fd = -1;
+	if (p->ops->open(p, addr) < 0) {
+		saved_errno = errno;
+		if (p->fd >= 0)
+			p->ops->close(p);
+		arena_free(&port_arena, p);
+		errno = saved_errno;
+		return NULL;
+	}
+	info(L_DEBUG, "%s: opened %s via %s\n", __func__, addr, p->ops->name);
+	return p;
+}
+
+void port_close(struct vrctl_port *p)
+{
+	p->ops->close(p);
+	arena_free(&port_arena, p);
+}
+
+int port_set_speed(struct vrctl_port *p, int baud, int parity)
+{
+	return p->ops->set_speed(p, baud, parity);
+}
+
+int port_wait(struct vrctl_port *p, int timeout_us)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = p->fd;
+	pfd.events = POLLIN;
+	do {
+		ret = poll(&pfd, 1, timeout_us < 0 ? -1 :
+			(timeout_us + 999) / 1000);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -1 : !!ret;
+}
+
+int port_read(struct vrctl_port *p, void *buf, int len)
+{
+	int ret = p->ops->read(p, buf, len);
+
+	return ret <= 0 ? -1 : ret;
+}
+
+int port_write(struct vrctl_port *p, const void *buf, int len)
+{
+	const char *ptr = buf;
+
+	while (len) {
+		int bytes = p->ops->write(p, ptr, len);
+		if (bytes <= 0)
+			return -1;
+		len -= bytes;
+		ptr += bytes;
+	}
+	return 0;
+}
+
+int read_byte(struct vrctl_port *p)
+{
+	unsigned char c;
+
+	if (port_wait(p, -1) < 0 || port_read(p, &c, 1) != 1)
+		return -EIO;
+	return c;
+}
+
+int read_bytes(struct vrctl_port *p, void *buf, int len, int timeout_us)
+{
+	char *ptr = buf;
+	int ret;
+
+	while (len) {
+		if (port_wait(p, timeout_us) != 1)
+			return -ETIMEDOUT;
+		ret = port_read(p, ptr, len);
+		if (ret < 0)
+			return -EIO;
+		len -= ret;
+		ptr += ret;
+	}
+	return 0;
+}
+
+int flush_bytes(struct vrctl_port *p)
+{
+	char buf[FRAMELEN];
+
+	while (port_wait(p, 0) > 0)
+		if (port_read(p, buf, sizeof(buf)) < 0)
+			return -EIO;
+	return 0;
+}
+
+int write_line(struct vrctl_port *p, char *buf)
+{
+	char frame[FRAMELEN];
+	int len;
+
+	info(L_DEBUG, "%s: sending '%s'\n", __func__, buf);
+
+	/* one write per frame, including the "\r\0" terminator */
+	len = snprintf(frame, sizeof(frame) - 1, "%s\r", buf);
+	if (len >= sizeof(frame) - 1)
+		return -EIO;
+	frame[len++] = 0;
+	if (port_write(p, frame, len) < 0)
+		return -EIO;
+	return 0;
+}
+
+int read_line(struct vrctl_port *p, char *buf, int maxlen, int timeout_us)
+{
+	char *ptr = buf;
+	int c, len = 0;
+
+	while (len < maxlen) {
+		if (port_wait(p, timeout_us) != 1) {
+			info(L_DEBUG, "%s: timed out\n", __func__);
+			return -ETIMEDOUT;
+		}
+		c = read_byte(p);
+		if (c < 0)
+			return c;
+		if (c == '\r' || c == '\n') {
+			if (len != 0) {
+				*ptr = 0;
+				info(L_DEBUG, "%s: got '%s'\n", __func__, buf);
+				return len;
+			}
+			/* ignore empty lines or leading [\r\n] */
+			continue;
+		}
+		*(ptr++) = c;
+		len++;
+	}
+
+	*ptr = 0;
+	info(L_DEBUG, "%s: out of buffer space\n", __func__);
+	return -ENOSPC;
+}
@@ -0,0 +1,77 @@
+/*
+ * libvrctl - serial port transports
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PORT_H_
+#define _PORT_H_
+
+/*
+ * The VRC0P is reached through a transport: either a local tty, or a raw
+ * TCP connection to a serial bridge (ser2net and friends) when the port
+ * name looks like "tcp:host:port".  Everything above this layer only sees
+ * a byte stream plus a file descriptor to poll on.
+ */
+
+#define PARITY_NONE		0
+#define PARITY_EVEN		1
+
+struct vrctl_port;
+
+struct port_ops {
+	const char		*name;
+	int			(*open)(struct vrctl_port *p, const char *addr);
+	int			(*set_speed)(struct vrctl_port *p, int baud,
+					     int parity);
+	int			(*read)(struct vrctl_port *p, void *buf,
+					int len);
+	int			(*write)(struct vrctl_port *p,
+					 const void *buf, int len);
+	void			(*close)(struct vrctl_port *p);
+};
+
+struct vrctl_port {
+	int			fd;
+	const struct port_ops	*ops;
+};
+
+/* returns NULL (with errno set) on failure */
+struct vrctl_port *port_open(const char *addr);
+void port_close(struct vrctl_port *p);
+
+/* 8 data bits, 1 stop bit */
+int port_set_speed(struct vrctl_port *p, int baud, int parity);
+
+/* 1 if input is waiting, 0 on timeout (timeout_us < 0: forever), -1 */
+int port_wait(struct vrctl_port *p, int timeout_us);
+
+/* a single read; returns the number of bytes, or -1 on EOF/error */
+int port_read(struct vrctl_port *p, void *buf, int len);
+
+/* all of buf in one go; returns 0 or -1 */
+int port_write(struct vrctl_port *p, const void *buf, int len);
+
+/* line and byte helpers built on the above */
+int read_byte(struct vrctl_port *p);
+int read_bytes(struct vrctl_port *p, void *buf, int len, int timeout_us);
+int flush_bytes(struct vrctl_port *p);
+int read_line(struct vrctl_port *p, char *buf, int maxlen, int timeout_us);
+
+/* longest line write_line() can send (it adds "\r\0"); -EIO otherwise */
+#define PORT_MAX_LINE		253
+int write_line(struct vrctl_port *p, char *buf);
+
+#endif /* _PORT_H_ */
@@ -0,0 +1,175 @@
+/*
+ * libvrctl - dimmer fades
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "util.h"
+#include "vrctl_int.h"
+
+/*
+ * A fade is a series of level frames to one node.  Rather than giving
+ * every fade its own timer, all fades in progress share one which ticks
+ * every RAMP_SLOT_US.  On each tick every fade works out where it should
+ * be by now; the ones furthest behind get a frame, up to the number the
+ * link can carry in one slot, and the rest catch up on a later tick.
+ *
+ * A fade never has more than one frame outstanding, so a slow node only
+ * makes its own fade coarser.  The step size of each fade is chosen so
+ * that it needs at most one frame per slot.
+ */
+
+#define RAMP_SLOT_US		100000
+
+/* the link capacity left over for everything else */
+#define RAMP_SHARE		2
+
+static int abs_int(int x)
+{
+	return x < 0 ? -x : x;
+}
+
+/* smallest change in level worth a frame */
+static int ramp_step(const struct vrctl_op *op)
+{
+	int steps = (long long)op->time_ms * 1000 / RAMP_SLOT_US;
+	int delta = abs_int(op->arg - op->ramp_from);
+
+	if (steps <= 1 || delta <= steps)
+		return 1;
+	return (delta + steps - 1) / steps;
+}
+
+/* where the node should be by now */
+static int ramp_want(const struct vrctl_op *op, long long now)
+{
+	long long elapsed = now - op->ramp_start;
+	long long total = (long long)op->time_ms * 1000;
+
+	if (elapsed >= total)
+		return op->arg;
+	return op->ramp_from + (op->arg - op->ramp_from) * elapsed / total;
+}
+
+/*
+ * Frames the link can carry in one slot, going by the current window and
+ * round trip time.  Until there is an estimate, send one per slot.
+ */
+static int ramp_budget(struct vrctl_conn *v)
+{
+	int n;
+
+	if (!v->srtt)
+		return 1;
+	n = (long long)v->window * RAMP_SLOT_US / (v->srtt * RAMP_SHARE);
+	return n < 1 ? 1 : n;
+}
+
+/* how far behind a fade is, in steps; the final step always counts */
+static int ramp_lag(const struct vrctl_op *op, long long now)
+{
+	int want = ramp_want(op, now);
+	int lag = abs_int(want - op->ramp_sent) / ramp_step(op);
+
+	if (want == op->arg && op->ramp_sent != op->arg)
+		lag++;
+	return lag;
+}
+
+static void ramp_tick(struct vrctl_timer *t)
+{
+	struct vrctl_conn *v = t->priv;
+	struct vrctl_op *op, *best;
+	long long now = mono_us();
+	int budget, lag, best_lag;
+
+	for (budget = ramp_budget(v); budget > 0; budget--) {
+		best = NULL;
+		best_lag = 0;
+		for (op = v->ramps; op; op = op->ramp_next) {
+			if (op->ramp_busy)
+				continue;
+			lag = ramp_lag(op, now);
+			if (lag > best_lag) {
+				best = op;
+				best_lag = lag;
+			}
+		}
+		if (!best)
+			break;
+
+		best->ramp_busy = 1;
+		best->ramp_sent = ramp_want(best, now);
+		op_send_level(best, best->ramp_sent);
+	}
+
+	/* a failed send may have ended fades and even started new ones */
+	vrctl_timer_del(v, &v->ramp_timer);
+	if (v->ramps)
+		vrctl_timer_add(v, &v->ramp_timer, RAMP_SLOT_US);
+}
+
+void ramp_add(struct vrctl_conn *v, struct vrctl_op *op, int from)
+{
+	struct vrctl_op *old, *next;
+
+	/*
+	 * A newer fade on the same node takes over.  The old one ends now, or
+	 * once the frame it has outstanding comes back.
+	 */
+	for (old = v->ramps; old; old = next) {
+		next = old->ramp_next;
+		if (old->nodeid != op->nodeid)
+			continue;
+		old->arg = old->ramp_sent;
+		old->time_ms = 0;
+		if (!old->ramp_busy)
+			op_finish(old, 0);
+	}
+
+	op->ramp_start = mono_us();
+	op->ramp_from = op->ramp_sent = from;
+	op->ramp_busy = 0;
+	op->ramp_next = v->ramps;
+	if (!v->ramps) {
+		v->ramp_timer.fn = ramp_tick;
+		v->ramp_timer.priv = v;
+		vrctl_timer_add(v, &v->ramp_timer, 0);
+	}
+	v->ramps = op;
+}
+
+/* a step frame went through; returns 1 if the fade is complete */
+int ramp_step_done(struct vrctl_conn *v, struct vrctl_op *op)
+{
+	op->ramp_busy = 0;
+	return op->ramp_sent == op->arg &&
+		mono_us() - op->ramp_start >= (long long)op->time_ms * 1000;
+}
+
+void ramp_del(struct vrctl_conn *v, struct vrctl_op *op)
+{
+	struct vrctl_op **p;
+
+	for (p = &v->ramps; *p; p = &(*p)->ramp_next)
+		if (*p == op) {
+			*p = op->ramp_next;
+			break;
+		}
+	if (!v->ramps)
+		vrctl_timer_del(v, &v->ramp_timer);
+}
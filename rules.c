@@ -0,0 +1,298 @@
+/*
+ * vrctl - automation rules
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Rules let the server react to <N reports on its own, without a round
+ * trip through an external program.  They are declared in .vrctlrc:
+ *
+ *   when <nodes> <report> <value> <nodes> <command> [<arg>]
+ *
+ * where <nodes> is a node name, number or group expression, e.g.
+ *
+ *   when 12 scene 3 kitchen,hall level 40
+ *   when remote level * porch toggle
+ *   when remotes scene 4 downstairs-kitchen off
+ *
+ * <report> is "scene", "level", or the raw report letter from the <N
+ * frame.  <value> may be "*" to match any value.  The actions are
+ * submitted straight to the TX queue from the server's report callback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "util.h"
+#include "arena.h"
+#include "rules.h"
+
+#define TOKLEN			64
+#define VALUE_ANY		-1
+
+struct rule {
+	int			linenum;
+
+	/* trigger */
+	char			trigger[TOKLEN];
+	struct nodeset		from;
+	char			type;
+	int			value;
+
+	/* action */
+	char			targets[TOKLEN];
+	struct nodeset		to;
+	int			to_all;
+	const struct srv_cmd	*cmd;
+	int			arg;
+	char			units;
+	int			time_ms;
+
+	int			busy;		/* actions still in flight */
+	struct rule		*next;
+};
+
+struct rule_op {
+	struct vrctl_op		op;
+	struct rule		*rule;
+};
+
+ARENA_DEFINE(rule_arena, "rules", sizeof(struct rule), ARENA_RULES);
+ARENA_DEFINE(rule_op_arena, "rule_ops", sizeof(struct rule_op),
+	ARENA_ACTIONS);
+
+static struct rule *rule_head = NULL, *rule_tail = NULL;
+
+/*
+ * RC FILE
+ */
+
+static char parse_report_type(char *str)
+{
+	if (strcasecmp(str, "scene") == 0)
+		return 'S';
+	if (strcasecmp(str, "level") == 0)
+		return 'L';
+	if (strlen(str) == 1 && isalpha(*str))
+		return toupper(*str);
+	return 0;
+}
+
+static int parse_value(char *str)
+{
+	char *endp;
+	long val;
+
+	if (strcmp(str, "*") == 0)
+		return VALUE_ANY;
+	val = strtol(str, &endp, 10);
+	if (*str == 0 || *endp != 0 || val < 0 || val > 255)
+		return -2;
+	return val;
+}
+
+void rule_add(char *filename, int linenum, char *line)
+{
+	struct rule *r;
+	struct vrctl_op scratch;
+	char tok[TOKLEN], argbuf[SRV_MAX_ARGS][TOKLEN];
+	char *p = line, *args[SRV_MAX_ARGS] = { argbuf[0], argbuf[1] };
+	int i;
+
+	r = arena_alloc(&rule_arena);
+	if (!r)
+		die("out of memory\n");
+	r->linenum = linenum;
+
+	if (next_token(&p, r->trigger, TOKLEN) < 0 ||
+	    next_token(&p, tok, TOKLEN) < 0 ||
+	    (r->type = parse_report_type(tok)) == 0) {
+		info(L_WARNING, "%s:%d: missing or invalid report type\n",
+			filename, linenum);
+		goto bad;
+	}
+	if (next_token(&p, tok, TOKLEN) < 0 ||
+	    (r->value = parse_value(tok)) < VALUE_ANY) {
+		info(L_WARNING, "%s:%d: missing or invalid report value\n",
+			filename, linenum);
+		goto bad;
+	}
+	if (next_token(&p, r->targets, TOKLEN) < 0) {
+		info(L_WARNING, "%s:%d: missing target nodes\n",
+			filename, linenum);
+		goto bad;
+	}
+	if (next_token(&p, tok, TOKLEN) < 0 ||
+	    (r->cmd = srv_find_cmd(tok)) == NULL) {
+		info(L_WARNING, "%s:%d: missing or invalid command\n",
+			filename, linenum);
+		goto bad;
+	}
+	if (r->cmd->arg_required) {
+		memset(&scratch, 0, sizeof(scratch));
+		for (i = 0; i < r->cmd->arg_required; i++)
+			if (next_token(&p, args[i], TOKLEN) < 0)
+				break;
+		if (i < r->cmd->arg_required ||
+		    srv_parse_arg(&scratch, r->cmd, args) < 0) {
+			info(L_WARNING, "%s:%d: missing or invalid argument\n",
+				filename, linenum);
+			goto bad;
+		}
+		r->arg = scratch.arg;
+		r->units = scratch.units;
+		r->time_ms = scratch.time_ms;
+	}
+
+	if (rule_tail != NULL) {
+		rule_tail->next = r;
+		rule_tail = r;
+	} else {
+		rule_head = rule_tail = r;
+	}
+	return;
+
+bad:
+	arena_free(&rule_arena, r);
+}
+
+/*
+ * Node names are resolved once the whole rc file has been read, so rules
+ * may refer to aliases defined further down.
+ */
+static int resolve_rule(struct rule *r, resolve_fn resolve)
+{
+	if (resolve(r->trigger, &r->from) < 0 || !ns_count(&r->from)) {
+		info(L_WARNING, "rule on line %d: invalid node '%s'\n",
+			r->linenum, r->trigger);
+		return -1;
+	}
+
+	if (strcasecmp(r->targets, "all") == 0) {
+		if (r->cmd->is_unicast) {
+			info(L_WARNING, "rule on line %d: %s cannot operate "
+				"on ALL nodes at once\n", r->linenum,
+				r->cmd->name);
+			return -1;
+		}
+		r->to_all = 1;
+		return 0;
+	}
+	if (resolve(r->targets, &r->to) < 0 || !ns_count(&r->to)) {
+		info(L_WARNING, "rule on line %d: invalid node '%s'\n",
+			r->linenum, r->targets);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * ACTIONS
+ */
+
+static void rule_op_done(struct vrctl_op *op)
+{
+	struct rule_op *ro = op->priv;
+
+	if (op->ret < 0)
+		info(L_WARNING, "rule on line %d: %s\n", ro->rule->linenum,
+			op->errmsg);
+	ro->rule->busy--;
+	arena_free(&rule_op_arena, ro);
+}
+
+static void fire_one(struct vrctl_conn *v, struct rule *r, int nodeid)
+{
+	struct rule_op *ro;
+
+	ro = arena_alloc(&rule_op_arena);
+	if (!ro) {
+		info(L_WARNING, "rule on line %d: out of memory\n",
+			r->linenum);
+		return;
+	}
+	ro->rule = r;
+	ro->op.cmd = r->cmd->cmd;
+	ro->op.nodeid = nodeid;
+	ro->op.arg = r->arg;
+	ro->op.units = r->units;
+	ro->op.time_ms = r->time_ms;
+	ro->op.done = rule_op_done;
+	ro->op.priv = ro;
+	ro->op.prio = VRCTL_PRIO_AUTOMATION;
+	r->busy++;
+	vrctl_op_start(v, &ro->op);
+}
+
+static void fire_rule(struct vrctl_conn *v, struct rule *r)
+{
+	int id;
+
+	if (r->to_all) {
+		fire_one(v, r, VRCTL_NODEID_ALL);
+		return;
+	}
+	ns_for_each(id, &r->to)
+		fire_one(v, r, id);
+}
+
+void rules_report(struct vrctl_conn *v, const struct vrctl_resp *resp,
+	const char *line)
+{
+	struct rule *r;
+
+	for (r = rule_head; r != NULL; r = r->next) {
+		if (resp->arg0 > VRCTL_MAX_NODEID ||
+		    !ns_has(&r->from, resp->arg0) || r->type != resp->type1)
+			continue;
+		if (r->value != VALUE_ANY && r->value != resp->arg1)
+			continue;
+
+		/*
+		 * A rule whose actions cause another matching report (e.g.
+		 * toggling the node it watches) must not feed on itself.
+		 */
+		if (r->busy) {
+			info(L_VERBOSE, "rule on line %d: still busy, "
+				"ignoring '%s'\n", r->linenum, line);
+			continue;
+		}
+		info(L_VERBOSE, "rule on line %d: triggered by '%s'\n",
+			r->linenum, line);
+		fire_rule(v, r);
+	}
+}
+
+int rules_resolve(resolve_fn resolve)
+{
+	struct rule **p = &rule_head, *r;
+	int n = 0;
+
+	rule_tail = NULL;
+	while ((r = *p) != NULL) {
+		if (resolve_rule(r, resolve) < 0) {
+			*p = r->next;
+			arena_free(&rule_arena, r);
+			continue;
+		}
+		rule_tail = r;
+		p = &r->next;
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,38 @@
+/*
+ * vrctl - automation rules
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RULES_H_
+#define _RULES_H_
+
+#include "libvrctl.h"
+#include "server.h"
+
+/* parse the rest of a "when" line from the rc file */
+void rule_add(char *filename, int linenum, char *line);
+
+/*
+ * Resolve the node names used by the rules, dropping rules that refer to
+ * unknown nodes.  Returns the number of active rules.
+ */
+int rules_resolve(resolve_fn resolve);
+
+/* run the actions of every rule matching an unsolicited <N report */
+void rules_report(struct vrctl_conn *v, const struct vrctl_resp *resp,
+	const char *line);
+
+#endif /* _RULES_H_ */
@@ -0,0 +1,491 @@
+/*
+ * vrctl - scheduled actions
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The server runs timed actions declared in .vrctlrc:
+ *
+ *   at <hh:mm[:ss]> [<days>] <nodes> <command> [<arg>...]
+ *
+ *   at 18:30 porch on
+ *   at 06:15 mon-fri thermostat heat 68
+ *   at 23:00 sat,sun downstairs off
+ *
+ * Pending entries sit in a hierarchical timer wheel with one-second ticks:
+ * WHEEL_LEVELS levels of WHEEL_SIZE slots, each level's slots spanning
+ * WHEEL_SIZE times as long as the one below.  An entry goes into the
+ * coarsest level it needs and moves down a level each time the wheel below
+ * wraps around, so adding, expiring and rescheduling are all O(1) however
+ * many entries there are.
+ *
+ * The wheel follows the wall clock rather than the monotonic one, since
+ * the entries are set in local time.  Daylight saving time doesn't move
+ * the wall clock at all (only its local rendering, which next_due() deals
+ * with), but NTP or an administrator can step it.  If it steps forward by
+ * up to MAX_CATCHUP the ticks in between are run at once, and if it steps
+ * back by that much the wheel waits for it to catch up, so no entry runs
+ * twice.  A bigger step (typically a gateway without an RTC getting the
+ * time long after it booted) starts the wheel over at the new time, and
+ * the actions it skipped over are not run.
+ *
+ * Every entry that comes due on one wakeup is fired as a single batch:
+ * entries with the same command are merged, so a node named by several of
+ * them gets one operation, and all the operations go onto the TX queue
+ * together.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include "util.h"
+#include "arena.h"
+#include "sched.h"
+
+#define TOKLEN			64
+
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4		/* 2^24 s: over 190 days */
+
+#define MAX_CATCHUP		86400
+
+#define ALL_DAYS		0x7f		/* bit n = tm_wday n */
+
+struct sched_entry {
+	int			linenum;
+	int			secs;		/* time of day */
+	unsigned int		days;
+
+	/* action */
+	char			targets[TOKLEN];
+	struct nodeset		to;
+	int			to_all;
+	const struct srv_cmd	*cmd;
+	int			arg;
+	char			units;
+	int			time_ms;
+
+	long long		expires;	/* UNIX time */
+	struct sched_entry	*next;		/* all entries */
+	struct sched_entry	*wnext;		/* wheel slot or batch */
+};
+
+struct sched_op {
+	struct vrctl_op		op;
+	struct sched_entry	*e;
+};
+
+ARENA_DEFINE(sched_arena, "sched", sizeof(struct sched_entry), ARENA_SCHED);
+ARENA_DEFINE(sched_op_arena, "sched_ops", sizeof(struct sched_op),
+	ARENA_ACTIONS);
+
+static struct sched_entry *sched_head = NULL, *sched_tail = NULL;
+
+static struct sched_entry *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static long long wheel_now;		/* last tick run */
+static struct vrctl_timer wheel_timer;
+
+/*
+ * RC FILE
+ */
+
+static const char *day_names[] = {
+	"sun", "mon", "tue", "wed", "thu", "fri", "sat",
+};
+
+static int parse_day(const char *str, int len)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(day_names); i++)
+		if (len == 3 && strncasecmp(str, day_names[i], 3) == 0)
+			return i;
+	return -1;
+}
+
+/* "daily", "weekdays", "weekends" or e.g. "mon-fri", "sat,sun"; 0 if not */
+static unsigned int parse_days(const char *str)
+{
+	unsigned int mask = 0;
+	int first, last;
+
+	if (strcasecmp(str, "daily") == 0)
+		return ALL_DAYS;
+	if (strcasecmp(str, "weekdays") == 0)
+		return 0x3e;
+	if (strcasecmp(str, "weekends") == 0)
+		return 0x41;
+
+	while (1) {
+		first = last = parse_day(str, strcspn(str, ",-"));
+		if (first < 0)
+			return 0;
+		str += 3;
+		if (*str == '-') {
+			last = parse_day(str + 1, strcspn(str + 1, ",-"));
+			if (last < 0)
+				return 0;
+			str += 4;
+		}
+		/* ranges may wrap around the weekend, e.g. fri-mon */
+		while (1) {
+			mask |= 1 << first;
+			if (first == last)
+				break;
+			first = (first + 1) % 7;
+		}
+		if (*str == 0)
+			return mask;
+		if (*str++ != ',')
+			return 0;
+	}
+}
+
+/* hh:mm[:ss]; -1 if invalid */
+static int parse_time(const char *str)
+{
+	long val[3] = { 0, 0, 0 };
+	char *endp;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		val[i] = strtol(str, &endp, 10);
+		if (endp == str || !isdigit(*str))
+			return -1;
+		str = endp;
+		if (*str != ':')
+			break;
+		str++;
+	}
+	if (*str != 0 || i == 0 || i == 3 || val[0] > 23 || val[1] > 59 ||
+	    val[2] > 59)
+		return -1;
+	return val[0] * 3600 + val[1] * 60 + val[2];
+}
+
+void sched_add(char *filename, int linenum, char *line)
+{
+	struct sched_entry *e;
+	struct vrctl_op scratch;
+	char tok[TOKLEN], argbuf[SRV_MAX_ARGS][TOKLEN];
+	char *p = line, *args[SRV_MAX_ARGS] = { argbuf[0], argbuf[1] };
+	int i;
+
+	e = arena_alloc(&sched_arena);
+	if (!e)
+		die("out of memory\n");
+	e->linenum = linenum;
+
+	if (next_token(&p, tok, TOKLEN) < 0 ||
+	    (e->secs = parse_time(tok)) < 0) {
+		info(L_WARNING, "%s:%d: missing or invalid time\n",
+			filename, linenum);
+		goto bad;
+	}
+	if (next_token(&p, e->targets, TOKLEN) < 0) {
+		info(L_WARNING, "%s:%d: missing target nodes\n",
+			filename, linenum);
+		goto bad;
+	}
+	e->days = parse_days(e->targets);
+	if (!e->days)
+		e->days = ALL_DAYS;
+	else if (next_token(&p, e->targets, TOKLEN) < 0) {
+		info(L_WARNING, "%s:%d: missing target nodes\n",
+			filename, linenum);
+		goto bad;
+	}
+	if (next_token(&p, tok, TOKLEN) < 0 ||
+	    (e->cmd = srv_find_cmd(tok)) == NULL) {
+		info(L_WARNING, "%s:%d: missing or invalid command\n",
+			filename, linenum);
+		goto bad;
+	}
+	if (e->cmd->arg_required) {
+		memset(&scratch, 0, sizeof(scratch));
+		for (i = 0; i < e->cmd->arg_required; i++)
+			if (next_token(&p, args[i], TOKLEN) < 0)
+				break;
+		if (i < e->cmd->arg_required ||
+		    srv_parse_arg(&scratch, e->cmd, args) < 0) {
+			info(L_WARNING, "%s:%d: missing or invalid argument\n",
+				filename, linenum);
+			goto bad;
+		}
+		e->arg = scratch.arg;
+		e->units = scratch.units;
+		e->time_ms = scratch.time_ms;
+	}
+
+	if (sched_tail != NULL) {
+		sched_tail->next = e;
+		sched_tail = e;
+	} else {
+		sched_head = sched_tail = e;
+	}
+	return;
+
+bad:
+	arena_free(&sched_arena, e);
+}
+
+static int resolve_entry(struct sched_entry *e, resolve_fn resolve)
+{
+	if (strcasecmp(e->targets, "all") == 0) {
+		if (e->cmd->is_unicast) {
+			info(L_WARNING, "schedule on line %d: %s cannot "
+				"operate on ALL nodes at once\n", e->linenum,
+				e->cmd->name);
+			return -1;
+		}
+		e->to_all = 1;
+		return 0;
+	}
+	if (resolve(e->targets, &e->to) < 0 || !ns_count(&e->to)) {
+		info(L_WARNING, "schedule on line %d: invalid node '%s'\n",
+			e->linenum, e->targets);
+		return -1;
+	}
+	return 0;
+}
+
+int sched_resolve(resolve_fn resolve)
+{
+	struct sched_entry **p = &sched_head, *e;
+	int n = 0;
+
+	sched_tail = NULL;
+	while ((e = *p) != NULL) {
+		if (resolve_entry(e, resolve) < 0) {
+			*p = e->next;
+			arena_free(&sched_arena, e);
+			continue;
+		}
+		sched_tail = e;
+		p = &e->next;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * TIMER WHEEL
+ */
+
+/* the first time after 'after' (local time) that e is due */
+static long long next_due(const struct sched_entry *e, long long after)
+{
+	time_t t = after;
+	struct tm base, tm;
+	long long due;
+	int d;
+
+	localtime_r(&t, &base);
+	for (d = 0; d <= 7; d++) {
+		tm = base;
+		tm.tm_mday += d;
+		tm.tm_hour = e->secs / 3600;
+		tm.tm_min = e->secs / 60 % 60;
+		tm.tm_sec = e->secs % 60;
+		tm.tm_isdst = -1;
+		due = mktime(&tm);
+		if (due > after && (e->days & (1 << tm.tm_wday)))
+			return due;
+	}
+	return after + 86400;		/* not reached */
+}
+
+static void wheel_add(struct sched_entry *e)
+{
+	long long when = e->expires > wheel_now ? e->expires : wheel_now;
+	long long delta = when - wheel_now;
+	int level;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < 1LL << (WHEEL_BITS * (level + 1)))
+			break;
+	e->wnext = wheel[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	wheel[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK] = e;
+}
+
+/* move a slot's entries down to the finer levels */
+static void wheel_cascade(int level)
+{
+	int idx = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	struct sched_entry *e, *next;
+
+	e = wheel[level][idx];
+	wheel[level][idx] = NULL;
+	for (; e; e = next) {
+		next = e->wnext;
+		wheel_add(e);
+	}
+}
+
+/* advance one tick, moving what comes due onto *batch */
+static void wheel_tick(struct sched_entry **batch)
+{
+	struct sched_entry *e, *next;
+	int level, idx;
+
+	wheel_now++;
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (wheel_now & ((1LL << (WHEEL_BITS * level)) - 1))
+			break;
+		wheel_cascade(level);
+	}
+
+	idx = wheel_now & WHEEL_MASK;
+	for (e = wheel[0][idx]; e; e = next) {
+		next = e->wnext;
+		e->wnext = *batch;
+		*batch = e;
+	}
+	wheel[0][idx] = NULL;
+}
+
+/*
+ * ACTIONS
+ */
+
+static void sched_op_done(struct vrctl_op *op)
+{
+	struct sched_op *so = op->priv;
+
+	if (op->ret < 0)
+		info(L_WARNING, "schedule on line %d: %s\n", so->e->linenum,
+			op->errmsg);
+	arena_free(&sched_op_arena, so);
+}
+
+static void fire_one(struct vrctl_conn *v, struct sched_entry *e, int nodeid)
+{
+	struct sched_op *so;
+
+	so = arena_alloc(&sched_op_arena);
+	if (!so) {
+		info(L_WARNING, "schedule on line %d: out of memory\n",
+			e->linenum);
+		return;
+	}
+	so->e = e;
+	so->op.cmd = e->cmd->cmd;
+	so->op.nodeid = nodeid;
+	so->op.arg = e->arg;
+	so->op.units = e->units;
+	so->op.time_ms = e->time_ms;
+	so->op.done = sched_op_done;
+	so->op.priv = so;
+	so->op.prio = VRCTL_PRIO_AUTOMATION;
+	vrctl_op_start(v, &so->op);
+}
+
+static int same_action(const struct sched_entry *a,
+	const struct sched_entry *b)
+{
+	return a->cmd == b->cmd && a->arg == b->arg &&
+		a->units == b->units && a->time_ms == b->time_ms;
+}
+
+static void fire_batch(struct vrctl_conn *v, struct sched_entry *batch)
+{
+	struct sched_entry *e, *f;
+	struct nodeset set;
+	int id, all;
+
+	for (e = batch; e; e = e->wnext) {
+		/* only the first entry with a given action fires it */
+		for (f = batch; f != e; f = f->wnext)
+			if (same_action(e, f))
+				break;
+		if (f != e)
+			continue;
+
+		ns_clear(&set);
+		all = 0;
+		for (f = e; f; f = f->wnext) {
+			if (!same_action(e, f))
+				continue;
+			info(L_VERBOSE, "schedule on line %d: due\n",
+				f->linenum);
+			ns_or(&set, &f->to);
+			all |= f->to_all;
+		}
+
+		if (all) {
+			fire_one(v, e, VRCTL_NODEID_ALL);
+			continue;
+		}
+		ns_for_each(id, &set)
+			fire_one(v, e, id);
+	}
+}
+
+/* empty the wheel and schedule everything afresh from 'now' */
+static void wheel_reset(long long now)
+{
+	struct sched_entry *e;
+
+	memset(wheel, 0, sizeof(wheel));
+	wheel_now = now;
+	for (e = sched_head; e; e = e->next) {
+		e->expires = next_due(e, now);
+		wheel_add(e);
+	}
+}
+
+/* runs at the top of every second */
+static void sched_timer(struct vrctl_timer *t)
+{
+	struct vrctl_conn *v = t->priv;
+	struct sched_entry *batch = NULL, *e, *next;
+	long long now = now_us() / 1000000;
+
+	if (now - wheel_now > MAX_CATCHUP || wheel_now - now > MAX_CATCHUP) {
+		info(L_WARNING, "clock stepped by %lld s; rescheduling all "
+			"timed actions\n", now - wheel_now);
+		wheel_reset(now);
+	}
+	while (wheel_now < now)
+		wheel_tick(&batch);
+	if (batch)
+		fire_batch(v, batch);
+
+	for (e = batch; e; e = next) {
+		next = e->wnext;
+		e->expires = next_due(e, now);
+		wheel_add(e);
+	}
+
+	vrctl_timer_add(v, &wheel_timer, 1000000 - now_us() % 1000000);
+}
+
+void sched_start(struct vrctl_conn *v)
+{
+	if (!sched_head)
+		return;
+
+	wheel_reset(now_us() / 1000000);
+
+	wheel_timer.fn = sched_timer;
+	wheel_timer.priv = v;
+	vrctl_timer_add(v, &wheel_timer, 1000000 - now_us() % 1000000);
+}
@@ -0,0 +1,37 @@
+/*
+ * vrctl - scheduled actions
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include "libvrctl.h"
+#include "server.h"
+
+/* parse the rest of an "at" line from the rc file */
+void sched_add(char *filename, int linenum, char *line);
+
+/*
+ * Resolve the node names used by the schedule, dropping entries that
+ * refer to unknown nodes.  Returns the number of active entries.
+ */
+int sched_resolve(resolve_fn resolve);
+
+/* start running the schedule from the server's event loop */
+void sched_start(struct vrctl_conn *v);
+
+#endif /* _SCHED_H_ */
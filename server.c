@@ -0,0 +1,747 @@
+/*
+ * vrctl - command server
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The server owns the serial port and accepts commands from any number of
+ * local clients over a Unix socket, one per line, in the same form as on
+ * the vrctl command line:
+ *
+ *   kitchen on
+ *   5 level 40
+ *   3 status
+ *
+ * Every node addressed by a command gets one reply line:
+ *
+ *   OK 003 status 255
+ *   ERR 099 on node 99 returned X001 for ON command
+ *
+ * Commands from clients are interactive by default; a poller or other
+ * bulk client can say "priority background" (or "automation") so its
+ * traffic yields to everybody else's.
+ *
+ * "subscribe" makes a client a monitor: from then on it also gets every
+ * <N report the devices send on their own, with a timestamp:
+ *
+ *   EV 1349049600.250 <N003L255
+ *
+ * "memory" lists the server's arenas (see arena.h), one line each with the
+ * objects in use, the high-water mark, the capacity and the object size,
+ * followed by the total high-water mark in bytes:
+ *
+ *   OK - memory requests 0 12 464 464
+ *   OK - memory total 26416
+ *
+ * Each addressed node becomes one library operation (struct vrctl_op).
+ * Their frames are funneled into the library's single ordered TX queue,
+ * so multi-step commands from different clients interleave freely, and
+ * replies are routed back to whichever client submitted them.  A
+ * single thread multiplexes the listening socket, the clients, the serial
+ * port and a timerfd for request timeouts with epoll.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "util.h"
+#include "arena.h"
+#include "server.h"
+#include "rules.h"
+#include "store.h"
+#include "state.h"
+#include "events.h"
+
+#define MAX_EVENTS		16
+#define LINELEN			256
+#define OUTLEN			4096
+#define TOKLEN			64
+
+enum {
+	SRC_LISTEN,
+	SRC_SERIAL,
+	SRC_TIMER,
+	SRC_CLIENT,
+};
+
+struct ev_src {
+	int			type;
+	int			fd;
+};
+
+struct client {
+	struct ev_src		src;
+	char			in[LINELEN];
+	int			inlen, discard;
+	char			out[OUTLEN];
+	int			outlen, want_out;
+	int			pending;
+	int			dead;
+	int			prio;
+	int			subscribed;
+	uint64_t		ev_cursor;	/* next event to send */
+	struct client		*next;
+};
+
+struct server;
+
+struct srv_req {
+	struct vrctl_op		op;
+	struct server		*s;
+	struct client		*c;
+	const struct srv_cmd	*cmd;
+};
+
+struct server {
+	struct vrctl_conn	*v;
+	resolve_fn		resolve;
+	int			epfd;
+	struct ev_src		listen, serial, timer;
+	struct client		*clients;
+	struct evring		ev;
+};
+
+ARENA_DEFINE(client_arena, "clients", sizeof(struct client), ARENA_CLIENTS);
+ARENA_DEFINE(req_arena, "requests", sizeof(struct srv_req), ARENA_REQS);
+
+static volatile sig_atomic_t quit;
+
+/*
+ * COMMANDS
+ */
+
+static int parse_arg(char *str, int maxval)
+{
+	int ret = 0;
+
+	if (!*str)
+		return -1;
+	for (; *str; str++) {
+		if (!isdigit(*str))
+			return -1;
+		ret = ret * 10 + *str - '0';
+		if (ret > maxval)
+			return -1;
+	}
+	return ret;
+}
+
+static const struct srv_cmd cmd_table[] = {
+	{ "on",		0,	0,	VRCTL_CMD_ON,		0 },
+	{ "off",	0,	0,	VRCTL_CMD_OFF,		0 },
+	{ "bounce",	0,	0,	VRCTL_CMD_BOUNCE,	0 },
+	{ "toggle",	0,	1,	VRCTL_CMD_TOGGLE,	0 },
+	{ "level",	1,	0,	VRCTL_CMD_LEVEL,	255 },
+	{ "fade",	2,	1,	VRCTL_CMD_FADE,		255 },
+	{ "status",	0,	1,	VRCTL_CMD_STATUS,	0 },
+	{ "lock",	0,	1,	VRCTL_CMD_LOCK,		0 },
+	{ "unlock",	0,	1,	VRCTL_CMD_UNLOCK,	0 },
+	{ "scene",	1,	0,	VRCTL_CMD_SCENE,	VRCTL_MAX_NODEID },
+	{ "temp",	0,	1,	VRCTL_CMD_TEMP,		0 },
+	{ "setpoint",	0,	1,	VRCTL_CMD_SETPOINT,	0 },
+	{ "fan",	1,	1,	VRCTL_CMD_FAN,		1 },
+	{ "heat",	1,	1,	VRCTL_CMD_HEAT,		99 },
+	{ "cool",	1,	1,	VRCTL_CMD_COOL,		99 },
+	{ "report",	1,	1,	VRCTL_CMD_REPORT,	VRCTL_MAX_NODEID },
+	{ "unreport",	1,	1,	VRCTL_CMD_UNREPORT,	VRCTL_MAX_NODEID },
+};
+
+const struct srv_cmd *srv_find_cmd(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cmd_table); i++)
+		if (strcasecmp(cmd_table[i].name, name) == 0)
+			return &cmd_table[i];
+	return NULL;
+}
+
+/*
+ * Fill in the op's arguments; setpoints look like "70" or "21c", and fades
+ * take a level and a time in msec.
+ */
+int srv_parse_arg(struct vrctl_op *op, const struct srv_cmd *cmd,
+	char **args)
+{
+	char buf[3], *arg = args[0];
+
+	if (!cmd->arg_required)
+		return 0;
+
+	if (cmd->cmd == VRCTL_CMD_FADE) {
+		op->time_ms = parse_arg(args[1], SRV_MAX_FADE_MS);
+		if (op->time_ms < 0)
+			return -1;
+	}
+
+	if (cmd->cmd == VRCTL_CMD_HEAT || cmd->cmd == VRCTL_CMD_COOL) {
+		op->units = 'F';
+		if (strlen(arg) == 3 && tolower(arg[2]) == 'c')
+			op->units = 'C';
+		else if (strlen(arg) == 3 && tolower(arg[2]) != 'f')
+			return -1;
+		snprintf(buf, sizeof(buf), "%s", arg);
+		arg = buf;
+	}
+
+	op->arg = parse_arg(arg, cmd->maxval);
+	return op->arg < 0 ? -1 : 0;
+}
+
+/*
+ * CLIENT I/O
+ */
+
+static void client_close(struct server *s, struct client *c)
+{
+	if (c->dead)
+		return;
+	epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->src.fd, NULL);
+	close(c->src.fd);
+	c->dead = 1;
+}
+
+static void client_update_events(struct server *s, struct client *c)
+{
+	struct epoll_event ev;
+	int want_out = c->outlen != 0;
+
+	if (c->dead || want_out == c->want_out)
+		return;
+	ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+	ev.data.ptr = &c->src;
+	epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->src.fd, &ev);
+	c->want_out = want_out;
+}
+
+static void client_flush(struct server *s, struct client *c)
+{
+	while (c->outlen && !c->dead) {
+		int ret = send(c->src.fd, c->out, c->outlen,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			client_close(s, c);
+			return;
+		}
+		memmove(c->out, c->out + ret, c->outlen - ret);
+		c->outlen -= ret;
+	}
+	client_update_events(s, c);
+}
+
+static void client_printf(struct server *s, struct client *c,
+	const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (c->dead)
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(c->out + c->outlen, OUTLEN - c->outlen, fmt, ap);
+	va_end(ap);
+
+	if (len >= OUTLEN - c->outlen) {
+		/* a client that doesn't read its replies can't stall us */
+		info(L_VERBOSE, "dropping client %d: output overflow\n",
+			c->src.fd);
+		client_close(s, c);
+		return;
+	}
+	c->outlen += len;
+	client_flush(s, c);
+}
+
+static void format_node(char *buf, int len, int nodeid)
+{
+	if (nodeid == VRCTL_NODEID_ALL)
+		snprintf(buf, len, "all");
+	else
+		snprintf(buf, len, "%03d", nodeid);
+}
+
+static void srv_req_done(struct vrctl_op *op)
+{
+	struct srv_req *sr = op->priv;
+	struct client *c = sr->c;
+	struct server *s = sr->s;
+	char node[16];
+
+	format_node(node, sizeof(node), op->nodeid);
+	store_op(op);
+	if (op->ret >= 0)
+		state_seen(op->nodeid);
+
+	if (op->ret < 0) {
+		client_printf(s, c, "ERR %s %s %s\n", node, sr->cmd->name,
+			op->errmsg);
+	} else if (op->cmd == VRCTL_CMD_STATUS ||
+		   op->cmd == VRCTL_CMD_TOGGLE) {
+		client_printf(s, c, "OK %s %s %03d\n", node, sr->cmd->name,
+			op->ret);
+	} else if (op->cmd == VRCTL_CMD_TEMP ||
+		   (op->cmd == VRCTL_CMD_SETPOINT && op->ret)) {
+		int precision, i;
+
+		for (precision = 1, i = op->temp.precision; i; i--)
+			precision *= 10;
+		client_printf(s, c, "OK %s %s %d.%d%c\n", node,
+			sr->cmd->name, op->temp.value / precision,
+			op->temp.value % precision, op->temp.units);
+	} else if (op->cmd == VRCTL_CMD_SETPOINT) {
+		client_printf(s, c, "OK %s %s OFF\n", node, sr->cmd->name);
+	} else {
+		client_printf(s, c, "OK %s %s\n", node, sr->cmd->name);
+	}
+
+	c->pending--;
+	arena_free(&req_arena, sr);
+}
+
+static void submit_one(struct server *s, struct client *c,
+	const struct srv_cmd *cmd, int nodeid, char **args)
+{
+	struct srv_req *sr;
+
+	sr = arena_alloc(&req_arena);
+	if (!sr) {
+		client_printf(s, c, "ERR - %s out of memory\n", cmd->name);
+		return;
+	}
+	if (srv_parse_arg(&sr->op, cmd, args) < 0) {
+		client_printf(s, c, "ERR - %s invalid argument '%s'\n",
+			cmd->name, args[0]);
+		arena_free(&req_arena, sr);
+		return;
+	}
+	sr->op.cmd = cmd->cmd;
+	sr->op.nodeid = nodeid;
+	sr->op.done = srv_req_done;
+	sr->op.priv = sr;
+	sr->op.prio = c->prio;
+	sr->s = s;
+	sr->c = c;
+	sr->cmd = cmd;
+	c->pending++;
+	vrctl_op_start(s->v, &sr->op);
+}
+
+static const char *prio_names[VRCTL_PRIO_MAX] = {
+	[VRCTL_PRIO_INTERACTIVE]	= "interactive",
+	[VRCTL_PRIO_AUTOMATION]		= "automation",
+	[VRCTL_PRIO_BACKGROUND]		= "background",
+};
+
+/* "priority <class>" applies to the rest of this client's commands */
+static void client_priority(struct server *s, struct client *c, char *p)
+{
+	char name[TOKLEN];
+	int prio;
+
+	if (next_token(&p, name, TOKLEN) < 0) {
+		client_printf(s, c, "OK - priority %s\n",
+			prio_names[c->prio]);
+		return;
+	}
+	for (prio = 0; prio < VRCTL_PRIO_MAX; prio++) {
+		if (strcasecmp(name, prio_names[prio]) == 0) {
+			c->prio = prio;
+			client_printf(s, c, "OK - priority %s\n",
+				prio_names[prio]);
+			return;
+		}
+	}
+	client_printf(s, c, "ERR - priority unknown class '%s'\n", name);
+}
+
+/*
+ * Copy a subscriber's events from the ring into its output buffer, as far
+ * as there is room (keeping some for command replies).  A subscriber which
+ * stops reading only falls behind in the ring; once the events it hasn't
+ * seen yet get overwritten, it is dropped.
+ */
+static void client_pump(struct server *s, struct client *c)
+{
+	struct evring_slot e;
+	int ret;
+
+	while (!c->dead && c->outlen < OUTLEN - LINELEN) {
+		ret = evring_get(&s->ev, &c->ev_cursor, &e);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			info(L_VERBOSE, "dropping client %d: too slow for the "
+				"event stream\n", c->src.fd);
+			client_close(s, c);
+			return;
+		}
+		client_printf(s, c, "EV %lld.%03lld %s\n",
+			(long long)e.ts / 1000000,
+			(long long)e.ts / 1000 % 1000, e.line);
+	}
+}
+
+/* "memory": arena usage, for sizing an ARENA=1 build */
+static void client_memory(struct server *s, struct client *c)
+{
+	const struct arena *a = NULL;
+	size_t peak = 0;
+
+	while ((a = arena_next(a)) != NULL) {
+		client_printf(s, c, "OK - memory %s %d %d %d %zu\n", a->name,
+			a->used, a->peak, a->count, a->size);
+		peak += a->size * a->peak;
+	}
+	client_printf(s, c, "OK - memory total %zu\n", peak);
+}
+
+/* "subscribe": follow the <N report stream from now on */
+static void client_subscribe(struct server *s, struct client *c)
+{
+	c->subscribed = 1;
+	c->ev_cursor = evring_head(&s->ev);
+	client_printf(s, c, "OK - subscribe\n");
+}
+
+static void client_line(struct server *s, struct client *c, char *line)
+{
+	char nodename[TOKLEN], command[TOKLEN];
+	char argbuf[SRV_MAX_ARGS][TOKLEN] = { "", "" };
+	char *p = line, *args[SRV_MAX_ARGS] = { argbuf[0], argbuf[1] };
+	const struct srv_cmd *cmd;
+	struct nodeset set;
+	int id, i;
+
+	if (next_token(&p, nodename, TOKLEN) < 0)
+		return;
+	if (strcasecmp(nodename, "priority") == 0) {
+		client_priority(s, c, p);
+		return;
+	}
+	if (strcasecmp(nodename, "subscribe") == 0) {
+		client_subscribe(s, c);
+		return;
+	}
+	if (strcasecmp(nodename, "memory") == 0) {
+		client_memory(s, c);
+		return;
+	}
+	if (next_token(&p, command, TOKLEN) < 0) {
+		client_printf(s, c, "ERR %s - command was not specified\n",
+			nodename);
+		return;
+	}
+
+	cmd = srv_find_cmd(command);
+	if (!cmd) {
+		client_printf(s, c, "ERR %s %s bad command\n",
+			nodename, command);
+		return;
+	}
+	for (i = 0; i < cmd->arg_required; i++) {
+		if (next_token(&p, args[i], TOKLEN) < 0) {
+			client_printf(s, c, "ERR %s %s requires an argument\n",
+				nodename, command);
+			return;
+		}
+	}
+
+	if (strcasecmp(nodename, "all") == 0) {
+		if (cmd->is_unicast)
+			client_printf(s, c, "ERR all %s this command cannot "
+				"operate on ALL nodes at once\n", cmd->name);
+		else
+			submit_one(s, c, cmd, VRCTL_NODEID_ALL, args);
+		return;
+	}
+
+	if (s->resolve(nodename, &set) < 0) {
+		client_printf(s, c, "ERR %s %s invalid node ID\n",
+			nodename, cmd->name);
+		return;
+	}
+	if (ns_count(&set) == 0) {
+		client_printf(s, c, "ERR %s %s no nodes selected\n",
+			nodename, cmd->name);
+		return;
+	}
+	ns_for_each(id, &set)
+		submit_one(s, c, cmd, id, args);
+}
+
+static void client_input(struct server *s, struct client *c)
+{
+	char buf[LINELEN];
+	int len, i;
+
+	len = recv(c->src.fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		client_close(s, c);
+		return;
+	}
+
+	for (i = 0; i < len && !c->dead; i++) {
+		if (buf[i] == '\n') {
+			c->in[c->inlen] = 0;
+			if (c->discard)
+				client_printf(s, c, "ERR - - line too long\n");
+			else
+				client_line(s, c, c->in);
+			c->inlen = c->discard = 0;
+		} else if (c->inlen < LINELEN - 1) {
+			c->in[c->inlen++] = buf[i];
+		} else {
+			c->discard = 1;
+		}
+	}
+}
+
+static void accept_clients(struct server *s)
+{
+	struct epoll_event ev;
+	struct client *c;
+	int fd;
+
+	while (1) {
+		fd = accept4(s->listen.fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		c = arena_alloc(&client_arena);
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->src.type = SRC_CLIENT;
+		c->src.fd = fd;
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = &c->src;
+		if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			arena_free(&client_arena, c);
+			continue;
+		}
+		c->next = s->clients;
+		s->clients = c;
+		info(L_VERBOSE, "client %d connected\n", fd);
+	}
+}
+
+/* free clients that have hung up, once their requests have drained */
+static void reap_clients(struct server *s)
+{
+	struct client **p = &s->clients, *c;
+
+	while ((c = *p) != NULL) {
+		if (c->dead && !c->pending) {
+			*p = c->next;
+			info(L_VERBOSE, "client %d disconnected\n", c->src.fd);
+			arena_free(&client_arena, c);
+		} else {
+			p = &c->next;
+		}
+	}
+}
+
+/*
+ * MAIN LOOP
+ */
+
+/*
+ * unsolicited <N reports: record them, pass them on to the subscribers,
+ * then let the rules react
+ */
+static void srv_report(struct vrctl_resp *r, const char *line, void *arg)
+{
+	struct server *s = arg;
+	struct client *c;
+
+	if (r->type0 == 'N')
+		state_seen(r->arg0);
+	store_report(r, line);
+
+	evring_put(&s->ev, r, line);
+	for (c = s->clients; c; c = c->next)
+		if (c->subscribed)
+			client_pump(s, c);
+
+	rules_report(s->v, r, line);
+}
+
+static void arm_timer(struct server *s)
+{
+	struct itimerspec its;
+	long long deadline = vrctl_next_deadline(s->v);
+
+	memset(&its, 0, sizeof(its));
+	if (deadline) {
+		its.it_value.tv_sec = deadline / 1000000;
+		its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	}
+	timerfd_settime(s->timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void handle_signal(int sig)
+{
+	quit = 1;
+}
+
+static int add_src(struct server *s, struct ev_src *src, int type, int fd)
+{
+	struct epoll_event ev;
+
+	src->type = type;
+	src->fd = fd;
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	return epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int open_listener(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int run_server(struct vrctl_conn *v, const char *path, resolve_fn resolve,
+	const char *ev_path, int ev_slots)
+{
+	struct server srv, *s = &srv;
+	struct epoll_event events[MAX_EVENTS];
+	struct client *c;
+	int i, n, fd, ret = 0;
+
+	memset(s, 0, sizeof(*s));
+	s->v = v;
+	s->resolve = resolve;
+	vrctl_set_report_cb(v, srv_report, s);
+	if (evring_create(&s->ev, ev_path, ev_slots) < 0)
+		return -1;
+
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd < 0)
+		return -1;
+
+	fd = open_listener(path);
+	if (fd < 0 || add_src(s, &s->listen, SRC_LISTEN, fd) < 0)
+		return -1;
+	if (add_src(s, &s->serial, SRC_SERIAL, vrctl_fd(v)) < 0)
+		return -1;
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0 || add_src(s, &s->timer, SRC_TIMER, fd) < 0)
+		return -1;
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	info(L_NORMAL, "listening on %s\n", path);
+
+	while (!quit) {
+		arm_timer(s);
+		n = epoll_wait(s->epfd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct ev_src *src = events[i].data.ptr;
+			uint64_t ticks;
+
+			switch (src->type) {
+			case SRC_LISTEN:
+				accept_clients(s);
+				break;
+			case SRC_SERIAL:
+				if (vrctl_handle_input(v) < 0) {
+					info(L_WARNING, "error: lost the "
+						"VRC0P\n");
+					quit = 1;
+					ret = -1;
+				}
+				break;
+			case SRC_TIMER:
+				read(src->fd, &ticks, sizeof(ticks));
+				vrctl_handle_timers(v);
+				break;
+			case SRC_CLIENT:
+				c = (struct client *)src;
+				if (c->dead)
+					break;
+				if (events[i].events & EPOLLOUT) {
+					client_flush(s, c);
+					if (c->subscribed)
+						client_pump(s, c);
+				}
+				if (events[i].events &
+				    (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					client_input(s, c);
+				break;
+			}
+		}
+		reap_clients(s);
+	}
+
+	for (c = s->clients; c; c = c->next)
+		client_close(s, c);
+	close(s->listen.fd);
+	close(s->timer.fd);
+	close(s->epfd);
+	evring_destroy(&s->ev);
+	unlink(path);
+	return ret;
+}
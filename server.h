@@ -0,0 +1,57 @@
+/*
+ * vrctl - command server
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include "libvrctl.h"
+#include "nodeset.h"
+
+/*
+ * Translate a node name, number or group expression into a set of node
+ * IDs.  Returns -1 if it is invalid.
+ */
+typedef int (*resolve_fn)(const char *name, struct nodeset *set);
+
+#define SRV_MAX_ARGS		2
+#define SRV_MAX_FADE_MS		3600000
+
+struct srv_cmd {
+	char			*name;
+	int			arg_required;	/* 0..SRV_MAX_ARGS */
+	int			is_unicast;
+	int			cmd;		/* VRCTL_CMD_* */
+	int			maxval;		/* for the argument */
+};
+
+/* look up a command by name (case-insensitive) */
+const struct srv_cmd *srv_find_cmd(const char *name);
+
+/* fill in op->arg (and op->units, op->time_ms) from the arguments */
+int srv_parse_arg(struct vrctl_op *op, const struct srv_cmd *cmd,
+	char **args);
+
+/*
+ * Serve clients on the Unix socket path until SIGINT/SIGTERM.  ev_path is
+ * where to publish the event ring (see events.h), or NULL to keep it
+ * private to the socket's subscribers.
+ */
+int run_server(struct vrctl_conn *v, const char *path, resolve_fn resolve,
+	const char *ev_path, int ev_slots);
+
+#endif /* _SERVER_H_ */
@@ -0,0 +1,204 @@
+/*
+ * vrctl - shared-memory node state table
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "store.h"
+#include "state.h"
+
+/* a reader gives up after this many torn copies in a row */
+#define SNAPSHOT_TRIES		1000
+
+static struct state_table *tbl;
+
+/*
+ * WRITER
+ */
+
+static void write_begin(void)
+{
+	tbl->seq++;
+	__sync_synchronize();
+}
+
+static void write_end(void)
+{
+	__sync_synchronize();
+	tbl->seq++;
+}
+
+static void reset_nodes(void)
+{
+	int i;
+
+	memset(tbl->node, 0, sizeof(tbl->node));
+	for (i = 0; i <= VRCTL_MAX_NODEID; i++)
+		tbl->node[i].level = -1;
+}
+
+int state_open(const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd, valid;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 ||
+	    (st.st_size != sizeof(*tbl) && ftruncate(fd, sizeof(*tbl)) < 0)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sizeof(*tbl), PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	tbl = map;
+
+	/*
+	 * Readers may still have an earlier server's table mapped, so clear
+	 * it under the lock rather than starting the sequence over.
+	 */
+	valid = st.st_size == sizeof(*tbl) &&
+		memcmp(tbl->magic, STATE_MAGIC, sizeof(tbl->magic)) == 0 &&
+		tbl->node_size == sizeof(struct state_node) &&
+		tbl->max_nodeid == VRCTL_MAX_NODEID;
+	if (valid) {
+		if (tbl->seq & 1)
+			tbl->seq++;
+		write_begin();
+		reset_nodes();
+		tbl->pid = getpid();
+		write_end();
+		return 0;
+	}
+
+	memset(tbl, 0, sizeof(*tbl));
+	reset_nodes();
+	tbl->node_size = sizeof(struct state_node);
+	tbl->max_nodeid = VRCTL_MAX_NODEID;
+	tbl->pid = getpid();
+	__sync_synchronize();
+	memcpy(tbl->magic, STATE_MAGIC, sizeof(tbl->magic));
+	return 0;
+}
+
+void state_close(void)
+{
+	if (!tbl)
+		return;
+	write_begin();
+	tbl->pid = 0;
+	write_end();
+	munmap(tbl, sizeof(*tbl));
+	tbl = NULL;
+}
+
+void state_seen(int nodeid)
+{
+	if (!tbl || nodeid < 1 || nodeid > VRCTL_MAX_NODEID)
+		return;
+	write_begin();
+	tbl->node[nodeid].seen = time(NULL);
+	write_end();
+}
+
+void state_add(int nodeid, char type, int value, int precision, char units)
+{
+	struct state_node *n;
+	uint32_t now = time(NULL);
+
+	if (!tbl || nodeid < 1 || nodeid > VRCTL_MAX_NODEID)
+		return;
+	if (type != ST_LEVEL && type != ST_TEMP)
+		return;
+
+	n = &tbl->node[nodeid];
+	write_begin();
+	n->seen = now;
+	if (type == ST_LEVEL) {
+		n->level = value;
+		n->level_ts = now;
+	} else {
+		n->temp = value;
+		n->temp_prec = precision;
+		n->temp_units = units;
+		n->temp_ts = now;
+	}
+	write_end();
+}
+
+/*
+ * READERS
+ */
+
+const struct state_table *state_attach(const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size != sizeof(struct state_table)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	return map;
+}
+
+int state_snapshot(const struct state_table *map, struct state_table *t)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_TRIES; i++) {
+		seq = map->seq;
+		__sync_synchronize();
+		if (seq & 1)
+			continue;
+		memcpy(t, (const void *)map, sizeof(*t));
+		__sync_synchronize();
+		if (map->seq != seq)
+			continue;
+
+		if (memcmp(t->magic, STATE_MAGIC, sizeof(t->magic)) != 0 ||
+		    t->node_size != sizeof(struct state_node) ||
+		    t->max_nodeid != VRCTL_MAX_NODEID)
+			return -1;
+
+		return !t->pid;
+	}
+	return -1;
+}
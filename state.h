@@ -0,0 +1,85 @@
+/*
+ * vrctl - shared-memory node state table
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdint.h>
+#include "libvrctl.h"
+
+/*
+ * The command server publishes the latest level and temperature of every
+ * node in a small memory-mapped file (ideally on tmpfs, e.g. /dev/shm).
+ * Readers in other programs can map it and take snapshots without any
+ * system calls, following this layout (native byte order):
+ *
+ * seq is a sequence lock.  The writer makes it odd before changing the
+ * table and even again afterwards, so a reader copies what it needs
+ * between two reads of seq and retries if they differ or are odd.
+ */
+
+#define STATE_MAGIC		"VRCTLNS1"
+
+struct state_node {
+	uint32_t		seen;		/* UNIX time; 0 = never */
+	int32_t			level;		/* -1 = unknown */
+	uint32_t		level_ts;
+	int32_t			temp;		/* scaled by 10^temp_prec */
+	uint8_t			temp_prec;
+	char			temp_units;	/* 0 = unknown */
+	uint16_t		reserved;
+	uint32_t		temp_ts;
+};
+
+struct state_table {
+	char			magic[8];
+	uint32_t		node_size;	/* sizeof(struct state_node) */
+	uint32_t		max_nodeid;
+	volatile uint32_t	seq;
+	uint32_t		pid;		/* writer; 0 = stopped */
+	uint32_t		reserved[10];
+	struct state_node	node[VRCTL_MAX_NODEID + 1];
+};
+
+/*
+ * WRITER (the server)
+ *
+ * state_open() creates or takes over the file; it returns -1 on error.
+ * The update calls do nothing unless it is open.
+ */
+int state_open(const char *path);
+void state_close(void);
+
+void state_seen(int nodeid);
+
+/* one reading, in the same form as store_add() */
+void state_add(int nodeid, char type, int value, int precision, char units);
+
+/*
+ * READERS
+ *
+ * state_snapshot() copies a consistent view of the table into *t.  It
+ * returns 0 on success, 1 if the writer has stopped (t is still filled in
+ * with the last data it published), or -1 if no consistent copy could be
+ * taken.  A writer which crashed never clears t->pid, so callers that care
+ * should check that it is still running.
+ */
+const struct state_table *state_attach(const char *path);
+int state_snapshot(const struct state_table *map, struct state_table *t);
+
+#endif /* _STATE_H_ */
@@ -0,0 +1,262 @@
+/*
+ * libvrctl - per-node link statistics
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "arena.h"
+#include "vrctl_int.h"
+
+/*
+ * Most networks only have a handful of nodes, so the per-command counters
+ * for a node are only allocated once something is sent to it.  The saved
+ * file is plain text with one line per (node, command) pair that has been
+ * used:
+ *
+ *   stat <node> <cmd> <attempts> <ok> <timeouts> <xerrs> <last_x> <rtt>...
+ */
+
+struct vrctl_stats {
+	struct vrctl_link_stats	*node[VRCTL_MAX_NODEID + 1];
+};
+
+/* a live table plus one being read back (--health) */
+ARENA_DEFINE(stats_arena, "stats", sizeof(struct vrctl_stats), 2);
+ARENA_DEFINE(stats_node_arena, "stats_nodes",
+	VRCTL_CMD_MAX * sizeof(struct vrctl_link_stats), VRCTL_MAX_NODEID + 1);
+
+static struct vrctl_link_stats *get_node(struct vrctl_stats *st, int nodeid)
+{
+	if (!st->node[nodeid])
+		st->node[nodeid] = arena_alloc(&stats_node_arena);
+	return st->node[nodeid];
+}
+
+static int rtt_bucket(long long rtt_us)
+{
+	int i;
+
+	for (i = 0; i < VRCTL_RTT_BUCKETS - 1; i++)
+		if (rtt_us < (1000LL << i))
+			break;
+	return i;
+}
+
+void stats_record(struct vrctl_conn *v, int nodeid, int cmd,
+	const struct vrctl_req *rq)
+{
+	struct vrctl_link_stats *ls;
+
+	if (!v->stats || nodeid < 1 || nodeid > VRCTL_MAX_NODEID ||
+	    cmd < 0 || cmd >= VRCTL_CMD_MAX || !rq->sent)
+		return;
+
+	/* port errors and aborted requests say nothing about the node */
+	if (rq->ret < 0 && rq->ret != -VRCTL_ETIMEDOUT &&
+	    rq->ret != -VRCTL_EDEVICE)
+		return;
+
+	ls = get_node(v->stats, nodeid);
+	if (!ls)
+		return;
+	ls = &ls[cmd];
+
+	ls->attempts++;
+	if (rq->ret == 0) {
+		ls->successes++;
+		ls->rtt[rtt_bucket(mono_us() - rq->sent)]++;
+	} else if (rq->ret > 0) {
+		ls->xerrs++;
+		ls->last_x = rq->ret;
+	} else if (rq->ret == -VRCTL_ETIMEDOUT) {
+		ls->timeouts++;
+	}
+}
+
+static int find_cmd(const char *name)
+{
+	int i;
+
+	for (i = 0; i < VRCTL_CMD_MAX; i++)
+		if (strcmp(vrctl_cmd_name(i), name) == 0)
+			return i;
+	return -1;
+}
+
+static int parse_line(struct vrctl_stats *st, char *buf)
+{
+	struct vrctl_link_stats tmp, *ls;
+	char name[BUFLEN], *p;
+	unsigned int last_x;
+	int id, cmd, i, len;
+
+	memset(&tmp, 0, sizeof(tmp));
+	if (sscanf(buf, "stat %d %63s %u %u %u %u %x%n", &id, name,
+		   &tmp.attempts, &tmp.successes, &tmp.timeouts, &tmp.xerrs,
+		   &last_x, &len) != 7)
+		return -1;
+	if (id < 1 || id > VRCTL_MAX_NODEID || (cmd = find_cmd(name)) < 0)
+		return -1;
+	tmp.last_x = last_x;
+
+	p = buf + len;
+	for (i = 0; i < VRCTL_RTT_BUCKETS; i++) {
+		if (sscanf(p, " %u%n", &tmp.rtt[i], &len) != 1)
+			return -1;
+		p += len;
+	}
+
+	ls = get_node(st, id);
+	if (!ls)
+		return -1;
+	ls[cmd] = tmp;
+	return 0;
+}
+
+struct vrctl_stats *vrctl_stats_load(const char *path, const char *dev)
+{
+	struct vrctl_stats *st;
+	char buf[PATHLEN], port[PATHLEN] = "";
+	FILE *f;
+	int i;
+
+	st = arena_alloc(&stats_arena);
+	if (!st)
+		return NULL;
+
+	f = fopen(path, "r");
+	if (!f)
+		return st;
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		if (sscanf(buf, "port %255s", port) == 1)
+			continue;
+		parse_line(st, buf);
+	}
+	fclose(f);
+
+	if (strcmp(port, dev) != 0) {
+		for (i = 0; i <= VRCTL_MAX_NODEID; i++) {
+			arena_free(&stats_node_arena, st->node[i]);
+			st->node[i] = NULL;
+		}
+	}
+	return st;
+}
+
+int vrctl_stats_save(const struct vrctl_stats *st, const char *path,
+	const char *dev)
+{
+	const struct vrctl_link_stats *ls;
+	FILE *f;
+	int id, cmd, i;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -VRCTL_EOPEN;
+
+	fprintf(f, "# vrctl link statistics - node cmd attempts ok "
+		"timeouts xerrs last_x rtt[]\n");
+	fprintf(f, "port %s\n", dev);
+	for (id = 1; id <= VRCTL_MAX_NODEID; id++) {
+		if (!st->node[id])
+			continue;
+		for (cmd = 0; cmd < VRCTL_CMD_MAX; cmd++) {
+			ls = &st->node[id][cmd];
+			if (!ls->attempts)
+				continue;
+			fprintf(f, "stat %d %s %u %u %u %u %03x", id,
+				vrctl_cmd_name(cmd), ls->attempts,
+				ls->successes, ls->timeouts, ls->xerrs,
+				ls->last_x);
+			for (i = 0; i < VRCTL_RTT_BUCKETS; i++)
+				fprintf(f, " %u", ls->rtt[i]);
+			fprintf(f, "\n");
+		}
+	}
+	if (fclose(f) != 0)
+		return -VRCTL_EIO;
+	return 0;
+}
+
+void vrctl_stats_free(struct vrctl_stats *st)
+{
+	int i;
+
+	if (!st)
+		return;
+	for (i = 0; i <= VRCTL_MAX_NODEID; i++)
+		arena_free(&stats_node_arena, st->node[i]);
+	arena_free(&stats_arena, st);
+}
+
+void vrctl_set_stats(struct vrctl_conn *v, struct vrctl_stats *st)
+{
+	v->stats = st;
+}
+
+int vrctl_stats_get(const struct vrctl_stats *st, int nodeid, int cmd,
+	struct vrctl_link_stats *ls)
+{
+	const struct vrctl_link_stats *src;
+	int i, j;
+
+	memset(ls, 0, sizeof(*ls));
+	if (nodeid < 1 || nodeid > VRCTL_MAX_NODEID || !st->node[nodeid] ||
+	    cmd >= VRCTL_CMD_MAX)
+		return 0;
+
+	if (cmd >= 0) {
+		*ls = st->node[nodeid][cmd];
+		return ls->attempts;
+	}
+
+	for (i = 0; i < VRCTL_CMD_MAX; i++) {
+		src = &st->node[nodeid][i];
+		ls->attempts += src->attempts;
+		ls->successes += src->successes;
+		ls->timeouts += src->timeouts;
+		ls->xerrs += src->xerrs;
+		if (src->last_x)
+			ls->last_x = src->last_x;
+		for (j = 0; j < VRCTL_RTT_BUCKETS; j++)
+			ls->rtt[j] += src->rtt[j];
+	}
+	return ls->attempts;
+}
+
+unsigned int vrctl_stats_rtt_ms(const struct vrctl_link_stats *ls, int pct)
+{
+	unsigned int total = 0, sum = 0, want;
+	int i;
+
+	for (i = 0; i < VRCTL_RTT_BUCKETS; i++)
+		total += ls->rtt[i];
+	if (!total)
+		return 0;
+
+	/* smallest bucket covering at least pct% of the samples */
+	want = ((unsigned long long)total * pct + 99) / 100;
+	for (i = 0; i < VRCTL_RTT_BUCKETS - 1; i++) {
+		sum += ls->rtt[i];
+		if (sum >= want)
+			break;
+	}
+	return 1U << i;
+}
@@ -0,0 +1,340 @@
+/*
+ * vrctl - sensor reading store
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Readings (node, type, timestamp, value) are appended to a fixed-size
+ * ring of 12-byte records in a memory-mapped file:
+ *
+ *   [ header (64 bytes) ][ rec 0 ][ rec 1 ] ... [ rec capacity-1 ]
+ *
+ * Once the ring is full the oldest readings are overwritten.  Timestamps
+ * never go backwards within the ring, so a time range can be located by
+ * binary search and only the records inside it are visited.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "store.h"
+#include "state.h"
+
+#define STORE_MAGIC		"VRCTLTS1"
+
+struct store_hdr {
+	char			magic[8];
+	uint32_t		rec_size;
+	uint32_t		capacity;
+	uint64_t		written;	/* total records ever appended */
+	uint32_t		last_ts;
+	uint32_t		reserved[9];
+};
+
+struct store_rec {
+	uint32_t		ts;
+	uint8_t			nodeid;
+	char			type;
+	uint8_t			precision;
+	char			units;
+	int32_t			value;
+};
+
+static int store_fd = -1;
+static struct store_hdr *hdr;
+static struct store_rec *recs;
+static size_t map_len;
+
+int store_open(const char *path, int nrecs, int readonly)
+{
+	struct store_hdr init;
+	struct stat st;
+	void *map;
+
+	store_fd = open(path, readonly ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	if (store_fd < 0)
+		return -1;
+	if (fstat(store_fd, &st) < 0)
+		goto err;
+
+	if (st.st_size == 0 && !readonly) {
+		memset(&init, 0, sizeof(init));
+		memcpy(init.magic, STORE_MAGIC, sizeof(init.magic));
+		init.rec_size = sizeof(struct store_rec);
+		init.capacity = nrecs;
+		if (write(store_fd, &init, sizeof(init)) != sizeof(init) ||
+		    ftruncate(store_fd, sizeof(init) +
+			      (off_t)nrecs * sizeof(struct store_rec)) < 0)
+			goto err;
+	} else {
+		if (st.st_size < sizeof(init) ||
+		    pread(store_fd, &init, sizeof(init), 0) != sizeof(init) ||
+		    memcmp(init.magic, STORE_MAGIC, sizeof(init.magic)) != 0 ||
+		    init.rec_size != sizeof(struct store_rec) ||
+		    st.st_size < sizeof(init) +
+			(off_t)init.capacity * sizeof(struct store_rec)) {
+			info(L_WARNING, "warning: %s is not a vrctl store\n",
+				path);
+			goto err;
+		}
+		if (nrecs && init.capacity != nrecs)
+			info(L_VERBOSE, "%s: keeping existing size of %u "
+				"records\n", path, init.capacity);
+	}
+
+	map_len = sizeof(init) + (size_t)init.capacity *
+		sizeof(struct store_rec);
+	map = mmap(NULL, map_len, readonly ? PROT_READ :
+		PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+
+	hdr = map;
+	recs = (struct store_rec *)(hdr + 1);
+	return 0;
+
+err:
+	close(store_fd);
+	store_fd = -1;
+	return -1;
+}
+
+void store_close(void)
+{
+	if (store_fd < 0)
+		return;
+	munmap(hdr, map_len);
+	close(store_fd);
+	store_fd = -1;
+	hdr = NULL;
+	recs = NULL;
+}
+
+/*
+ * WRITING
+ */
+
+void store_add(int nodeid, char type, int value, int precision, char units)
+{
+	struct store_rec *r;
+	uint32_t ts = time(NULL);
+
+	/* the server's state table gets every reading, store or not */
+	state_add(nodeid, type, value, precision, units);
+
+	if (store_fd < 0 || !hdr->capacity || nodeid < 1 ||
+	    nodeid > VRCTL_MAX_NODEID)
+		return;
+
+	/* other vrctl processes may share the file */
+	flock(store_fd, LOCK_EX);
+
+	/* keep the ring sorted even if the clock steps backwards */
+	if (ts < hdr->last_ts)
+		ts = hdr->last_ts;
+
+	r = &recs[hdr->written % hdr->capacity];
+	r->ts = ts;
+	r->nodeid = nodeid;
+	r->type = type;
+	r->precision = precision;
+	r->units = units;
+	r->value = value;
+
+	/* readers look at "written" to see how much is valid */
+	__sync_synchronize();
+	hdr->last_ts = ts;
+	hdr->written++;
+
+	flock(store_fd, LOCK_UN);
+}
+
+void store_temp(int nodeid, char type, const struct vrctl_temp *t)
+{
+	store_add(nodeid, type, t->value, t->precision, t->units);
+}
+
+/* polling path: results of status/temp/setpoint commands */
+void store_op(const struct vrctl_op *op)
+{
+	if (op->ret < 0)
+		return;
+
+	switch (op->cmd) {
+	case VRCTL_CMD_STATUS:
+	case VRCTL_CMD_TOGGLE:
+		store_add(op->nodeid, ST_LEVEL, op->ret, 0, 0);
+		break;
+	case VRCTL_CMD_TEMP:
+		store_temp(op->nodeid, ST_TEMP, &op->temp);
+		break;
+	case VRCTL_CMD_SETPOINT:
+		store_add(op->nodeid, ST_MODE, op->ret, 0, 0);
+		if (op->ret != VRCTL_MODE_OFF)
+			store_temp(op->nodeid, ST_SETPOINT, &op->temp);
+		break;
+	}
+}
+
+/* monitor path: unsolicited <N reports */
+void store_report(const struct vrctl_resp *r, const char *line)
+{
+	if (r->type0 != 'N' || !r->type1)
+		return;
+
+	if (line[5] != ':') {
+		store_add(r->arg0, r->type1, r->arg1, 0, 0);
+		return;
+	}
+
+	/*
+	 * Command class reports (<N004:049,...) are only decoded for the
+	 * classes vrctl_parse_resp() understands: temperatures and setpoints
+	 * come back in 'C' or 'F', thermostat modes as 'M'.  Anything else
+	 * (humidity, luminance, ...) is left as ':' and not stored.
+	 */
+	switch (r->type1) {
+	case 'C':
+	case 'F':
+		store_add(r->arg0, strncmp(&line[5], ":067,", 5) == 0 ?
+			ST_SETPOINT : ST_TEMP, r->arg1, r->arg1_precision,
+			r->type1);
+		break;
+	case 'M':
+		store_add(r->arg0, ST_MODE, r->arg1, 0, 0);
+		break;
+	}
+}
+
+/*
+ * QUERIES
+ */
+
+char store_parse_type(const char *name)
+{
+	if (strcasecmp(name, "level") == 0 || strcasecmp(name, "status") == 0)
+		return ST_LEVEL;
+	if (strcasecmp(name, "temp") == 0)
+		return ST_TEMP;
+	if (strcasecmp(name, "setpoint") == 0)
+		return ST_SETPOINT;
+	if (strcasecmp(name, "mode") == 0)
+		return ST_MODE;
+	if (strlen(name) == 1 && name[0] >= 'A' && name[0] <= 'Z')
+		return name[0];
+	return 0;
+}
+
+/* index of the first record (oldest = 0) with ts >= from */
+static uint64_t lower_bound(uint64_t first, uint64_t count, long from)
+{
+	uint64_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (recs[(first + mid) % hdr->capacity].ts < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static double scale(const struct store_rec *r)
+{
+	double val = r->value;
+	int i;
+
+	for (i = 0; i < r->precision; i++)
+		val /= 10;
+	return val;
+}
+
+static void print_bucket(long start, double min, double sum, double max,
+	int count, int precision)
+{
+	printf("%ld %.*f %.*f %.*f %d\n", start, precision, min,
+		precision + 1, sum / count, precision, max, count);
+}
+
+int store_query(int nodeid, char type, long from, long to, long step)
+{
+	uint64_t written, first, count, i;
+	double val, min = 0, max = 0, sum = 0;
+	long bucket = -1, b;
+	int n = 0, precision = 0, buckets = 0;
+
+	if (store_fd < 0 || !hdr->capacity || step <= 0)
+		return 0;
+
+	written = hdr->written;
+	__sync_synchronize();
+	count = written < hdr->capacity ? written : hdr->capacity;
+
+	/*
+	 * Skip a few of the oldest records: a writer might be overwriting
+	 * them while we read.
+	 */
+	if (count == hdr->capacity && count > 16)
+		count -= 16;
+	first = written - count;
+
+	for (i = lower_bound(first, count, from); i < count; i++) {
+		const struct store_rec *r = &recs[(first + i) % hdr->capacity];
+
+		if (r->ts > to)
+			break;
+		if (r->nodeid != nodeid || r->type != type)
+			continue;
+
+		b = (r->ts - from) / step;
+		if (b != bucket) {
+			if (n)
+				print_bucket(from + bucket * step, min, sum,
+					max, n, precision);
+			buckets += !!n;
+			bucket = b;
+			n = precision = 0;
+			sum = 0;
+		}
+
+		val = scale(r);
+		if (!n || val < min)
+			min = val;
+		if (!n || val > max)
+			max = val;
+		if (r->precision > precision)
+			precision = r->precision;
+		sum += val;
+		n++;
+	}
+	if (n) {
+		print_bucket(from + bucket * step, min, sum, max, n,
+			precision);
+		buckets++;
+	}
+	return buckets;
+}
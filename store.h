@@ -0,0 +1,55 @@
+/*
+ * vrctl - sensor reading store
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include "libvrctl.h"
+
+/* reading types */
+#define ST_LEVEL		'L'
+#define ST_TEMP			'T'
+#define ST_SETPOINT		'P'
+#define ST_MODE			'M'
+
+#define STORE_DEFAULT_RECORDS	65536
+
+/*
+ * Open (creating if necessary) a store holding up to nrecs readings.  An
+ * existing store keeps its original size.  Returns -1 on error.
+ */
+int store_open(const char *path, int nrecs, int readonly);
+void store_close(void);
+
+/* these do nothing if no store is open */
+void store_add(int nodeid, char type, int value, int precision, char units);
+void store_temp(int nodeid, char type, const struct vrctl_temp *t);
+void store_op(const struct vrctl_op *op);
+void store_report(const struct vrctl_resp *r, const char *line);
+
+/* map "level", "temp", ... to a reading type; 0 if unknown */
+char store_parse_type(const char *name);
+
+/*
+ * Print one line per step-second bucket between from and to (UNIX time):
+ *   <start> <min> <avg> <max> <count>
+ * Returns the number of buckets printed.
+ */
+int store_query(int nodeid, char type, long from, long to, long step);
+
+#endif /* _STORE_H_ */
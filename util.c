@@ -25,12 +25,16 @@
 #include <signal.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <time.h>
 #include <sys/time.h>
+#include <dirent.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include "util.h"
 
 #define BUFLEN			256
+#define LOCK_POLL_MAX_US	20000
 
 int g_loglevel = L_NORMAL;
 char *g_locked_tty = NULL;
@@ -61,11 +65,28 @@ void info(int level, char *fmt, ...)
 	}
 }
 
+long long now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* for measuring intervals; not affected by changes to the wall clock */
+long long mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 int next_token(char **in, char *tok, int maxlen)
 {
 	int len;
 
-	for (len = 0; len < BUFLEN - 1; (*in)++) {
+	for (len = 0; len < maxlen - 1; (*in)++) {
 		if (**in == 0 || **in == '\r' || **in == '\n') {
 			if (len == 0)
 				return -1;
@@ -156,124 +177,142 @@ void unlock_tty(char *name)
 		unlink(lockname);
 }
 
-int set_tty_defaults(int fd, int baud)
-{
-	struct termios termios;
+/*
+ * Waiters line up in /var/lock/LCK..ttyS0.queue/, one file per process.
+ * The file names sort in arrival order, so the process owning the lowest
+ * live entry is the only one allowed to go after the UUCP lock.  Programs
+ * that only know about LCK..ttyS0 are unaffected; the head of the queue
+ * simply keeps polling until they let go of the port.  Arrival times come
+ * from CLOCK_MONOTONIC, which is shared by all processes and doesn't jump
+ * when NTP steps the wall clock.
+ */
 
-	if (tcgetattr(fd, &termios) != 0)
+static int get_queuename(char *dev, char *buf)
+{
+	if (get_lockname(dev, buf) == -1)
 		return -1;
-
-	termios.c_iflag = 0;
-	termios.c_oflag = 0;
-	termios.c_cflag = CS8 | CLOCAL | CREAD;
-	termios.c_lflag = 0;
-	switch (baud) {
-		case 115200: cfsetspeed(&termios, B115200); break;
-		case 57600: cfsetspeed(&termios, B57600); break;
-		case 38400: cfsetspeed(&termios, B38400); break;
-		case 19200: cfsetspeed(&termios, B19200); break;
-		case 9600: cfsetspeed(&termios, B9600); break;
-		default:
-			return -1;
-	}
-
-	if (tcsetattr(fd, TCSANOW, &termios) != 0)
+	if (strlen(buf) + sizeof(".queue") > BUFLEN)
 		return -1;
+	strcat(buf, ".queue");
 	return 0;
 }
 
-unsigned char read_byte(int fd)
+/* per-port scratch file for state that should not survive a reboot */
+int get_tty_statename(char *dev, char *buf, int len)
 {
-	char c;
-	fd_set s;
-
-	FD_ZERO(&s);
-	FD_SET(fd, &s);
-	select(fd + 1, &s, NULL, NULL, NULL);
+	char lockname[BUFLEN];
 
-	if (read(fd, &c, 1) != 1)
-		die("EOF or read error on tty\n");
-	return c;
+	if (get_lockname(dev, lockname) == -1)
+		return -1;
+	if (snprintf(buf, len, "%s.state", lockname) >= len)
+		return -1;
+	return 0;
 }
 
-void read_bytes(int fd, unsigned char *buf, int maxlen)
+/* 1 if nobody who is still alive got in line before "me" */
+static int queue_head(char *qdir, char *me)
 {
-	while (maxlen) {
-		int bytes = read(fd, buf, maxlen);
-		if (bytes <= 0)
-			die("EOF or read error on tty\n");
-		maxlen -= bytes;
-		buf += bytes;
-	}
-}
+	DIR *d;
+	struct dirent *de;
+	char path[BUFLEN * 2];
+	int ret = 1;
 
-void flush_bytes(int fd)
-{
-	fd_set s;
-	struct timeval tv;
+	d = opendir(qdir);
+	if (!d)
+		return 1;
 
-	FD_ZERO(&s);
-	FD_SET(fd, &s);
-	tv.tv_sec = tv.tv_usec = 0;
+	while ((de = readdir(d)) != NULL) {
+		char *dot = strrchr(de->d_name, '.');
+		int pid;
 
-	while (select(fd + 1, &s, NULL, NULL, &tv) > 0)
-		read_byte(fd);
-}
+		if (de->d_name[0] == '.' || !dot)
+			continue;
+		if (me && strcmp(de->d_name, me) >= 0)
+			continue;
 
-static void write_loop(int fd, char *buf, int len)
-{
-	while (len) {
-		int bytes = write(fd, buf, len);
-		if (bytes <= 0)
-			die("EOF or write error on tty\n");
-		len -= bytes;
-		buf += bytes;
+		pid = atoi(dot + 1);
+		if (pid > 0 && (kill(pid, 0) >= 0 || errno != ESRCH)) {
+			ret = 0;
+			break;
+		}
+
+		/* waiter went away without cleaning up */
+		snprintf(path, sizeof(path), "%s/%s", qdir, de->d_name);
+		unlink(path);
 	}
+	closedir(d);
+	return ret;
 }
 
-void write_line(int fd, char *buf)
+int lock_tty_wait(char *name, char *caller, int timeout_ms)
 {
-	int len = strlen(buf);
-	char eol[] = "\r";
+	char qdir[BUFLEN], me[BUFLEN], path[BUFLEN * 2];
+	long long start = mono_us();
+	int fd, ret, delay = 1000;
 
-	info(L_DEBUG, "%s: sending '%s'\n", __func__, buf);
-	write_loop(fd, buf, len);
-	write_loop(fd, eol, 2);
-}
+	if (access("/var/lock", R_OK | W_OK) < 0)
+		return 0;
+	if (get_queuename(name, qdir) == -1)
+		return -1;
 
-int read_line(int fd, char *buf, int maxlen, int timeout_us)
-{
-	char c, *ptr = buf;
-	int len = 0;
+	/* don't barge in ahead of processes that are already waiting */
+	if (timeout_ms == 0)
+		return queue_head(qdir, NULL) ? lock_tty(name, caller) : -1;
 
-	while (len < maxlen) {
-		struct timeval tv;
-		fd_set s;
+	if (mkdir(qdir, 01777) < 0 && errno != EEXIST)
+		return lock_tty(name, caller);
+	chmod(qdir, 01777);
 
-		FD_ZERO(&s);
-		FD_SET(fd, &s);
-		tv.tv_sec = timeout_us / 1000000;
-		tv.tv_usec = timeout_us % 1000000;
+	snprintf(me, BUFLEN, "%020lld.%010d", start, getpid());
+	snprintf(path, sizeof(path), "%s/%s", qdir, me);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return lock_tty(name, caller);
+	close(fd);
 
-		if (select(fd + 1, &s, NULL, NULL, &tv) != 1) {
-			info(L_DEBUG, "%s: timed out\n", __func__);
-			return -ETIMEDOUT;
+	while (1) {
+		if (queue_head(qdir, me) && lock_tty(name, caller) == 0) {
+			ret = 0;
+			break;
 		}
-		c = read_byte(fd);
-		if (c == '\r' || c == '\n') {
-			if (len != 0) {
-				*ptr = 0;
-				info(L_DEBUG, "%s: got '%s'\n", __func__, buf);
-				return len;
-			}
-			/* ignore empty lines or leading [\r\n] */
-			continue;
+		if (timeout_ms > 0 &&
+		    mono_us() - start >= (long long)timeout_ms * 1000) {
+			ret = -1;
+			break;
 		}
-		*(ptr++) = c;
-		len++;
+		usleep(delay);
+		if (delay < LOCK_POLL_MAX_US)
+			delay <<= 1;
 	}
 
-	*ptr = 0;
-	info(L_DEBUG, "%s: out of buffer space\n", __func__);
-	return -ENOSPC;
+	unlink(path);
+	info(L_VERBOSE, "%s: waited %lld ms for %s\n", __func__,
+		(mono_us() - start) / 1000, name);
+	return ret;
+}
+
+int set_tty_defaults(int fd, int baud)
+{
+	struct termios termios;
+
+	if (tcgetattr(fd, &termios) != 0)
+		return -1;
+
+	termios.c_iflag = 0;
+	termios.c_oflag = 0;
+	termios.c_cflag = CS8 | CLOCAL | CREAD;
+	termios.c_lflag = 0;
+	switch (baud) {
+		case 115200: cfsetspeed(&termios, B115200); break;
+		case 57600: cfsetspeed(&termios, B57600); break;
+		case 38400: cfsetspeed(&termios, B38400); break;
+		case 19200: cfsetspeed(&termios, B19200); break;
+		case 9600: cfsetspeed(&termios, B9600); break;
+		default:
+			return -1;
+	}
+
+	if (tcsetattr(fd, TCSANOW, &termios) != 0)
+		return -1;
+	return 0;
 }
@@ -39,16 +39,14 @@ extern char *g_locked_tty;
 
 void die(const char *fmt, ...);
 void info(int level, char *fmt, ...);
+long long now_us(void);
+long long mono_us(void);
 int next_token(char **in, char *tok, int maxlen);
 
 int lock_tty(char *name, char *caller);
+int lock_tty_wait(char *name, char *caller, int timeout_ms);
 void unlock_tty(char *name);
+int get_tty_statename(char *dev, char *buf, int len);
 int set_tty_defaults(int fd, int baud);
 
-unsigned char read_byte(int fd);
-void read_bytes(int fd, unsigned char *buff, int maxlen);
-void flush_bytes(int fd);
-int read_line(int fd, char *buf, int maxlen, int timeout_us);
-void write_line(int fd, char *buf);
-
 #endif /* _UTIL_H_ */
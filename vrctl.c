@@ -27,77 +27,100 @@
 #include <termios.h>
 #include <signal.h>
 #include <getopt.h>
+#include <time.h>
 #include <ctype.h>
 #include <sys/select.h>
 #include <sys/fcntl.h>
 #include <sys/types.h>
 #include "util.h"
+#include "arena.h"
+#include "port.h"
+#include "libvrctl.h"
+#include "server.h"
+#include "rules.h"
+#include "sched.h"
+#include "store.h"
+#include "state.h"
+#include "events.h"
+#include "alias.h"
+#include "firmware.h"
 
 #define VERSION			"0.1"
 #define BUFLEN			64
 #define DEFAULT_DEV		"/dev/vrc0p"
 #define RC_NAME			".vrctlrc"
+#define RC_LINELEN		256
+#define NODES_NAME		".vrctl_nodes"
+#define HEALTH_NAME		".vrctl_health"
 #define TIMEOUT			3000000
 #define TIMEOUT_UPGRADE		4000000
-#define NODEID_ALL		-2
-#define MAX_NODEID		232
+#define FW_LINELEN		600
+#define UPDATE_ALWAYS		-1
+#define UPDATE_NEVER		-2
+#define NODEID_ALL		VRCTL_NODEID_ALL
+#define MAX_NODEID		VRCTL_MAX_NODEID
+#define MAX_FADE_MS		3600000
+#define EVENTS_POLL_US		20000
 
 #define __func__		__FUNCTION__
 
-struct resp {
-	char			type0;
-	unsigned int		arg0;
-	char			type1;
-	unsigned int		arg1;
-	unsigned int		arg1_precision;
-};
-
-struct node_alias {
-	int			nodeid;
-	char			nodename[BUFLEN];
-	struct node_alias	*next;
-};
+static char *rc_port = NULL, rc_port_buf[BUFLEN];
+static int rc_wait = 0;
+static int rc_update = UPDATE_ALWAYS;
+static char *rc_store = NULL, rc_store_buf[BUFLEN];
+static int rc_store_recs = STORE_DEFAULT_RECORDS;
+static char *rc_state = NULL, rc_state_buf[BUFLEN];
+static char *rc_events = NULL, rc_events_buf[BUFLEN];
+static int rc_events_slots = EVRING_DEFAULT_SLOTS;
 
-static struct node_alias *alias_head = NULL, *alias_tail = NULL;
-static char *rc_port = NULL;
+static struct vrctl_stats *g_stats = NULL;
+static char g_stats_path[RC_LINELEN];
+static char *g_stats_dev;
 
-typedef int (*cmd_handler_t)(int devfd, int nodeid, char *arg);
+typedef void (*cmd_parse_t)(struct vrctl_op *op, char **args);
+typedef void (*cmd_report_t)(struct vrctl_op *op);
+typedef int (*cmd_group_t)(struct vrctl_conn *v, struct vrctl_op *ops,
+	int n);
 
 struct vrctl_cmd {
 	char			*name;
-	int			arg_required;
+	int			arg_required;	/* how many */
 	int			is_unicast;
-	cmd_handler_t		handler;
+	int			cmd;		/* VRCTL_CMD_* */
+	cmd_parse_t		parse;
+	cmd_report_t		report;
+	cmd_group_t		group;		/* for groups; allows "all" */
 };
 
 /*
  * RC FILE
  */
 
-/* check the alias list - next case-insensitive match wins */
-static struct node_alias *lookup_next_alias(char *nodename,
-	struct node_alias *start)
+/* "always", "never", or a max age in seconds; returns -1 if invalid */
+static int parse_update_policy(char *str, int *policy)
 {
-	struct node_alias *a = start ? start->next : alias_head;
+	char *endp;
+	long val;
 
-	for (; a != NULL; a = a->next)
-		if (strcasecmp(a->nodename, nodename) == 0) {
-			info(L_DEBUG, "%s: '%s' => node %lu\n", __func__,
-				nodename, a->nodeid);
-			return a;
-		}
-	return NULL;
+	if (strcasecmp(str, "always") == 0) {
+		*policy = UPDATE_ALWAYS;
+		return 0;
+	}
+	if (strcasecmp(str, "never") == 0) {
+		*policy = UPDATE_NEVER;
+		return 0;
+	}
+	val = strtol(str, &endp, 10);
+	if (*str == 0 || *endp != 0 || val < 0)
+		return -1;
+	*policy = val;
+	return 0;
 }
 
-/* scan the alias list for a nodeid; first match wins */
-static const char *nodeid_to_nodename(int nodeid)
+/* node names, groups and expressions; "all" is handled by the callers */
+static int resolve_nodename(const char *nodename, struct nodeset *set)
 {
-	struct node_alias *a = alias_head;
-
-	for (; a != NULL; a = a->next)
-		if (nodeid == a->nodeid)
-			return a->nodename;
-	return NULL;
+	return alias_eval(nodename, set);
 }
 
 static void parse_rcline(char *filename, int linenum, char *line)
@@ -110,56 +133,55 @@ static void parse_rcline(char *filename, int linenum, char *line)
 	if (tok[0] == '#')
 		return;		/* comment */
 
-	if (strcasecmp(tok, "alias") == 0) {
-		struct node_alias *a, *chain;
-		unsigned long nodeid;
-		char *endp;
-
-		a = malloc(sizeof(*a));
-		if (!a)
-			die("out of memory\n");
-		a->next = NULL;
+	if (strcasecmp(tok, "alias") == 0 || strcasecmp(tok, "group") == 0 ||
+	    strcasecmp(tok, "room") == 0) {
+		int is_group = strcasecmp(tok, "alias") != 0;
+		struct nodeset set;
+		char *end;
 
 		if (next_token(&p, tok, BUFLEN) < 0) {
 			info(L_WARNING, "%s:%d: missing node name\n",
 				filename, linenum);
-			free(a);
 			return;
 		}
-		strncpy(a->nodename, tok, BUFLEN);
+		if (*p && !isspace(*p)) {
+			/* next_token() stopped short */
+			info(L_WARNING, "%s:%d: name '%s...' is too long\n",
+				filename, linenum, tok);
+			return;
+		}
 
-		if (next_token(&p, tok, BUFLEN) < 0) {
+		/*
+		 * The rest of the line: node numbers and/or earlier names,
+		 * optionally followed by a comment.
+		 */
+		end = strchr(p, '#');
+		if (end)
+			*end = 0;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		for (end = p + strlen(p); end > p && isspace(end[-1]); end--)
+			;
+		*end = 0;
+		if (!*p) {
 			info(L_WARNING, "%s:%d: missing node number\n",
 				filename, linenum);
-			free(a);
 			return;
 		}
-
-		/* it is legal to refer to a previously defined alias */
-		chain = lookup_next_alias(tok, NULL);
-		if (chain)
-			nodeid = chain->nodeid;
-		else {
-			nodeid = strtoul(tok, &endp, 10);
-			if (tok[0] == 0 || *endp != 0 || nodeid > MAX_NODEID) {
-				info(L_WARNING, "%s:%d: invalid node number\n",
-					filename, linenum);
-				free(a);
-				return;
-			}
+		if (alias_eval(p, &set) < 0) {
+			info(L_WARNING, "%s:%d: invalid node expression '%s'\n",
+				filename, linenum, p);
+			return;
+		}
+		if (alias_define(tok, &set, is_group) < 0) {
+			info(L_WARNING, "%s:%d: name '%s' is too long\n",
+				filename, linenum, tok);
+			return;
 		}
-		a->nodeid = nodeid;
 
 		/* note: g_loglevel is probably not set yet */
-		info(L_DEBUG, "%s: adding alias '%s' for nodeid %d\n",
-			__func__, a->nodename, a->nodeid);
-
-		if (alias_tail != NULL) {
-			alias_tail->next = a;
-			alias_tail = a;
-		} else {
-			alias_head = alias_tail = a;
-		}
+		info(L_DEBUG, "%s: '%s' now has %d node(s)\n", __func__,
+			tok, ns_count(alias_lookup(tok)));
 		return;
 	}
 
@@ -169,7 +191,92 @@ static void parse_rcline(char *filename, int linenum, char *line)
 				filename, linenum);
 			return;
 		}
-		rc_port = strdup(tok);
+		rc_port = strcpy(rc_port_buf, tok);
+		return;
+	}
+
+	if (strcasecmp(tok, "update") == 0) {
+		if (next_token(&p, tok, BUFLEN) < 0 ||
+		    parse_update_policy(tok, &rc_update) < 0)
+			info(L_WARNING, "%s:%d: invalid update policy\n",
+				filename, linenum);
+		return;
+	}
+
+	if (strcasecmp(tok, "store") == 0) {
+		char *endp;
+
+		if (next_token(&p, tok, BUFLEN) < 0) {
+			info(L_WARNING, "%s:%d: missing store file name\n",
+				filename, linenum);
+			return;
+		}
+		rc_store = strcpy(rc_store_buf, tok);
+		if (next_token(&p, tok, BUFLEN) < 0)
+			return;
+		rc_store_recs = strtol(tok, &endp, 10);
+		if (*endp != 0 || rc_store_recs <= 0) {
+			info(L_WARNING, "%s:%d: invalid store size\n",
+				filename, linenum);
+			rc_store_recs = STORE_DEFAULT_RECORDS;
+		}
+		return;
+	}
+
+	if (strcasecmp(tok, "state") == 0) {
+		if (next_token(&p, tok, BUFLEN) < 0) {
+			info(L_WARNING, "%s:%d: missing state file name\n",
+				filename, linenum);
+			return;
+		}
+		rc_state = strcpy(rc_state_buf, tok);
+		return;
+	}
+
+	if (strcasecmp(tok, "events") == 0) {
+		char *endp;
+
+		if (next_token(&p, tok, BUFLEN) < 0) {
+			info(L_WARNING, "%s:%d: missing event file name\n",
+				filename, linenum);
+			return;
+		}
+		rc_events = strcpy(rc_events_buf, tok);
+		if (next_token(&p, tok, BUFLEN) < 0)
+			return;
+		rc_events_slots = strtol(tok, &endp, 10);
+		if (*endp != 0 || rc_events_slots < 16) {
+			info(L_WARNING, "%s:%d: invalid event ring size\n",
+				filename, linenum);
+			rc_events_slots = EVRING_DEFAULT_SLOTS;
+		}
+		return;
+	}
+
+	if (strcasecmp(tok, "when") == 0) {
+		rule_add(filename, linenum, p);
+		return;
+	}
+
+	if (strcasecmp(tok, "at") == 0) {
+		sched_add(filename, linenum, p);
+		return;
+	}
+
+	if (strcasecmp(tok, "wait") == 0) {
+		char *endp;
+
+		if (next_token(&p, tok, BUFLEN) < 0) {
+			info(L_WARNING, "%s:%d: missing wait time\n",
+				filename, linenum);
+			return;
+		}
+		rc_wait = strtol(tok, &endp, 10);
+		if (*endp != 0) {
+			info(L_WARNING, "%s:%d: invalid wait time\n",
+				filename, linenum);
+			rc_wait = 0;
+		}
 		return;
 	}
 
@@ -180,7 +287,7 @@ static void parse_rcline(char *filename, int linenum, char *line)
 static void read_rcfile(void)
 {
 	FILE *f;
-	char filename[BUFLEN], buf[BUFLEN];
+	char filename[BUFLEN], buf[RC_LINELEN];
 	char *homedir;
 	int linenum = 1;
 
@@ -197,7 +304,7 @@ static void read_rcfile(void)
 	if (f == NULL)
 		return;
 
-	while (fgets(buf, BUFLEN, f) != NULL)
+	while (fgets(buf, RC_LINELEN, f) != NULL)
 		parse_rcline(filename, linenum++, buf);
 
 	if (ferror(f))
@@ -210,15 +317,18 @@ static void read_rcfile(void)
  * VRC0P COMMANDS
  */
 
-static int read_resp(int devfd, char *buf, int maxlen, int timeout_us)
+static int read_resp(struct vrctl_port *port, char *buf, int maxlen,
+	int timeout_us)
 {
 	int ret;
-	ret = read_line(devfd, buf, maxlen, timeout_us);
+	ret = read_line(port, buf, maxlen, timeout_us);
 
 	if (ret == -ENOSPC)
 		die("error: input overflow from VRC0P\n");
 	if (ret == -ETIMEDOUT)
 		die("error: timeout waiting for command response\n");
+	if (ret < 0)
+		die("EOF or read error on tty\n");
 	return ret;
 }
 
@@ -238,409 +348,384 @@ static int parse_uint(char *str, int maxlen, char *name, int maxval)
 	return ret;
 }
 
-static void parse_temp(char *buf, struct resp *r)
-{
-	int fmt = parse_uint(&buf[0], 3, "temp format", 0);
-	int bytes = fmt & 0x07;
-
-	r->type1 = (fmt & 0x18) ? 'F' : 'C';
-	r->arg1_precision = (fmt >> 5) & 0x07;
-
-	if (!bytes || bytes > 2 || strlen(buf) < 3 + bytes*4)
-		die("error: malformed temp response: %s\n", buf);
+/*
+ * USER COMMANDS
+ *
+ * Every addressed node gets one library operation.  parse() fills in the
+ * operation's argument before anything is sent, and report() prints and
+ * records the result once it has succeeded.
+ */
 
-	if (bytes == 1) {
-		r->arg1 = parse_uint(&buf[4], 3, "temp", 0);
-	} else {
-		r->arg1 = (parse_uint(&buf[4], 3, "temp", 0) << 8) |
-			  (parse_uint(&buf[8], 3, "temp", 0) << 0);
-	}
+static void parse_level(struct vrctl_op *op, char **args)
+{
+	op->arg = parse_uint(args[0], 0, "brightness level", 255);
 }
 
-static int parse_resp(char *buf, struct resp *r)
+static void parse_scene(struct vrctl_op *op, char **args)
 {
-	/*
-	 * Some valid inputs look like:
-	 * <E001
-	 * <X000
-	 * <N003L000 (light level)
-	 * <N004:049,005,001,009,075 (temp sensor report)
-	 *
-	 * Numbers are in decimal notation, typically 0-255.
-	 */
-
-	if (buf[0] != '<')
-		return -1;
-	if (buf[1] < 'A' || buf[1] > 'Z')
-		return -1;
-
-	r->type0 = buf[1];
-	r->arg0 = parse_uint(&buf[2], 3, "arg0", 0);
-
-	if (buf[5] == 0) {
-		r->type1 = 0;
-		return 0;
-	}
-
-	if (!strncmp(&buf[5], ":049,005,001,", 13) ||
-	    !strncmp(&buf[5], ":067,003,001,", 13) ||
-	    !strncmp(&buf[5], ":067,003,002,", 13)) {
-		/* parse temperature sensor result */
-		parse_temp(&buf[18], r);
-	} else if (!strncmp(&buf[5], ":064,003,", 9)) {
-		/* parse thermostat mode */
-		r->arg1 = parse_uint(&buf[14], 3, "thermostat mode", 0);
-	} else {
-		/* parse other result types (typically light level) */
-		r->type1 = buf[5];
-		r->arg1 = parse_uint(&buf[6], 3, "arg1", 0);
-	}
-
-	return 0;
+	op->arg = parse_uint(args[0], 0, "scene number", MAX_NODEID);
 }
 
-static void wait_resp(int devfd, char expected_type, struct resp *r)
+static void parse_fan(struct vrctl_op *op, char **args)
 {
-	char buf[BUFLEN];
-
-	do {
-		read_resp(devfd, buf, BUFLEN, TIMEOUT);
-		if (parse_resp(buf, r) < 0)
-			die("error: received bad response '%s'\n", buf);
-
-		if (r->type0 == 'E' && r->arg0 != 0)
-			die("error: received E%03d while waiting for "
-				"'%c' response\n", r->arg0, expected_type);
-	} while (r->type0 != expected_type);
+	op->arg = parse_uint(args[0], 0, "fan enable", 1);
 }
 
-static int send_then_recv(int devfd, char expected_type, char *fmt, ...)
+static void parse_report(struct vrctl_op *op, char **args)
 {
-	va_list ap;
-	char buf[BUFLEN];
-	struct resp r;
-
-	va_start(ap, fmt);
-	vsnprintf(buf, BUFLEN, fmt, ap);
-	va_end(ap);
-
-	write_line(devfd, buf);
-	wait_resp(devfd, expected_type, &r);
-	return r.arg0;
+	op->arg = parse_uint(args[0], 0, "node ID", MAX_NODEID);
 }
 
-static void sync_interface(int devfd)
+/* <level> <ms> */
+static void parse_fade(struct vrctl_op *op, char **args)
 {
-	char buf[BUFLEN];
-	int i, ret;
-
-	usleep(25000);
-	flush_bytes(devfd);
-	/* hit "enter" on the serial line until we get <E000 back */
-	for (i = 0; i < 3; i++) {
-		write_line(devfd, "");
+	op->arg = parse_uint(args[0], 0, "brightness level", 255);
+	op->time_ms = parse_uint(args[1], 0, "fade time", MAX_FADE_MS);
+}
 
-		ret = read_line(devfd, buf, BUFLEN, TIMEOUT);
+/* "70", "21c"; 0 turns the heater and A/C off */
+static void parse_setpoint(struct vrctl_op *op, char **args)
+{
+	char *arg = args[0];
 
-		if (ret > 0 && strcmp(buf, "<E000") == 0)
-			return;
-		sleep(1);
-	}
-	die("error: can't establish communication with VRC0P interface\n");
+	op->arg = parse_uint(arg, 2, "setpoint", 99);
+	op->units = 'F';
+	if (strlen(arg) >= 3 && tolower(arg[2]) == 'c')
+		op->units = 'C';
 }
 
-static void update_nodes(int devfd)
+static void report_status(struct vrctl_op *op)
 {
-	send_then_recv(devfd, 'E', ">UP");
+	info(L_NORMAL, "%03d\n", op->ret);
+	store_add(op->nodeid, ST_LEVEL, op->ret, 0, 0);
 }
 
-/*
- * USER COMMAND HANDLERS
- *
- * Unless otherwise specified, the return value will be:
- *
- *   0 - success
- *  <0 - Xnnn error code from the VRC0P (0-255)
- *  >0 - dim level (0-255 - handle_status() only)
- */
-
-static int handle_on(int devfd, int nodeid, char *arg)
+static void report_toggle(struct vrctl_op *op)
 {
-	int ret;
-
-	if (nodeid == NODEID_ALL)
-		ret = send_then_recv(devfd, 'X', ">N,ON");
-	else
-		ret = send_then_recv(devfd, 'X', ">N%03dON", nodeid);
-	if (ret != 0)
-		info(L_WARNING, "node %d returned X%03x for ON command\n",
-			nodeid, ret);
-	return -ret;
+	store_add(op->nodeid, ST_LEVEL, op->ret, 0, 0);
 }
 
-static int handle_off(int devfd, int nodeid, char *arg)
+static void print_temp(struct vrctl_temp *t)
 {
-	int ret;
+	int precision, i;
 
-	if (nodeid == NODEID_ALL)
-		ret = send_then_recv(devfd, 'X', ">N,OF");
-	else
-		ret = send_then_recv(devfd, 'X', ">N%03dOF", nodeid);
-	if (ret != 0)
-		info(L_WARNING, "node %d returned X%03x for OFF command\n",
-			nodeid, ret);
-	return -ret;
+	for (precision = 1, i = t->precision; i; i--)
+		precision *= 10;
+	info(L_NORMAL, "%d.%d%c\n",
+		t->value / precision, t->value % precision, t->units);
 }
 
-static int handle_bounce(int devfd, int nodeid, char *arg)
+static void report_temp(struct vrctl_op *op)
 {
-	int ret;
-
-	ret = handle_off(devfd, nodeid, arg);
-	if (ret != 0)
-		return ret;
-
-	usleep(500000);
-
-	return handle_on(devfd, nodeid, arg);
+	print_temp(&op->temp);
+	store_temp(op->nodeid, ST_TEMP, &op->temp);
 }
 
-static int handle_status_quiet(int devfd, int nodeid, char *arg)
+static void report_setpoint(struct vrctl_op *op)
 {
-	int ret;
-	struct resp r;
-
-	ret = send_then_recv(devfd, 'X', ">?N%03d", nodeid);
-	if (ret != 0) {
-		info(L_WARNING, "node %d returned X%03x for STATUS command\n",
-			nodeid, ret);
-		return -ret;
+	store_add(op->nodeid, ST_MODE, op->ret, 0, 0);
+	if (op->ret == VRCTL_MODE_OFF) {
+		info(L_NORMAL, "OFF\n");
+		return;
 	}
-
-	do {
-		wait_resp(devfd, 'N', &r);
-	} while (r.arg0 != nodeid || r.type1 != 'L');
-
-	return r.arg1;
+	print_temp(&op->temp);
+	store_temp(op->nodeid, ST_SETPOINT, &op->temp);
 }
 
-static int handle_status(int devfd, int nodeid, char *arg)
+/*
+ * Node-level failures (Xnnn) are reported and processing continues with
+ * the next command; anything else means we lost the VRC0P.
+ */
+static int check_op(struct vrctl_cmd *entry, struct vrctl_op *op)
 {
-	int ret = handle_status_quiet(devfd, nodeid, arg);
-	info(L_NORMAL, "%03d\n", ret);
-	return ret;
+	if (op->ret >= 0) {
+		if (entry->report)
+			entry->report(op);
+		return op->ret;
+	}
+	if (op->ret == -VRCTL_ENODE) {
+		info(L_WARNING, "%s\n", op->errmsg);
+		return op->ret;
+	}
+	die("error: %s\n", op->errmsg);
+	return op->ret;
 }
 
-static int handle_toggle(int devfd, int nodeid, char *arg)
+/*
+ * "all status" is a snapshot of the whole house, one line per switch or
+ * dimmer: "<node> <level> <name>".  A level that couldn't be read or a
+ * node without an alias shows up as "-", so every line has three fields.
+ */
+static void print_snapshot(struct vrctl_op *ops, int n)
 {
-	int ret;
+	const char *nodename;
+	char level[16];
+	int i;
 
-	ret = handle_status_quiet(devfd, nodeid, arg);
-	if (ret < 0)
-		return ret;
-	if (ret == 0)
-		return handle_on(devfd, nodeid, arg);
-	else
-		return handle_off(devfd, nodeid, arg);
+	/* one bad node shouldn't spoil the rest of the table */
+	for (i = 0; i < n; i++) {
+		struct vrctl_op *op = &ops[i];
+
+		if (op->ret >= 0) {
+			snprintf(level, sizeof(level), "%03d", op->ret);
+			store_add(op->nodeid, ST_LEVEL, op->ret, 0, 0);
+		} else if (op->ret == -VRCTL_ENODE) {
+			info(L_WARNING, "%s\n", op->errmsg);
+			snprintf(level, sizeof(level), "-");
+		} else {
+			info(L_WARNING, "node %d: %s\n", op->nodeid,
+				op->errmsg);
+			snprintf(level, sizeof(level), "-");
+		}
+		nodename = alias_name(op->nodeid);
+		info(L_NORMAL, "%03d %s %s\n", op->nodeid, level,
+			nodename ? nodename : "-");
+	}
 }
 
-static int handle_level(int devfd, int nodeid, char *arg)
+static void print_node(const char *prefix, int nodeid,
+	const struct vrctl_node *n, const char *suffix)
 {
-	int ret;
-	int level = parse_uint(arg, 0, "brightness level", 255);
+	const char *nodename = alias_name(nodeid);
+	char name[BUFLEN];
 
-	if (nodeid == NODEID_ALL)
-		ret = send_then_recv(devfd, 'X', ">N,L%03d", level);
+	if (nodename)
+		snprintf(name, BUFLEN, "'%s'", nodename);
 	else
-		ret = send_then_recv(devfd, 'X', ">N%03dL%03d", nodeid, level);
-	if (ret != 0)
-		info(L_WARNING, "node %d returned X%03x for LEVEL command\n",
-			nodeid, ret);
-	return ret;
+		snprintf(name, BUFLEN, "unnamed");
+	info(L_NORMAL, "%s%03d (%s): %s (generic class %d, instance %d)%s\n",
+		prefix, nodeid, name, vrctl_class_name(n->gen_class),
+		n->gen_class, n->instance, suffix);
 }
 
-static int handle_lock_level(int devfd, int nodeid, int level)
+static void print_changes(const struct vrctl_netinfo *prev,
+	const struct vrctl_netinfo *ni)
 {
-	int ret;
+	const struct vrctl_node *old, *new;
+	char suffix[BUFLEN];
+	int i;
 
-	ret = send_then_recv(devfd, 'X', ">N%03dSS98,1,%d", nodeid, level);
-	if (ret != 0)
-		info(L_WARNING, "node %d returned X%03x for LOCK/UNLOCK "
-			"command\n", nodeid, ret);
-	return -ret;
+	for (i = 1; i <= MAX_NODEID; i++) {
+		old = &prev->node[i];
+		new = &ni->node[i];
+
+		if (!old->gen_class && new->gen_class) {
+			print_node("added: ", i, new, "");
+		} else if (old->gen_class && !new->gen_class) {
+			print_node("removed: ", i, old, "");
+		} else if (old->gen_class != new->gen_class) {
+			snprintf(suffix, BUFLEN, ", was %s",
+				vrctl_class_name(old->gen_class));
+			print_node("moved: ", i, new, suffix);
+		}
+	}
 }
 
-static int handle_lock(int devfd, int nodeid, char *arg)
+/*
+ * The previous scan is kept in $HOME/.vrctl_nodes so that a repeat
+ * --list only has to re-probe the classes that changed.
+ */
+static int nodes_path(char *path, int len)
 {
-	return handle_lock_level(devfd, nodeid, 255);
-}
+	char *homedir = getenv("HOME");
 
-static int handle_unlock(int devfd, int nodeid, char *arg)
-{
-	return handle_lock_level(devfd, nodeid, 0);
+	if (!homedir)
+		return -1;
+	snprintf(path, len, "%s/%s", homedir, NODES_NAME);
+	return 0;
 }
 
-static int handle_scene(int devfd, int nodeid, char *arg)
+static int handle_list(struct vrctl_conn *v, char *dev, int full)
 {
-	int ret;
-	int scene = parse_uint(arg, 0, "scene number", MAX_NODEID);
+	static struct vrctl_netinfo prev, ni;
+	char path[BUFLEN * 2];
+	int i, have_path, have_prev = 0;
 
-	if (nodeid == NODEID_ALL)
-		ret = send_then_recv(devfd, 'X', ">N,S%d", scene);
-	else
-		ret = send_then_recv(devfd, 'X', ">N%03dS%d", nodeid, scene);
-	if (ret != 0)
-		info(L_WARNING, "node %d returned X%03x for SCENE command\n",
-			nodeid, ret);
-	return -ret;
-}
+	have_path = nodes_path(path, sizeof(path)) == 0;
+	if (have_path)
+		have_prev = vrctl_netinfo_load(path, dev, &prev) == 0;
 
-static int handle_temp_common(int devfd, int nodeid, char *arg)
-{
-	struct resp r;
-	int precision;
+	if (vrctl_discover(v, have_prev ? &prev : NULL, &ni, full) < 0)
+		die("error: %s\n", vrctl_errmsg(v));
 
-	do {
-		wait_resp(devfd, 'N', &r);
-	} while (r.arg0 != nodeid || (r.type1 != 'F' && r.type1 != 'C'));
+	for (i = 1; i <= MAX_NODEID; i++)
+		if (ni.node[i].gen_class)
+			print_node("", i, &ni.node[i], "");
 
-	for (precision = 1; r.arg1_precision; r.arg1_precision--)
-		precision *= 10;
-	info(L_NORMAL, "%d.%d%c\n",
-		r.arg1 / precision, r.arg1 % precision, r.type1);
+	info(L_VERBOSE, "%d nodes, generation %u (%d probes)\n",
+		ni.n_nodes, ni.generation, ni.probes);
+
+	if (have_prev && ni.generation != prev.generation)
+		print_changes(&prev, &ni);
 
-	return r.arg1;
+	if (have_path && vrctl_netinfo_save(path, dev, &ni) < 0)
+		info(L_WARNING, "warning: can't write %s\n", path);
+	return 0;
 }
 
-static int handle_temp(int devfd, int nodeid, char *arg)
+/*
+ * Commands like toggle can't use the VRC0P's own "all nodes" frames, so
+ * "all" means every switch or dimmer from the last --list (which is run
+ * now if there isn't one yet).
+ */
+static void all_switches(struct vrctl_conn *v, char *dev, struct nodeset *set)
 {
-	int ret;
-
-	ret = send_then_recv(devfd, 'X', ">N%03dSE49,4", nodeid);
-	if (ret != 0) {
-		info(L_WARNING, "node %d returned X%03x for TEMP command\n",
-			nodeid, ret);
-		return -ret;
+	static struct vrctl_netinfo ni;
+	char path[BUFLEN * 2];
+	int i, have_path;
+
+	have_path = nodes_path(path, sizeof(path)) == 0;
+	if (!have_path || vrctl_netinfo_load(path, dev, &ni) < 0) {
+		if (vrctl_discover(v, NULL, &ni, 0) < 0)
+			die("error: %s\n", vrctl_errmsg(v));
+		if (have_path && vrctl_netinfo_save(path, dev, &ni) < 0)
+			info(L_WARNING, "warning: can't write %s\n", path);
 	}
 
-	return handle_temp_common(devfd, nodeid, arg);
+	for (i = 1; i <= MAX_NODEID; i++)
+		if (ni.node[i].caps & VRCTL_CAP_SWITCH)
+			ns_add(set, i);
 }
 
-static int handle_setpoint(int devfd, int nodeid, char *arg)
-{
-	int ret;
-	struct resp r;
-
-	/* get thermostat mode */
-	ret = send_then_recv(devfd, 'X', ">N%03dSE64,2", nodeid);
-	do {
-		wait_resp(devfd, 'N', &r);
-	} while (r.arg0 != nodeid);
-
-	if (r.arg1 == 0) {
-		info(L_NORMAL, "OFF\n");
-		return 0;
-	}
-
-	/* get setpoint temperature */
-	ret = send_then_recv(devfd, 'X', ">N%03dSE67,2,%d", nodeid, r.arg1);
-	if (ret != 0) {
-		info(L_WARNING, "node %d returned X%03x for SETPOINT command\n",
-			nodeid, ret);
-		return -ret;
-	}
+/*
+ * LINK HEALTH
+ *
+ * Every command's frames are counted in $HOME/.vrctl_health.  The table is
+ * written back on the way out, and also from an atexit() handler so that
+ * commands which end in die() (e.g. a node that stopped answering) are
+ * counted too.
+ */
 
-	return handle_temp_common(devfd, nodeid, arg);
+static void save_stats(void)
+{
+	if (g_stats && vrctl_stats_save(g_stats, g_stats_path,
+					g_stats_dev) < 0)
+		info(L_WARNING, "warning: can't write %s\n", g_stats_path);
 }
 
-static int handle_fan(int devfd, int nodeid, char *arg)
+static int stats_path(char *dev)
 {
-	int ret;
-	int enable = parse_uint(arg, 0, "fan enable", 1);
+	char *homedir = getenv("HOME");
 
-	ret = send_then_recv(devfd, 'X', ">N%03dSE68,1,%d", nodeid, enable);
-	if (ret != 0)
-		info(L_WARNING, "node %d returned X%03x for FAN command\n",
-			nodeid, ret);
-	return ret;
+	if (!homedir)
+		return -1;
+	snprintf(g_stats_path, sizeof(g_stats_path), "%s/%s", homedir,
+		HEALTH_NAME);
+	g_stats_dev = dev;
+	return 0;
 }
 
-static int handle_heat_common(int devfd, int nodeid, char *arg, int mode)
+static void open_stats(struct vrctl_conn *v, char *dev)
 {
-	int setpoint = parse_uint(arg, 2, "setpoint", 99);
-	int units = 1, ret;
+	if (stats_path(dev) < 0)
+		return;
+	g_stats = vrctl_stats_load(g_stats_path, dev);
+	if (!g_stats)
+		return;
+	vrctl_set_stats(v, g_stats);
+	atexit(save_stats);
+}
 
-	if (strlen(arg) >= 3 && tolower(arg[2]) == 'c')
-		units = 0;
+/* write the table back while the port is still locked */
+static void close_stats(struct vrctl_conn *v)
+{
+	save_stats();
+	vrctl_set_stats(v, NULL);
+	vrctl_stats_free(g_stats);
+	g_stats = NULL;
+}
 
-	if (setpoint) {
-		if (units)
-			ret = send_then_recv(devfd, 'X', ">N%03dSE67,1,%d,9,%d",
-					     nodeid, mode, setpoint);
-		else
-			ret = send_then_recv(devfd, 'X', ">N%03dSE67,1,%d,17,%d",
-					     nodeid, mode, setpoint);
-		if (ret != 0) {
-			info(L_WARNING,
-				"node %d returned X%03x for SETPOINT command\n",
-				nodeid, ret);
-			return -ret;
-		}
-	} else {
-		mode = 0;
-	}
+struct health {
+	int			nodeid;
+	unsigned int		fail_pct10;	/* failure rate, 0.1% units */
+	unsigned int		p90;
+	struct vrctl_link_stats	ls;
+};
 
-	ret = send_then_recv(devfd, 'X', ">N%03dSE64,1,%d", nodeid, mode);
-	if (ret != 0) {
-		info(L_WARNING, "node %d returned X%03x for MODE command\n",
-			nodeid, ret);
-		return -ret;
-	}
+/* worst first: highest failure rate, then slowest */
+static int cmp_health(const void *a, const void *b)
+{
+	const struct health *ha = a, *hb = b;
 
-	return 0;
+	if (ha->fail_pct10 != hb->fail_pct10)
+		return ha->fail_pct10 < hb->fail_pct10 ? 1 : -1;
+	if (ha->p90 != hb->p90)
+		return ha->p90 < hb->p90 ? 1 : -1;
+	return ha->nodeid - hb->nodeid;
 }
 
-static int handle_heat(int devfd, int nodeid, char *arg)
+static void fmt_rtt(char *buf, const struct vrctl_link_stats *ls, int pct)
 {
-	return handle_heat_common(devfd, nodeid, arg, 1);
+	unsigned int ms = vrctl_stats_rtt_ms(ls, pct);
+
+	if (ms)
+		snprintf(buf, BUFLEN, "%ums", ms);
+	else
+		snprintf(buf, BUFLEN, "-");
 }
 
-static int handle_cool(int devfd, int nodeid, char *arg)
+static void print_health(const char *label, const char *name,
+	const struct vrctl_link_stats *ls)
 {
-	return handle_heat_common(devfd, nodeid, arg, 2);
+	unsigned int fails = ls->attempts - ls->successes;
+	char p50[BUFLEN], p90[BUFLEN], p99[BUFLEN], xerr[BUFLEN] = "";
+
+	fmt_rtt(p50, ls, 50);
+	fmt_rtt(p90, ls, 90);
+	fmt_rtt(p99, ls, 99);
+	if (ls->xerrs)
+		snprintf(xerr, BUFLEN, " (last X%03x)", ls->last_x);
+	info(L_NORMAL, "%-5s %-12s %6u %5u.%u%% %5u %5u %7s %7s %7s%s\n",
+		label, name, ls->attempts, fails * 100 / ls->attempts,
+		fails * 1000 / ls->attempts % 10, ls->timeouts, ls->xerrs,
+		p50, p90, p99, xerr);
 }
 
-static void search_by_type(int devfd, int gen_class, char *class_name)
+static int handle_health(char *dev)
 {
-	int ret, i;
+	static struct health h[MAX_NODEID];
+	struct vrctl_link_stats ls;
+	struct vrctl_stats *st;
 	const char *nodename;
+	char label[BUFLEN];
+	int i, cmd, n = 0;
 
-	info(L_VERBOSE, "%s: searching for type %d (%s)\n", __func__,
-		gen_class, class_name);
+	if (stats_path(dev) < 0)
+		die("error: $HOME is not set\n");
+	st = vrctl_stats_load(g_stats_path, dev);
+	if (!st)
+		die("error: out of memory\n");
 
 	for (i = 1; i <= MAX_NODEID; i++) {
-		ret = send_then_recv(devfd, 'F', ">?FI0,%d,0,%d", gen_class, i);
-		if (ret <= 0)
-			break;
-
-		nodename = nodeid_to_nodename(ret);
-		if (nodename)
-			info(L_NORMAL, "%03d ('%s'): %s "
-				"(generic class %d, instance %d)\n",
-				ret, nodename, class_name, gen_class, i);
-		else
-			info(L_NORMAL, "%03d (unnamed): %s "
-				"(generic class %d, instance %d)\n",
-				ret, class_name, gen_class, i);
+		if (!vrctl_stats_get(st, i, -1, &h[n].ls))
+			continue;
+		h[n].nodeid = i;
+		h[n].fail_pct10 = (h[n].ls.attempts - h[n].ls.successes) *
+			1000 / h[n].ls.attempts;
+		h[n].p90 = vrctl_stats_rtt_ms(&h[n].ls, 90);
+		n++;
 	}
-}
+	if (!n) {
+		info(L_NORMAL, "no statistics recorded for %s\n", dev);
+		vrctl_stats_free(st);
+		return 0;
+	}
+	qsort(h, n, sizeof(h[0]), cmp_health);
 
-static int handle_list(int devfd)
-{
-	search_by_type(devfd, 16, "switch/appliance");
-	search_by_type(devfd, 17, "dimmer");
-	search_by_type(devfd, 8, "thermostat");
-	search_by_type(devfd, 1, "controller");
+	info(L_NORMAL, "%-5s %-12s %6s %8s %5s %5s %7s %7s %7s\n", "node",
+		"name", "tries", "fail", "tmo", "xerr", "p50", "p90", "p99");
+	for (i = 0; i < n; i++) {
+		nodename = alias_name(h[i].nodeid);
+		snprintf(label, BUFLEN, "%03d", h[i].nodeid);
+		print_health(label, nodename ? nodename : "", &h[i].ls);
+
+		if (g_loglevel < L_VERBOSE)
+			continue;
+		for (cmd = 0; cmd < VRCTL_CMD_MAX; cmd++)
+			if (vrctl_stats_get(st, h[i].nodeid, cmd, &ls))
+				print_health("", vrctl_cmd_name(cmd), &ls);
+	}
+	vrctl_stats_free(st);
 	return 0;
 }
 
@@ -658,51 +743,62 @@ static int handle_list(int devfd)
  * first or last block looks empty).
  */
 
-static int upgrade_zensys(int devfd, FILE *f)
+/* rebuild the original ":LLAAAATT...CC" line of block i */
+static void fw_format_line(const struct fw_image *img, int i, char *buf)
 {
-	char buf[BUFLEN];
-	int ret = 0;
+	const struct fw_block *b = &img->blk[i];
+	const uint8_t *data = fw_block_data(img, i);
+	uint8_t sum;
+	int j;
+
+	sum = b->len + (b->addr >> 8) + (b->addr & 0xff) + b->type;
+	buf += sprintf(buf, ":%02X%04X%02X", b->len, b->addr, b->type);
+	for (j = 0; j < b->len; j++) {
+		buf += sprintf(buf, "%02X", data[j]);
+		sum += data[j];
+	}
+	sprintf(buf, "%02X", (uint8_t)-sum);
+}
+
+static int upgrade_zensys(struct vrctl_conn *v, const struct fw_image *img)
+{
+	char buf[FW_LINELEN];
+	int i, ret = 0;
+	struct vrctl_port *port = vrctl_port(v);
 
 	info(L_NORMAL, "Zensys upgrade: syncing up with the target...\n");
 
-	sync_interface(devfd);
-	write_line(devfd, ">ZB");
+	if (vrctl_sync(v) < 0)
+		die("error: %s\n", vrctl_errmsg(v));
+	write_line(port, ">ZB");
 
 	/* ">ZB" generates three responses (and the last one takes a moment) */
-	read_resp(devfd, buf, BUFLEN, TIMEOUT);
+	read_resp(port, buf, BUFLEN, TIMEOUT);
 	if (strncmp(buf, "<E000", 5) != 0)
 		die("error: bad response '%s'\n", buf);
 
-	read_resp(devfd, buf, BUFLEN, TIMEOUT);
+	read_resp(port, buf, BUFLEN, TIMEOUT);
 	if (strncmp(buf, ":7F7F7F7F1F00", 13) != 0)
 		die("error: bad response '%s'\n", buf);
 
-	read_resp(devfd, buf, BUFLEN, TIMEOUT_UPGRADE);
+	read_resp(port, buf, BUFLEN, TIMEOUT_UPGRADE);
 	if (strncmp(buf, "<B000", 5) != 0)
 		die("error: bad response '%s'\n", buf);
 
 	info(L_NORMAL, "Programming...\n");
 
-	while (fgets(buf, BUFLEN, f) != NULL && buf[0] == ':') {
-		char *newline;
-
-		newline = index(buf, '\n');
-		if (*newline)
-			*newline = 0;
-
-		newline = index(buf, '\r');
-		if (*newline)
-			*newline = 0;
-
+	for (i = 0; i < img->hdr->n_blocks; i++) {
+		fw_format_line(img, i, buf);
 		info(L_DEBUG, "processing: '%s'\n", buf);
-		write_line(devfd, buf);
-		read_resp(devfd, buf, BUFLEN, TIMEOUT_UPGRADE);
+		if (write_line(port, buf) < 0)
+			die("error: can't send record %d to the VRC0P\n", i);
+		read_resp(port, buf, BUFLEN, TIMEOUT_UPGRADE);
 		if (strncmp(buf, "<E000", 5) != 0) {
 			info(L_WARNING, "unexpected response: '%s'\n", buf);
 			ret = 1;
 		}
 
-		read_resp(devfd, buf, BUFLEN, TIMEOUT_UPGRADE);
+		read_resp(port, buf, BUFLEN, TIMEOUT_UPGRADE);
 		if (strncmp(buf, "<B", 2) == 0)
 			continue;
 
@@ -718,102 +814,51 @@ static int upgrade_zensys(int devfd, FILE *f)
 	info(L_NORMAL, "Verifying... (or at least pretending to)\n");
 
 	while (buf[0] != ':')
-		read_resp(devfd, buf, BUFLEN, TIMEOUT_UPGRADE);
+		read_resp(port, buf, BUFLEN, TIMEOUT_UPGRADE);
 
 	do {
-		read_resp(devfd, buf, BUFLEN, TIMEOUT_UPGRADE);
+		read_resp(port, buf, BUFLEN, TIMEOUT_UPGRADE);
 	} while (strncmp(buf, "<B000", 5) != 0);
 
 	return ret;
 }
 
-static int st_getbytes(int devfd, char *buf, int len)
+static int st_getbytes(struct vrctl_port *port, char *buf, int len)
 {
-	fd_set s;
-	struct timeval tv;
-	int ret;
-
-	FD_ZERO(&s);
-	FD_SET(devfd, &s);
-
-	while (len) {
-		tv.tv_sec = TIMEOUT_UPGRADE / 1000000;
-		tv.tv_usec = TIMEOUT_UPGRADE % 1000000;
-		if (select(devfd + 1, &s, NULL, NULL, &tv) != 1)
-			return -1;
-
-		ret = read(devfd, buf, len);
-		if (ret <= 0)
-			return -1;
-		len -= ret;
-	}
-	return 0;
+	return read_bytes(port, buf, len, TIMEOUT_UPGRADE);
 }
 
-static void st_cmd(int devfd, const char *out, int outlen, int inlen)
+static void st_cmd(struct vrctl_port *port, const char *out, int outlen,
+	int inlen)
 {
 	char buf[BUFLEN];
 
-	write(devfd, out, outlen);
-	if (inlen && st_getbytes(devfd, buf, inlen) < 0)
+	port_write(port, out, outlen);
+	if (inlen && st_getbytes(port, buf, inlen) < 0)
 		die("error: target quit responding.  "
 			"Cycle power and try again.\n");
 }
 
-static void st_parsehex(unsigned char *out, char *in)
+static void st_termsetup(struct vrctl_port *port)
 {
-	if (*in >= 'A')
-		*out = (0x0a + *in - 'A') << 4;
-	else
-		*out = (0x00 + *in - '0') << 4;
-	in++;
-
-	if (*in >= 'A')
-		*out |= (0x0a + *in - 'A');
-	else
-		*out |= (0x00 + *in - '0');
-}
-
-static void st_xor(unsigned char *out, int len)
-{
-	int i;
-	unsigned char res = 0;
-
-	for (i = 0; i < len; i++)
-		res ^= out[i];
-	out[len] = res;
-}
-
-static void st_termsetup(int fd)
-{
-	struct termios termios;
-
-	if (tcgetattr(fd, &termios) != 0)
-		die("can't set termios\n");
-
 	/* 57600bps 8E1 */
-	termios.c_iflag = 0;
-	termios.c_oflag = 0;
-	termios.c_cflag = CS8 | CLOCAL | CREAD | PARENB;
-	termios.c_lflag = 0;
-	cfsetspeed(&termios, B57600);
-
-	if (tcsetattr(fd, TCSANOW, &termios) != 0)
+	if (port_set_speed(port, 57600, PARITY_EVEN) < 0)
 		die("can't set termios\n");
 }
 
-static int upgrade_st(int devfd, FILE *f)
+static int upgrade_st(struct vrctl_conn *v, const struct fw_image *img)
 {
 	char buf[BUFLEN];
 	int i, ret = 0;
+	struct vrctl_port *port = vrctl_port(v);
 
-	st_termsetup(devfd);
+	st_termsetup(port);
 
 	info(L_NORMAL, "ST upgrade: attempting to sync up with target...\n");
 	for (i = 0; ; i++) {
-		flush_bytes(devfd);
-		write(devfd, "\x7f", 1);
-		if (st_getbytes(devfd, buf, 1) == 0 && buf[0] == 0x79)
+		flush_bytes(port);
+		port_write(port, "\x7f", 1);
+		if (st_getbytes(port, buf, 1) == 0 && buf[0] == 0x79)
 			break;
 
 		/*
@@ -822,12 +867,12 @@ static int upgrade_st(int devfd, FILE *f)
 		 * normal mode if that does not work.
 		 */
 		if (i == 2) {
-			set_tty_defaults(devfd, 9600);
-			write_line(devfd, "");
-			write_line(devfd, ">CB");
+			port_set_speed(port, 9600, PARITY_NONE);
+			write_line(port, "");
+			write_line(port, ">CB");
 			usleep(20000);
-			flush_bytes(devfd);
-			st_termsetup(devfd);
+			flush_bytes(port);
+			st_termsetup(port);
 			usleep(20000);
 		}
 		if (i == 4)
@@ -837,85 +882,102 @@ static int upgrade_st(int devfd, FILE *f)
 
 	info(L_NORMAL, "Erasing...\n");
 
-	st_cmd(devfd, "\x01\xfe", 2, 5);
-	st_cmd(devfd, "\x02\xfd", 2, 5);
-	st_cmd(devfd, "\x43\xbc", 2, 1);
-	st_cmd(devfd, "\x3e\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b"
+	st_cmd(port, "\x01\xfe", 2, 5);
+	st_cmd(port, "\x02\xfd", 2, 5);
+	st_cmd(port, "\x43\xbc", 2, 1);
+	st_cmd(port, "\x3e\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b"
 		"\x0c\x0d\x0e\x0f\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19"
 		"\x1a\x1b\x1c\x1d\x1e\x1f\x20\x21\x22\x23\x24\x25\x26\x27"
 		"\x28\x29\x2a\x2b\x2c\x2d\x2e\x2f\x30\x31\x32\x33\x34\x35"
 		"\x36\x37\x38\x39\x3a\x3b\x3c\x3d\x3e\x3f\x3e", 65, 1);
 
 	info(L_NORMAL, "Programming...\n");
-	while (fgets(buf, BUFLEN, f) != NULL && buf[0] == ':') {
+	for (i = 0; i < img->hdr->n_blocks; i++) {
+		const struct fw_block *b = &img->blk[i];
 		unsigned char binbuf[18];
-		int len, j;
-		char *newline;
 
-		newline = index(buf, '\n');
-		if (*newline)
-			*newline = 0;
-
-		newline = index(buf, '\r');
-		if (*newline)
-			*newline = 0;
-
-		info(L_DEBUG, "processing: '%s'\n", buf);
-		if (buf[7] != '0' || buf[8] != '0')
+		if (b->type != FW_REC_DATA)
 			continue;
 
-		st_cmd(devfd, "\x31\xce", 2, 1);
-
-		/* set address */
-		memcpy(binbuf, "\x08\x00\x00\x00", 5);
-		st_parsehex(&binbuf[2], &buf[3]);
-		st_parsehex(&binbuf[3], &buf[5]);
-		st_xor(binbuf, 4);
-		st_cmd(devfd, (char *)binbuf, 5, 1);
-
-		len = strlen(buf);
-		/* each line needs to have 1-16 data bytes */
-		if (len < 13 || len > 43) {
-			info(L_WARNING, "warning: malformed line '%s'\n",
-				buf);
+		/* each write needs to have 1-16 data bytes */
+		if (b->len < 1 || b->len > 16) {
+			info(L_WARNING, "warning: skipping %d-byte block at "
+				"%04x\n", b->len, b->addr);
 			ret = 1;
 			continue;
 		}
-		len = (len - 11) >> 1;
+		info(L_DEBUG, "programming %d bytes at %04x\n", b->len,
+			b->addr);
 
-		binbuf[0] = len - 1;
-		for (j = 0; j < len; j++)
-			st_parsehex(&binbuf[j + 1], &buf[9 + j * 2]);
-		st_xor(binbuf, len + 1);
-		st_cmd(devfd, (char *)binbuf, len + 2, 1);
+		st_cmd(port, "\x31\xce", 2, 1);
+
+		/* set address */
+		memcpy(binbuf, "\x08\x00\x00\x00", 5);
+		binbuf[2] = b->addr >> 8;
+		binbuf[3] = b->addr & 0xff;
+		fw_st_checksum(binbuf, 4);
+		st_cmd(port, (char *)binbuf, 5, 1);
+
+		binbuf[0] = b->len - 1;
+		memcpy(&binbuf[1], fw_block_data(img, i), b->len);
+		fw_st_checksum(binbuf, b->len + 1);
+		st_cmd(port, (char *)binbuf, b->len + 2, 1);
 	}
 	info(L_NORMAL, "\n");
 
-	st_cmd(devfd, "\x21\xde", 2, 1);
-	st_cmd(devfd, "\x08\x00\x00\x00\x08", 5, 0);
+	st_cmd(port, "\x21\xde", 2, 1);
+	st_cmd(port, "\x08\x00\x00\x00\x08", 5, 0);
 
 	return ret;
 }
 
-static int handle_upgrade(int devfd, char *firmware)
+static void print_image(const char *path, const struct fw_image *img)
+{
+	const struct fw_segment *s;
+	int i;
+
+	info(L_VERBOSE, "%s: %s image, %u segment(s), %u blocks, %u bytes\n",
+		path, fw_target_name(img->hdr->target), img->hdr->n_segments,
+		img->hdr->n_blocks, img->hdr->data_len);
+	for (i = 0; i < img->hdr->n_segments; i++) {
+		s = &img->seg[i];
+		info(L_VERBOSE, "  %08x-%08x (%u blocks)\n", s->addr,
+			s->addr + s->len - 1, s->n_blocks);
+	}
+}
+
+/* .hex or packed container; everything is checked before the port opens */
+static void load_firmware(char *path, char *target, struct fw_image *img)
+{
+	int t = 0, i;
+
+	if (target && (t = fw_parse_target(target)) == 0)
+		die("error: unknown target '%s' (st or zensys)\n", target);
+	if (fw_load(path, t, img) < 0)
+		die("error: bad firmware image '%s'\n", path);
+	print_image(path, img);
+
+	/* Zensys records go over the serial link as they are */
+	for (i = 0; img->hdr->target == FW_TARGET_ZENSYS &&
+	     i < img->hdr->n_blocks; i++) {
+		if (11 + 2 * img->blk[i].len > PORT_MAX_LINE)
+			die("error: %s: record %d has %u data bytes; the "
+				"VRC0P takes at most %d per line\n", path, i,
+				img->blk[i].len, (PORT_MAX_LINE - 11) / 2);
+	}
+}
+
+static int handle_upgrade(struct vrctl_conn *v, const struct fw_image *img)
 {
-	FILE *f;
-	char buf[BUFLEN];
 	int ret;
 
-	f = fopen(firmware, "r");
-	if (f == NULL)
-		die("error: can't open '%s'\n", firmware);
-
-	if (fgets(buf, BUFLEN, f) == NULL || buf[0] != ':')
-		die("error: bad firmware image\n");
-	fseek(f, 0, SEEK_SET);
-	
-	if (buf[7] == '0' && buf[8] == '0')
-		ret = upgrade_zensys(devfd, f);
+	/* the VRC0P will need a full handshake after it reboots */
+	vrctl_forget_session(v);
+
+	if (img->hdr->target == FW_TARGET_ZENSYS)
+		ret = upgrade_zensys(v, img);
 	else
-		ret = upgrade_st(devfd, f);
-	fclose(f);
+		ret = upgrade_st(v, img);
 
 	if (ret == 0)
 		info(L_NORMAL, "Operation was successful.  "
@@ -930,47 +992,93 @@ static int handle_upgrade(int devfd, char *firmware)
  * UI
  */
 
-static int run_command(int devfd, char *nodename, struct vrctl_cmd *entry,
-	char *arg)
+static void init_op(struct vrctl_op *op, struct vrctl_cmd *entry,
+	int nodeid, char **args)
 {
-	int id, ret;
-	struct node_alias *a;
+	op->cmd = entry->cmd;
+	op->nodeid = nodeid;
+	if (entry->parse)
+		entry->parse(op, args);
+}
+
+ARENA_DEFINE(ops_arena, "ops", MAX_NODEID * sizeof(struct vrctl_op), 1);
 
-	/* "all" keyword */
-	if (strcasecmp(nodename, "all") == 0) {
+static int run_command(struct vrctl_conn *v, char *dev, char *nodename,
+	struct vrctl_cmd *entry, char **args)
+{
+	struct nodeset set;
+	struct vrctl_op *ops;
+	int id, i, n = 0, ret = 0, all;
+
+	ns_clear(&set);
+	all = strcasecmp(nodename, "all") == 0;
+	if (all && !entry->group) {
+		/* "all" keyword */
 		if (entry->is_unicast)
 			die("error: this command cannot operate on ALL nodes at once\n");
-		return entry->handler(devfd, NODEID_ALL, arg);
+	} else {
+		/* alias, group, node number, or an expression of them */
+		if (all)
+			all_switches(v, dev, &set);
+		else if (resolve_nodename(nodename, &set) < 0)
+			die("error: invalid node ID '%s'\n", nodename);
+		if (ns_count(&set) == 0) {
+			info(L_WARNING, "warning: '%s' does not contain any "
+				"nodes\n", nodename);
+			return 0;
+		}
 	}
 
-	/* single or multiple alias match */
-	a = lookup_next_alias(nodename, NULL);
-	if (a) {
-		while (1) {
-			/* note: return status only reflects the LAST command */
-			ret = entry->handler(devfd, a->nodeid, arg);
+	ops = arena_alloc_len(&ops_arena,
+		(ns_count(&set) ? ns_count(&set) : 1) * sizeof(*ops));
+	if (!ops)
+		die("error: out of memory\n");
+	if (!ns_count(&set))
+		init_op(&ops[n++], entry, NODEID_ALL, args);
+	ns_for_each(id, &set)
+		init_op(&ops[n++], entry, id, args);
 
-			a = lookup_next_alias(nodename, a);
-			if (a == NULL)
-				return ret;
-		}
+	/*
+	 * All nodes at once: their frames are pipelined and their delays
+	 * overlap, so bouncing a group is all off, one wait, all on.
+	 */
+	if (entry->group && n > 1)
+		entry->group(v, ops, n);
+	else
+		vrctl_run_ops(v, ops, n);
+
+	if (all && entry->cmd == VRCTL_CMD_STATUS) {
+		print_snapshot(ops, n);
+		arena_free(&ops_arena, ops);
+		return 0;
 	}
 
-	/* fall back to parsing it as an integer */
-	id = parse_uint(nodename, 0, "node ID", MAX_NODEID);
-	return entry->handler(devfd, id, arg);
+	/* note: return status only reflects the LAST command */
+	for (i = 0; i < n; i++)
+		ret = check_op(entry, &ops[i]);
+	arena_free(&ops_arena, ops);
+	return ret;
 }
 
 static const struct option longopts[] = {
 	{ "verbose",	no_argument,		NULL, 'v' },
 	{ "quiet",	no_argument,		NULL, 'q' },
 	{ "port",	required_argument,	NULL, 'x' },
+	{ "wait",	required_argument,	NULL, 'w' },
+	{ "update",	required_argument,	NULL, 'U' },
 	{ "list",	no_argument,		NULL, 'l' },
+	{ "rescan",	no_argument,		NULL, 'L' },
+	{ "server",	required_argument,	NULL, 's' },
+	{ "history",	no_argument,		NULL, 'H' },
+	{ "health",	no_argument,		NULL, 'Q' },
+	{ "state",	no_argument,		NULL, 'S' },
+	{ "events",	no_argument,		NULL, 'E' },
 	{ "upgrade",	required_argument,	NULL, 'u' },
+	{ "pack",	required_argument,	NULL, 'P' },
 	{ "help",	no_argument,		NULL, 'h' },
 	{ NULL,		0,			NULL,  0  },
 };
-static const char optstring[] = "vqx:lu:h";
+static const char optstring[] = "vqx:w:U:lLs:HQSEu:P:h";
 
 static void usage(void)
 {
@@ -980,15 +1088,34 @@ static void usage(void)
 	printf("\n");
 	printf("Usage:\n");
 	printf("  vrctl [<options>] <nodeid> <command> [ <nodeid> <command> ... ]\n");
-	printf("  vrctl [<options>] all { on | off }\n");
+	printf("  vrctl [<options>] all { on | off | toggle | status }\n");
 	printf("  vrctl [<options>] --list\n");
+	printf("  vrctl [<options>] --server=SOCKET\n");
+	printf("  vrctl [<options>] --history <nodeid> <type> [<secs> [<step>]]\n");
+	printf("  vrctl [<options>] --health\n");
+	printf("  vrctl [<options>] --state\n");
+	printf("  vrctl [<options>] --events\n");
+	printf("  vrctl [<options>] --upgrade=FILE [st | zensys]\n");
+	printf("  vrctl [<options>] --pack=OUT <file.hex> [st | zensys]\n");
 	printf("\n");
 	printf("Options:\n");
 	printf("  -v, --verbose       add v's to increase verbosity\n");
 	printf("  -q, --quiet         only display errors\n");
-	printf("  -x, --port=PORT     set port to use (default: " DEFAULT_DEV ")\n");
+	printf("  -x, --port=PORT     set port to use (default: " DEFAULT_DEV "), or\n");
+	printf("                      tcp:HOST:PORT for a serial bridge\n");
+	printf("  -w, --wait=SECS     wait in line for a locked port (-1: forever)\n");
+	printf("  -U, --update=WHEN   refresh the node list after commands: always,\n");
+	printf("                      never, or only if older than N seconds\n");
 	printf("  -l, --list          list all devices in the network\n");
-	printf("  -u, --upgrade=FILE  upgrade firmware from FILE\n");
+	printf("  -L, --rescan        like --list, but re-probe every node\n");
+	printf("  -s, --server=SOCKET accept commands from clients on a Unix socket\n");
+	printf("  -H, --history       print stored readings (level, temp, setpoint,\n");
+	printf("                      mode) averaged over <step> seconds\n");
+	printf("  -Q, --health        rank nodes by failure rate and latency\n");
+	printf("  -S, --state         print the server's latest node levels and temps\n");
+	printf("  -E, --events        follow the reports received by the server\n");
+	printf("  -u, --upgrade=FILE  upgrade firmware from FILE (.hex or --pack output)\n");
+	printf("  -P, --pack=OUT      convert a .hex file into a verified container\n");
 	printf("  -h, --help          this help\n");
 	printf("\n");
 	printf("<nodeid> is one of the following:\n");
@@ -1001,6 +1128,7 @@ static void usage(void)
 	printf("  bounce              turn the device off, then on again\n");
 	printf("  toggle              invert the device's on/off state\n");
 	printf("  level <n>           set brightness level\n");
+	printf("  fade <n> <ms>       move to brightness level over <ms> msec\n");
 	printf("  status              display the current on/off/dimmer status\n");
 	printf("  scene <n>           activate a previously stored scene\n");
 	printf("\n");
@@ -1015,35 +1143,206 @@ static void usage(void)
 	printf("  heat <n>            enable heater with setpoint N\n");
 	printf("  cool <n>            enable A/C with setpoint N\n");
 	printf("  heat 0              disable heater and A/C\n");
+	printf("\n");
+	printf("For thermostats and sensors:\n");
+	printf("  report <n>          send changes to node N (the VRC0P) unasked\n");
+	printf("  unreport <n>        stop sending them\n");
 	exit(1);
 }
 
 static struct vrctl_cmd cmd_table[] = {
-	{ "on",		0,	0,	handle_on },
-	{ "off",	0,	0,	handle_off },
-	{ "bounce",	0,	0,	handle_bounce },
-	{ "toggle",	0,	1,	handle_toggle },
-	{ "level",	1,	0,	handle_level },
-	{ "status",	0,	1,	handle_status },
-	{ "lock",	0,	1,	handle_lock },
-	{ "unlock",	0,	1,	handle_unlock },
-	{ "scene",	1,	0,	handle_scene },
-	{ "temp",	0,	1,	handle_temp },
-	{ "setpoint",	0,	1,	handle_setpoint },
-	{ "fan",	1,	1,	handle_fan },
-	{ "heat",	1,	1,	handle_heat },
-	{ "cool",	1,	1,	handle_cool },
+	{ "on",		0,	0,	VRCTL_CMD_ON,		NULL,		NULL },
+	{ "off",	0,	0,	VRCTL_CMD_OFF,		NULL,		NULL },
+	{ "bounce",	0,	0,	VRCTL_CMD_BOUNCE,	NULL,		NULL },
+	{ "toggle",	0,	1,	VRCTL_CMD_TOGGLE,	NULL,		report_toggle,
+		vrctl_toggle_group },
+	{ "level",	1,	0,	VRCTL_CMD_LEVEL,	parse_level,	NULL },
+	{ "fade",	2,	1,	VRCTL_CMD_FADE,		parse_fade,	NULL },
+	{ "status",	0,	1,	VRCTL_CMD_STATUS,	NULL,		report_status,
+		vrctl_run_ops },
+	{ "lock",	0,	1,	VRCTL_CMD_LOCK,		NULL,		NULL },
+	{ "unlock",	0,	1,	VRCTL_CMD_UNLOCK,	NULL,		NULL },
+	{ "scene",	1,	0,	VRCTL_CMD_SCENE,	parse_scene,	NULL },
+	{ "temp",	0,	1,	VRCTL_CMD_TEMP,		NULL,		report_temp },
+	{ "setpoint",	0,	1,	VRCTL_CMD_SETPOINT,	NULL,		report_setpoint },
+	{ "fan",	1,	1,	VRCTL_CMD_FAN,		parse_fan,	NULL },
+	{ "heat",	1,	1,	VRCTL_CMD_HEAT,		parse_setpoint,	NULL },
+	{ "cool",	1,	1,	VRCTL_CMD_COOL,		parse_setpoint,	NULL },
+	{ "report",	1,	1,	VRCTL_CMD_REPORT,	parse_report,	NULL },
+	{ "unreport",	1,	1,	VRCTL_CMD_UNREPORT,	parse_report,	NULL },
 };
 
+/*
+ * READING HISTORY
+ */
+
+static long parse_secs(char *str)
+{
+	char *endp;
+	long val = strtol(str, &endp, 10);
+
+	if (*str == 0 || *endp != 0 || val <= 0)
+		die("error: invalid time '%s'\n", str);
+	return val;
+}
+
+/* <nodeid> <type> [<seconds> [<step>]] */
+static int handle_history(int argc, char **argv)
+{
+	long now = time(NULL), secs = 86400, step = 3600;
+	struct nodeset set;
+	int nodeid;
+	char type;
+
+	if (argc < 2 || argc > 4)
+		usage();
+	if (!rc_store)
+		die("error: no store is configured in $HOME/%s\n", RC_NAME);
+
+	if (resolve_nodename(argv[0], &set) < 0 ||
+	    (nodeid = ns_next(&set, 0)) < 0)
+		die("error: invalid node ID '%s'\n", argv[0]);
+	type = store_parse_type(argv[1]);
+	if (!type)
+		die("error: unknown reading type '%s'\n", argv[1]);
+	if (argc >= 3)
+		secs = parse_secs(argv[2]);
+	if (argc >= 4)
+		step = parse_secs(argv[3]);
+
+	if (store_open(rc_store, 0, 1) < 0)
+		die("error: can't open %s: %s\n", rc_store, strerror(errno));
+	/* align the buckets so repeated queries line up */
+	if (store_query(nodeid, type, (now - secs) / step * step, now,
+			step) == 0)
+		info(L_VERBOSE, "no readings\n");
+	store_close();
+	return 0;
+}
+
+/*
+ * NODE STATE
+ */
+
+/* print the server's state table without touching the port */
+static int handle_state(void)
+{
+	static struct state_table t;
+	const struct state_table *map;
+	const struct state_node *n;
+	long now = time(NULL);
+	const char *nodename;
+	char temp[BUFLEN];
+	int i, ret, div;
+
+	if (!rc_state)
+		die("error: no state file is configured in $HOME/%s\n",
+			RC_NAME);
+	map = state_attach(rc_state);
+	if (!map)
+		die("error: can't open %s: %s\n", rc_state, strerror(errno));
+
+	ret = state_snapshot(map, &t);
+	if (ret < 0)
+		die("error: can't read %s\n", rc_state);
+	if (ret > 0 || (kill(t.pid, 0) < 0 && errno == ESRCH))
+		info(L_WARNING, "warning: the server is not running; "
+			"this data is stale\n");
+
+	printf("node  name          level     temp      seen\n");
+	for (i = 1; i <= MAX_NODEID; i++) {
+		n = &t.node[i];
+		if (!n->seen)
+			continue;
+		nodename = alias_name(i);
+
+		if (n->temp_units) {
+			for (div = 1, ret = n->temp_prec; ret; ret--)
+				div *= 10;
+			snprintf(temp, sizeof(temp), "%d.%d%c", n->temp / div,
+				n->temp % div, n->temp_units);
+		} else
+			strcpy(temp, "-");
+
+		printf("%03d   %-12s", i, nodename ? nodename : "-");
+		if (n->level >= 0)
+			printf(" %5d", n->level);
+		else
+			printf(" %5s", "-");
+		printf(" %8s", temp);
+		printf(" %8lds ago\n", now - (long)n->seen);
+	}
+	return 0;
+}
+
+/* follow the server's event ring until it stops */
+static int handle_events(void)
+{
+	struct evring ev;
+	struct evring_slot e;
+	uint64_t cursor;
+	int ret;
+
+	if (!rc_events)
+		die("error: no event file is configured in $HOME/%s\n",
+			RC_NAME);
+	if (evring_attach(&ev, rc_events) < 0)
+		die("error: can't open %s: %s\n", rc_events, strerror(errno));
+
+	cursor = evring_head(&ev);
+	while (ev.hdr->pid) {
+		ret = evring_get(&ev, &cursor, &e);
+		if (ret > 0) {
+			printf("%lld.%03lld %s\n", (long long)e.ts / 1000000,
+				(long long)e.ts / 1000 % 1000, e.line);
+			fflush(stdout);
+		} else if (ret < 0) {
+			info(L_WARNING, "warning: fell behind; some events "
+				"were lost\n");
+		} else {
+			usleep(EVENTS_POLL_US);
+		}
+	}
+	info(L_NORMAL, "the server has stopped\n");
+	return 0;
+}
+
+/*
+ * FIRMWARE PACKING
+ */
+
+/* <in.hex> [<target>] */
+static int handle_pack(char *out, int argc, char **argv)
+{
+	struct fw_image img;
+
+	if (argc < 1 || argc > 2)
+		usage();
+	load_firmware(argv[0], argc > 1 ? argv[1] : NULL, &img);
+	if (fw_save(&img, out) < 0)
+		die("error: can't write %s: %s\n", out, strerror(errno));
+	info(L_NORMAL, "wrote %s image to %s (%u bytes of data)\n",
+		fw_target_name(img.hdr->target), out, img.hdr->data_len);
+	fw_free(&img);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	int opt, do_list = 0, synced = 0, no_cmdlist = 0, ret = 0;
-	char *dev = DEFAULT_DEV, *firmware = NULL;
-	int devfd;
+	int opt, ret = 0, synced = 0, no_cmdlist = 0;
+	int do_list = 0, full_scan = 0, history = 0;
+	int health = 0, state = 0, events = 0;
+	char *dev = DEFAULT_DEV, *firmware = NULL, *sockpath = NULL, *endp;
+	char *pack = NULL;
+	struct fw_image img;
+	int lock_wait, update;
+	struct vrctl_conn *v;
 
 	read_rcfile();
 	if (rc_port != NULL)
 		dev = rc_port;
+	lock_wait = rc_wait;
+	update = rc_update;
 
 	while ((opt = getopt_long(argc, argv,
 			optstring, longopts, NULL)) != -1) {
@@ -1057,14 +1356,45 @@ int main(int argc, char **argv)
 		case 'x':
 			dev = optarg;
 			break;
+		case 'w':
+			lock_wait = strtol(optarg, &endp, 10);
+			if (*optarg == 0 || *endp != 0)
+				usage();
+			break;
+		case 'U':
+			if (parse_update_policy(optarg, &update) < 0)
+				usage();
+			break;
+		case 'L':
+			full_scan = 1;
+			/* fall through */
 		case 'l':
 			do_list = 1;
 			no_cmdlist = 1;
 			break;
+		case 's':
+			sockpath = optarg;
+			no_cmdlist = 1;
+			break;
+		case 'H':
+			history = 1;
+			break;
+		case 'Q':
+			health = 1;
+			break;
+		case 'S':
+			state = 1;
+			break;
+		case 'E':
+			events = 1;
+			break;
 		case 'u':
 			firmware = optarg;
 			no_cmdlist = 1;
 			break;
+		case 'P':
+			pack = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -1072,36 +1402,87 @@ int main(int argc, char **argv)
 
 	}
 
+	if (history)
+		return handle_history(argc - optind, &argv[optind]);
+	if (health) {
+		if (optind < argc)
+			usage();
+		return handle_health(dev);
+	}
+	if (state) {
+		if (optind < argc)
+			usage();
+		return handle_state();
+	}
+	if (events) {
+		if (optind < argc)
+			usage();
+		return handle_events();
+	}
+
+	if (pack)
+		return handle_pack(pack, argc - optind, &argv[optind]);
+
+	if (firmware) {
+		if (argc - optind > 1)
+			usage();
+		load_firmware(firmware, optind < argc ? argv[optind] : NULL,
+			&img);
+		optind = argc;
+	}
+
 	if (no_cmdlist ^ !!(optind >= argc))
 		usage();
 
-	if (lock_tty(dev, "vrctl") < 0)
-		die("error: %s is locked\n", dev);
+	v = vrctl_open_wait(dev,
+		lock_wait < 0 ? -1 : lock_wait * 1000, &ret);
+	if (!v) {
+		if (ret == -VRCTL_ELOCKED)
+			die("error: %s is locked\n", dev);
+		die("error: can't open %s: %s\n", dev, strerror(errno));
+	}
 	g_locked_tty = dev;
+	open_stats(v, dev);
+
+	if (rc_store && store_open(rc_store, rc_store_recs, 0) < 0)
+		info(L_WARNING, "warning: can't open %s: %s\n", rc_store,
+			strerror(errno));
 
-	devfd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
-	if (devfd < 0)
-		die("error: can't open %s: %s\n", dev, strerror(errno));
-	if (fcntl(devfd, F_SETFL, 0) < 0)
-		die("error: can't clear NONBLOCK flag: %s\n", strerror(errno));
-	if (set_tty_defaults(devfd, 9600) < 0)
-		die("error: can't set termios on %s: %s\n",
-			dev, strerror(errno));
-	
 	if (firmware) {
-		ret = handle_upgrade(devfd, firmware);
+		ret = handle_upgrade(v, &img);
+		fw_free(&img);
 		goto out;
 	}
 
 	if (do_list) {
-		ret = handle_list(devfd);
+		ret = handle_list(v, dev, full_scan);
+		goto out;
+	}
+
+	if (sockpath) {
+		if (vrctl_sync(v) < 0)
+			die("error: %s\n", vrctl_errmsg(v));
+		info(L_VERBOSE, "loaded %d rule(s)\n",
+			rules_resolve(resolve_nodename));
+		info(L_VERBOSE, "loaded %d scheduled action(s)\n",
+			sched_resolve(resolve_nodename));
+		sched_start(v);
+		if (rc_state && state_open(rc_state) < 0)
+			info(L_WARNING, "warning: can't open %s: %s\n",
+				rc_state, strerror(errno));
+		if (run_server(v, sockpath, resolve_nodename, rc_events,
+				rc_events_slots) < 0)
+			die("error: server on %s failed: %s\n", sockpath,
+				strerror(errno));
+		state_close();
+		arena_report(L_VERBOSE);
 		goto out;
 	}
 
 	while (optind < argc) {
 		int i;
 		struct vrctl_cmd *entry = NULL;
-		char *nodename, *command, *arg = NULL;
+		char *nodename, *command, **args;
 
 		nodename = argv[optind++];
 
@@ -1120,25 +1501,33 @@ int main(int argc, char **argv)
 		if (!entry)
 			die("error: bad command '%s'\n", command);
 
-		if (entry->arg_required) {
-			if (optind >= argc)
+		args = &argv[optind];
+		if (optind + entry->arg_required > argc) {
+			if (entry->arg_required == 1)
 				die("error: %s requires an argument\n",
 					command);
-			arg = argv[optind++];
+			die("error: %s requires %d arguments\n", command,
+				entry->arg_required);
 		}
+		optind += entry->arg_required;
 
 		if (!synced) {
-			sync_interface(devfd);
+			if (vrctl_sync(v) < 0)
+				die("error: %s\n", vrctl_errmsg(v));
 			synced = 1;
 		}
 
 		/* parse the nodeid(s) and execute the command */
-		run_command(devfd, nodename, entry, arg);
+		run_command(v, dev, nodename, entry, args);
 	}
 
-	update_nodes(devfd);
+	if (update != UPDATE_NEVER &&
+	    vrctl_update_nodes_deferred(v, update) < 0)
+		die("error: %s\n", vrctl_errmsg(v));
 
 out:
-	unlock_tty(dev);
+	store_close();
+	close_stats(v);
+	vrctl_close(v);
 	return ret;
 }
@@ -0,0 +1,95 @@
+/*
+ * libvrctl - internal definitions shared by the library sources
+ * Copyright 2012 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _VRCTL_INT_H_
+#define _VRCTL_INT_H_
+
+#include <stdarg.h>
+#include "libvrctl.h"
+#include "port.h"
+
+#define BUFLEN			VRCTL_FRAMELEN
+#define ERRLEN			VRCTL_ERRLEN
+#define TIMEOUT			3000000
+#define PATHLEN			256
+
+/* persisted in /var/lock/LCK..<dev>.state between invocations */
+struct session_state {
+	long long		last_active_us;
+	long long		last_update_us;
+	long long		cold_sync_us;
+	long long		update_us;
+};
+
+struct vrctl_conn {
+	struct vrctl_port	*port;
+	int			fd;		/* port->fd, for polling */
+	char			dev[PATHLEN];
+	int			locked;
+	int			last_code;
+	char			errmsg[ERRLEN];
+
+	int			in_sync;
+	struct session_state	state;
+
+	/* async engine (engine.c) */
+	struct vrctl_req	*txq_head[VRCTL_PRIO_MAX];
+	struct vrctl_req	*txq_tail[VRCTL_PRIO_MAX];
+	int			txq_skipped[VRCTL_PRIO_MAX];
+	int			sync_prio;	/* for the blocking calls */
+	struct vrctl_req	*sent_head, *sent_tail;
+	int			n_sent, window;
+	int			win_acked;	/* clean replies this round */
+	int			win_full;	/* was the window ever filled */
+	long long		srtt, rtt_min;
+	long long		drain_until;	/* resyncing; 0 = not */
+	int			drain_err;
+	char			rxbuf[BUFLEN];
+	int			rxlen, rx_overflow;
+	vrctl_report_cb		report_cb;
+	void			*report_arg;
+	struct vrctl_timer	*timers;
+	struct vrctl_op		*ramps;		/* fades (ramp.c) */
+	struct vrctl_timer	ramp_timer;
+
+	struct vrctl_stats	*stats;
+};
+
+/* libvrctl.c */
+int vrctl_parse_resp(char *buf, struct vrctl_resp *r);
+
+/* engine.c */
+void vrctl_req_vinit(struct vrctl_req *rq, char expect, int nodeid,
+	const char *report, const char *fmt, va_list ap);
+void engine_init(struct vrctl_conn *v);
+void engine_abort(struct vrctl_conn *v, int err);
+
+/* ops.c */
+void op_finish(struct vrctl_op *op, int ret);
+void op_send_level(struct vrctl_op *op, int level);
+
+/* ramp.c */
+void ramp_add(struct vrctl_conn *v, struct vrctl_op *op, int from);
+int ramp_step_done(struct vrctl_conn *v, struct vrctl_op *op);
+void ramp_del(struct vrctl_conn *v, struct vrctl_op *op);
+
+/* stats.c */
+void stats_record(struct vrctl_conn *v, int nodeid, int cmd,
+	const struct vrctl_req *rq);
+
+#endif /* _VRCTL_INT_H_ */